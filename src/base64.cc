@@ -80,9 +80,9 @@ inline static char* string_to_array( std::string* output ) {
 
 #define ENCODE_UNIT(B1,B2,B3,O,OFF) \
     do { \
-        const char b1 = B1; \
-        const char b2 = B2; \
-        const char b3 = B3; \
+        const unsigned char b1 = B1; \
+        const unsigned char b2 = B2; \
+        const unsigned char b3 = B3; \
         const int idx1 = (b1<<4) | (b2>>4); \
         const int idx2 = (b2<<2) | (b3>>6); \
         O[(OFF)] = kB64EncodeChar[b1>>2]; \
@@ -94,8 +94,8 @@ inline static char* string_to_array( std::string* output ) {
 
 #define FINALIZE_ENCODE1(B1,O,OFF) \
     do { \
-        const char b1 = B1; \
-        const char b2 = 0 ; \
+        const unsigned char b1 = B1; \
+        const unsigned char b2 = 0 ; \
         O[(OFF)] = kB64EncodeChar[b1>>2]; \
         O[1+(OFF)]=kB64EncodeChar[((b1&3)<<4) | (b2>>4)]; \
         O[2+(OFF)]='='; \
@@ -104,9 +104,9 @@ inline static char* string_to_array( std::string* output ) {
 
 #define FINALIZE_ENCODE2(B1,B2,O,OFF) \
     do { \
-        const char b1 = B1; \
-        const char b2 = B2; \
-        const char b3 = 0; \
+        const unsigned char b1 = B1; \
+        const unsigned char b2 = B2; \
+        const unsigned char b3 = 0; \
         O[(OFF)] = kB64EncodeChar[b1>>2]; \
         O[1+(OFF)]=kB64EncodeChar[((b1&3)<<4) | (b2>>4)]; \
         O[2+(OFF)]=kB64EncodeChar[((b2&15)<<2)| (b3>>6)]; \
@@ -351,6 +351,10 @@ void Base64Encode( const char* input , std::size_t length , std::string* output
     // Trying to align the memory of input to 4
     int bits = reinterpret_cast<intptr_t>(input) & 3;
     assert( length > 0 );
+    // Shifting 3 bytes needs them to be there
+    if( bits == 1 && length < 3 ) {
+        bits = 2;
+    }
     switch(bits) {
         case 0: {
             output->resize( ENCODE_SIZE(length) );
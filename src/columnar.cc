@@ -0,0 +1,401 @@
+#include "columnar.h"
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+
+namespace proto2json {
+using namespace google::protobuf;
+
+namespace {
+
+static const char kMagic[4] = { 'P','2','J','C' };
+static const uint32_t kVersion = 1;
+static const int kMaxLevel = 255;
+
+// A row group is also flushed once its column buffers hold this many bytes ,
+// so records with huge repeated fields still flush in bounded memory.
+static const std::size_t kRowGroupByteLimit = 64 * 1024 * 1024;
+
+inline void put_u32( std::string* buf , uint32_t v ) {
+    char b[4] = { static_cast<char>(v) , static_cast<char>(v>>8) ,
+                  static_cast<char>(v>>16) , static_cast<char>(v>>24) };
+    buf->append(b,4);
+}
+
+inline void put_u64( std::string* buf , uint64_t v ) {
+    put_u32(buf,static_cast<uint32_t>(v));
+    put_u32(buf,static_cast<uint32_t>(v>>32));
+}
+
+inline void put_str( std::string* buf , const std::string& str ) {
+    put_u32(buf,static_cast<uint32_t>(str.size()));
+    buf->append(str);
+}
+
+// Fixed width values are appended in little endian
+template< typename T >
+inline void put_fixed( std::string* buf , T v ) {
+    char b[sizeof(T)];
+    std::memcpy(b,&v,sizeof(T));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    std::reverse(b,b+sizeof(T));
+#endif
+    buf->append(b,sizeof(T));
+}
+
+}// namespace
+
+struct columnar_writer::column {
+    std::string path;
+    column_type type;
+    int max_rep;
+    int max_def;
+    std::string type_name;
+    const EnumDescriptor* enum_type;
+
+    std::string rep;         // Repetition level per entry
+    std::string def;         // Definition level per entry
+    std::string value;       // Fixed width values or variable length data
+    std::string offset;      // u32 offsets for variable length values
+    uint64_t value_count;
+
+    column():
+        path(), type(TYPE_BOOL), max_rep(0), max_def(0), type_name(),
+        enum_type(NULL), rep(), def(), value(), offset(), value_count(0)
+    {}
+
+    bool is_variable() const {
+        return type == TYPE_STRING || type == TYPE_BYTES || type == TYPE_MESSAGE;
+    }
+
+    std::size_t buffered() const {
+        return rep.size() + def.size() + value.size() + offset.size();
+    }
+
+    void add_level( int r , int d ) {
+        if( max_rep != 0 ) rep.push_back(static_cast<char>(r));
+        if( max_def != 0 ) def.push_back(static_cast<char>(d));
+    }
+
+    void add_variable( const std::string& v ) {
+        value.append(v);
+        put_u32(&offset,static_cast<uint32_t>(value.size()));
+        ++value_count;
+    }
+
+    void clear() {
+        rep.clear();
+        def.clear();
+        value.clear();
+        offset.clear();
+        value_count = 0;
+        if( is_variable() ) put_u32(&offset,0);
+    }
+};
+
+struct columnar_writer::node {
+    const FieldDescriptor* field; // NULL for the root
+    int rep;                      // Max repetition level of this node
+    int def;                      // Max definition level of this node
+    std::vector<node*> children;
+    column* leaf;                 // Non NULL for leaf node
+
+    node(): field(NULL), rep(0), def(0), children(), leaf(NULL) {}
+    ~node() {
+        for( std::size_t i = 0 ; i < children.size() ; ++i ) delete children[i];
+    }
+};
+
+columnar_writer::columnar_writer( std::ostream& output , std::size_t row_group_size ):
+    m_output(output),
+    m_row_group_size(row_group_size == 0 ? 1 : row_group_size),
+    m_offset(0),
+    m_row_count(0),
+    m_root(NULL),
+    m_column(),
+    m_row_group()
+{}
+
+columnar_writer::~columnar_writer() {
+    delete m_root;
+    for( std::size_t i = 0 ; i < m_column.size() ; ++i ) delete m_column[i];
+}
+
+bool columnar_writer::init( const Descriptor* descriptor ) {
+    m_root = new node();
+    std::vector<const Descriptor*> stack;
+    if( !build(m_root,descriptor,"",&stack) ) {
+        return false;
+    }
+    std::string header(kMagic,4);
+    put_u32(&header,kVersion);
+    write_bytes(header.data(),header.size());
+    return true;
+}
+
+bool columnar_writer::build( node* parent , const Descriptor* descriptor ,
+                             const std::string& path ,
+                             std::vector<const Descriptor*>* stack ) {
+    stack->push_back(descriptor);
+    for( int i = 0 ; i < descriptor->field_count() ; ++i ) {
+        const FieldDescriptor* field = descriptor->field(i);
+        node* n = new node();
+        parent->children.push_back(n);
+        n->field = field;
+        n->rep = parent->rep + (field->is_repeated() ? 1 : 0);
+        // Required field is always there , it does not need a level
+        n->def = parent->def + (field->is_required() ? 0 : 1);
+        if( field->is_repeated() == false && field->is_required() == false &&
+            field->has_presence() == false ) {
+            // Proto3 scalar without presence always has a value
+            n->def = parent->def;
+        }
+        if( n->rep > kMaxLevel || n->def > kMaxLevel ) {
+            return false;
+        }
+        const std::string name = path.empty() ? field->name() : path + "." + field->name();
+
+        if( field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE &&
+            std::find(stack->begin(),stack->end(),field->message_type()) == stack->end() ) {
+            if( !build(n,field->message_type(),name,stack) ) {
+                return false;
+            }
+            continue;
+        }
+
+        column* c = new column();
+        c->path = name;
+        c->max_rep = n->rep;
+        c->max_def = n->def;
+        switch( field->cpp_type() ) {
+            case FieldDescriptor::CPPTYPE_BOOL:   c->type = TYPE_BOOL; break;
+            case FieldDescriptor::CPPTYPE_INT32:  c->type = TYPE_INT32; break;
+            case FieldDescriptor::CPPTYPE_INT64:  c->type = TYPE_INT64; break;
+            case FieldDescriptor::CPPTYPE_UINT32: c->type = TYPE_UINT32; break;
+            case FieldDescriptor::CPPTYPE_UINT64: c->type = TYPE_UINT64; break;
+            case FieldDescriptor::CPPTYPE_FLOAT:  c->type = TYPE_FLOAT; break;
+            case FieldDescriptor::CPPTYPE_DOUBLE: c->type = TYPE_DOUBLE; break;
+            case FieldDescriptor::CPPTYPE_ENUM:
+                c->type = TYPE_ENUM;
+                c->enum_type = field->enum_type();
+                c->type_name = field->enum_type()->full_name();
+                break;
+            case FieldDescriptor::CPPTYPE_STRING:
+                c->type = field->type() == FieldDescriptor::TYPE_STRING ?
+                    TYPE_STRING : TYPE_BYTES;
+                break;
+            case FieldDescriptor::CPPTYPE_MESSAGE:
+                c->type = TYPE_MESSAGE;
+                c->type_name = field->message_type()->full_name();
+                break;
+            default:
+                assert(!"Unreachable");
+                break;
+        }
+        c->clear();
+        n->leaf = c;
+        m_column.push_back(c);
+    }
+    stack->pop_back();
+    return true;
+}
+
+void columnar_writer::append( const Message& message ) {
+    shred(message,*m_root,0,0);
+    ++m_row_count;
+
+    if( m_row_count >= m_row_group_size ) {
+        flush_row_group();
+        return;
+    }
+    std::size_t buffered = 0;
+    for( std::size_t i = 0 ; i < m_column.size() ; ++i ) {
+        buffered += m_column[i]->buffered();
+    }
+    if( buffered >= kRowGroupByteLimit ) {
+        flush_row_group();
+    }
+}
+
+void columnar_writer::shred( const Message& message , const node& parent ,
+                             int rep , int def ) {
+    for( std::size_t i = 0 ; i < parent.children.size() ; ++i ) {
+        shred_field(message,*parent.children[i],rep,def);
+    }
+}
+
+void columnar_writer::shred_field( const Message& message , const node& n ,
+                                   int rep , int def ) {
+    const Reflection* reflection = message.GetReflection();
+    const FieldDescriptor* field = n.field;
+
+    if( field->is_repeated() ) {
+        const int size = reflection->FieldSize(message,field);
+        if( size == 0 ) {
+            write_null(n,rep,def);
+            return;
+        }
+        for( int i = 0 ; i < size ; ++i ) {
+            // First element continues the enclosing repetition , the rest
+            // repeat at the level of this field.
+            const int r = i == 0 ? rep : n.rep;
+            if( n.leaf != NULL ) {
+                write_value(message,n,i,r);
+            } else {
+                shred(reflection->GetRepeatedMessage(message,field,i),n,r,n.def);
+            }
+        }
+        return;
+    }
+
+    if( n.def != def && !reflection->HasField(message,field) ) {
+        write_null(n,rep,def);
+        return;
+    }
+    if( n.leaf != NULL ) {
+        write_value(message,n,-1,rep);
+    } else {
+        shred(reflection->GetMessage(message,field),n,rep,n.def);
+    }
+}
+
+void columnar_writer::write_null( const node& n , int rep , int def ) {
+    if( n.leaf != NULL ) {
+        n.leaf->add_level(rep,def);
+        return;
+    }
+    for( std::size_t i = 0 ; i < n.children.size() ; ++i ) {
+        write_null(*n.children[i],rep,def);
+    }
+}
+
+void columnar_writer::write_value( const Message& message , const node& n ,
+                                   int index , int rep ) {
+    const Reflection* reflection = message.GetReflection();
+    const FieldDescriptor* field = n.field;
+    column* c = n.leaf;
+    c->add_level(rep,n.def);
+
+#define DO_(Type,type) \
+    do { \
+        type v = index < 0 ? reflection->Get##Type(message,field) : \
+                             reflection->GetRepeated##Type(message,field,index); \
+        put_fixed(&c->value,v); \
+        ++c->value_count; \
+    } while(0); break
+
+    switch( c->type ) {
+        case TYPE_BOOL:
+            {
+                const bool v = index < 0 ? reflection->GetBool(message,field) :
+                                           reflection->GetRepeatedBool(message,field,index);
+                c->value.push_back(v ? 1 : 0);
+                ++c->value_count;
+                break;
+            }
+        case TYPE_INT32:  DO_(Int32,int32_t);
+        case TYPE_INT64:  DO_(Int64,int64_t);
+        case TYPE_UINT32: DO_(UInt32,uint32_t);
+        case TYPE_UINT64: DO_(UInt64,uint64_t);
+        case TYPE_FLOAT:  DO_(Float,float);
+        case TYPE_DOUBLE: DO_(Double,double);
+        case TYPE_ENUM:   DO_(EnumValue,int32_t);
+        case TYPE_STRING:
+        case TYPE_BYTES:
+            {
+                std::string scratch;
+                c->add_variable( index < 0 ?
+                    reflection->GetStringReference(message,field,&scratch) :
+                    reflection->GetRepeatedStringReference(message,field,index,&scratch) );
+                break;
+            }
+        case TYPE_MESSAGE:
+            {
+                const Message& sub = index < 0 ? reflection->GetMessage(message,field) :
+                    reflection->GetRepeatedMessage(message,field,index);
+                c->add_variable(sub.SerializeAsString());
+                break;
+            }
+        default:
+            assert(!"Unreachable");
+            break;
+    }
+#undef DO_
+}
+
+void columnar_writer::write_bytes( const void* data , std::size_t size ) {
+    m_output.write(static_cast<const char*>(data),size);
+    m_offset += size;
+}
+
+void columnar_writer::flush_row_group() {
+    if( m_row_count == 0 ) return;
+    row_group_meta meta;
+    meta.row_count = m_row_count;
+    for( std::size_t i = 0 ; i < m_column.size() ; ++i ) {
+        column* c = m_column[i];
+        chunk_meta chunk;
+        chunk.offset = m_offset;
+        chunk.level_count = c->max_def != 0 ? c->def.size() :
+                           (c->max_rep != 0 ? c->rep.size() : c->value_count);
+        chunk.value_count = c->value_count;
+        write_bytes(c->rep.data(),c->rep.size());
+        write_bytes(c->def.data(),c->def.size());
+        if( c->is_variable() ) {
+            write_bytes(c->offset.data(),c->offset.size());
+        }
+        write_bytes(c->value.data(),c->value.size());
+        chunk.size = m_offset - chunk.offset;
+        meta.chunk.push_back(chunk);
+        c->clear();
+    }
+    m_row_group.push_back(meta);
+    m_row_count = 0;
+}
+
+void columnar_writer::write_footer() {
+    std::string footer;
+    put_u32(&footer,static_cast<uint32_t>(m_column.size()));
+    for( std::size_t i = 0 ; i < m_column.size() ; ++i ) {
+        const column* c = m_column[i];
+        put_str(&footer,c->path);
+        footer.push_back(static_cast<char>(c->type));
+        footer.push_back(static_cast<char>(c->max_rep));
+        footer.push_back(static_cast<char>(c->max_def));
+        put_str(&footer,c->type_name);
+        if( c->enum_type != NULL ) {
+            put_u32(&footer,static_cast<uint32_t>(c->enum_type->value_count()));
+            for( int j = 0 ; j < c->enum_type->value_count() ; ++j ) {
+                const EnumValueDescriptor* v = c->enum_type->value(j);
+                put_u32(&footer,static_cast<uint32_t>(v->number()));
+                put_str(&footer,v->name());
+            }
+        } else {
+            put_u32(&footer,0);
+        }
+    }
+    put_u32(&footer,static_cast<uint32_t>(m_row_group.size()));
+    for( std::size_t i = 0 ; i < m_row_group.size() ; ++i ) {
+        const row_group_meta& meta = m_row_group[i];
+        put_u64(&footer,meta.row_count);
+        for( std::size_t j = 0 ; j < meta.chunk.size() ; ++j ) {
+            put_u64(&footer,meta.chunk[j].offset);
+            put_u64(&footer,meta.chunk[j].size);
+            put_u64(&footer,meta.chunk[j].level_count);
+            put_u64(&footer,meta.chunk[j].value_count);
+        }
+    }
+    const uint64_t footer_offset = m_offset;
+    put_u64(&footer,footer_offset);
+    footer.append(kMagic,4);
+    write_bytes(footer.data(),footer.size());
+}
+
+bool columnar_writer::finish() {
+    flush_row_group();
+    write_footer();
+    m_output.flush();
+    return m_output.good();
+}
+
+}// namespace proto2json
@@ -0,0 +1,115 @@
+#ifndef _COLUMNAR_H_
+#define _COLUMNAR_H_
+#include <cstddef>
+#include <stdint.h>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+
+// =====================================================================
+// Columnar output
+// Records are shredded into one column per leaf field , as Dremel and
+// parquet do : every value of a column carries a repetition level and
+// a definition level , so repeated and nested fields can be assembled
+// back without storing the structure. Columns are kept in typed buffers
+// and flushed as a row group once enough records are collected.
+//
+// File layout , every integer is little endian :
+//   "P2JC" u32 version
+//   row group*         : one chunk per column
+//   footer
+//   u64 footer offset , "P2JC"
+// Column chunk :
+//   u8 repetition level * level count    (only when max repetition > 0)
+//   u8 definition level * level count    (only when max definition > 0)
+//   values : fixed width types are packed one after another , bool as
+//   u8 ; string and bytes store u32 offset * (value count + 1) and then
+//   the data.
+// Footer :
+//   u32 column count , per column :
+//     str path , u8 type , u8 max repetition , u8 max definition ,
+//     str type name , u32 enum value count , (i32 number , str name)*
+//   u32 row group count , per row group :
+//     u64 row count , per column :
+//       u64 offset , u64 size , u64 level count , u64 value count
+//   where str is u32 length followed by the bytes.
+// Message field of a type already on the path would recurse forever ,
+// it is stored as a bytes column holding the serialized submessage and
+// its type name.
+// =====================================================================
+
+namespace proto2json {
+
+class columnar_writer {
+public:
+    enum column_type {
+        TYPE_BOOL = 1,
+        TYPE_INT32 ,
+        TYPE_INT64 ,
+        TYPE_UINT32 ,
+        TYPE_UINT64 ,
+        TYPE_FLOAT ,
+        TYPE_DOUBLE ,
+        TYPE_ENUM ,    // i32 number , names in footer
+        TYPE_STRING ,
+        TYPE_BYTES ,
+        TYPE_MESSAGE   // Serialized submessage of a recursive field
+    };
+
+    columnar_writer( std::ostream& output , std::size_t row_group_size );
+    ~columnar_writer();
+
+    // Build the column schema for the record type , return false if the
+    // schema nests too deep to be described with 8 bits levels.
+    bool init( const google::protobuf::Descriptor* descriptor );
+
+    void append( const google::protobuf::Message& message );
+
+    // Flush the pending row group and write footer.
+    bool finish();
+
+private:
+    struct column;
+    struct node;
+    struct chunk_meta {
+        uint64_t offset;
+        uint64_t size;
+        uint64_t level_count;
+        uint64_t value_count;
+    };
+    struct row_group_meta {
+        uint64_t row_count;
+        std::vector<chunk_meta> chunk;
+    };
+
+    bool build( node* parent , const google::protobuf::Descriptor* descriptor ,
+                const std::string& path ,
+                std::vector<const google::protobuf::Descriptor*>* stack );
+    void shred( const google::protobuf::Message& message , const node& parent ,
+                int rep , int def );
+    void shred_field( const google::protobuf::Message& message , const node& field ,
+                      int rep , int def );
+    void write_null( const node& field , int rep , int def );
+    void write_value( const google::protobuf::Message& message , const node& field ,
+                      int index , int rep );
+    void flush_row_group();
+    void write_footer();
+    void write_bytes( const void* data , std::size_t size );
+
+    std::ostream& m_output;
+    std::size_t m_row_group_size;
+    uint64_t m_offset;       // Bytes written so far
+    uint64_t m_row_count;    // Rows of the pending row group
+    node* m_root;
+    std::vector<column*> m_column;
+    std::vector<row_group_meta> m_row_group;
+
+    void operator=( const columnar_writer& );
+    columnar_writer( const columnar_writer& );
+};
+
+}// namespace proto2json
+#endif // _COLUMNAR_H_
@@ -0,0 +1,635 @@
+#include "field_stats.h"
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <unordered_map>
+#include <utility>
+
+#include <google/protobuf/wire_format.h>
+#include <google/protobuf/io/coded_stream.h>
+
+namespace proto2json {
+using namespace google::protobuf;
+using google::protobuf::internal::WireFormat;
+
+namespace {
+
+// Submessage nested deeper is only counted , not walked , so a recursive
+// schema could not grow the number of field paths without bound.
+static const int kMaxDepth = 32;
+
+// Counters kept by Space-Saving and the ones reported
+static const std::size_t kTopCapacity = 64;
+static const std::size_t kTopReport = 10;
+
+// Buckets of the repeated length histogram , bucket k counts the lengths in
+// [2^k , 2^(k+1))
+static const int kLengthBucket = 32;
+
+inline uint64_t mix( uint64_t v ) {
+    // splitmix64 finalizer , spreads every input bit over the whole word
+    v ^= v >> 30;
+    v *= 0xbf58476d1ce4e5b9ULL;
+    v ^= v >> 27;
+    v *= 0x94d049bb133111ebULL;
+    v ^= v >> 31;
+    return v;
+}
+
+inline uint64_t hash_bytes( const std::string& v ) {
+    // FNV-1a , then mixed since its high bits are weak for short input
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for( std::size_t i = 0 ; i < v.size() ; ++i ) {
+        h ^= static_cast<unsigned char>(v[i]);
+        h *= 0x100000001b3ULL;
+    }
+    return mix(h);
+}
+
+template< typename T >
+inline uint64_t hash_bits( T v ) {
+    uint64_t bits = 0;
+    std::memcpy(&bits,&v,sizeof(T));
+    return mix(bits);
+}
+
+// Cardinality estimation with 2^12 one byte registers , about 1.6% of
+// standard error. Register is picked by the top bits of the hash and keeps
+// the longest run of leading zeros seen in the remaining bits.
+class hyperloglog {
+public:
+    static const int kBits = 12;
+    static const std::size_t kSize = 1 << kBits;
+
+    hyperloglog() {
+        std::memset(m_register,0,sizeof(m_register));
+    }
+
+    void add( uint64_t hash ) {
+        const std::size_t index = static_cast<std::size_t>(hash >> (64 - kBits));
+        // Sentinel bit bounds the run when the remaining bits are all zero
+        const uint64_t rest = (hash << kBits) | (1ULL << (kBits - 1));
+        const uint8_t rank = static_cast<uint8_t>(__builtin_clzll(rest) + 1);
+        if( rank > m_register[index] ) {
+            m_register[index] = rank;
+        }
+    }
+
+    void merge( const hyperloglog& that ) {
+        for( std::size_t i = 0 ; i < kSize ; ++i ) {
+            m_register[i] = std::max(m_register[i],that.m_register[i]);
+        }
+    }
+
+    uint64_t estimate() const {
+        const double m = static_cast<double>(kSize);
+        double sum = 0;
+        std::size_t zero = 0;
+        for( std::size_t i = 0 ; i < kSize ; ++i ) {
+            sum += std::ldexp(1.0,-m_register[i]);
+            zero += m_register[i] == 0;
+        }
+        double e = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+        // Small range is far more accurate with linear counting
+        if( e <= 2.5 * m && zero != 0 ) {
+            e = m * std::log(m / zero);
+        }
+        return static_cast<uint64_t>(e + 0.5);
+    }
+
+private:
+    uint8_t m_register[kSize];
+};
+
+// Space-Saving keeps a fixed number of counters. A value without a counter
+// takes over the smallest one and inherits its count as overestimation , so
+// every value more frequent than records / capacity is sure to be kept.
+class space_saving {
+public:
+    struct counter {
+        uint64_t count;
+        uint64_t error;   // Count is at most this much too high
+    };
+    typedef std::pair<std::string,counter> item;
+
+    space_saving(): m_counter() {}
+
+    void add( const std::string& value ) {
+        std::unordered_map<std::string,counter>::iterator i = m_counter.find(value);
+        if( i != m_counter.end() ) {
+            ++i->second.count;
+            return;
+        }
+        counter c = { 1 , 0 };
+        if( m_counter.size() >= kTopCapacity ) {
+            std::unordered_map<std::string,counter>::iterator min = smallest();
+            c.count += min->second.count;
+            c.error = min->second.count;
+            m_counter.erase(min);
+        }
+        m_counter.insert(std::make_pair(value,c));
+    }
+
+    void merge( const space_saving& that ) {
+        std::unordered_map<std::string,counter>::const_iterator i = that.m_counter.begin();
+        for( ; i != that.m_counter.end() ; ++i ) {
+            counter& c = m_counter[i->first];
+            c.count += i->second.count;
+            c.error += i->second.error;
+        }
+        while( m_counter.size() > kTopCapacity ) {
+            m_counter.erase(smallest());
+        }
+    }
+
+    // Most frequent values first
+    void top( std::vector<item>* output ) const {
+        output->assign(m_counter.begin(),m_counter.end());
+        std::sort(output->begin(),output->end(),by_count);
+        if( output->size() > kTopReport ) {
+            output->resize(kTopReport);
+        }
+    }
+
+private:
+    static bool by_count( const item& l , const item& r ) {
+        return l.second.count != r.second.count ?
+            l.second.count > r.second.count : l.first < r.first;
+    }
+
+    std::unordered_map<std::string,counter>::iterator smallest() {
+        std::unordered_map<std::string,counter>::iterator ret = m_counter.begin();
+        std::unordered_map<std::string,counter>::iterator i = ret;
+        for( ++i ; i != m_counter.end() ; ++i ) {
+            if( i->second.count < ret->second.count ) {
+                ret = i;
+            }
+        }
+        return ret;
+    }
+
+    std::unordered_map<std::string,counter> m_counter;
+};
+
+}// namespace
+
+struct field_stats::entry {
+    const FieldDescriptor* field;
+    std::string path;
+
+    uint64_t present;
+    uint64_t values;
+    uint64_t bytes;
+
+    // Value of number fields , size of string and bytes fields
+    uint64_t number_count;
+    int64_t int_min , int_max;
+    uint64_t uint_min , uint_max;
+    double double_min , double_max;
+    double sum;
+
+    // Element count of repeated field , only when present
+    uint64_t length_min , length_max , length_sum;
+    uint64_t length_bucket[kLengthBucket];
+
+    hyperloglog* distinct;   // NULL for message field
+    space_saving* top;       // Only for enum , bool and string field
+    node* child;             // Only for message field , built when first seen
+
+    entry( const FieldDescriptor* f , const std::string& p ):
+        field(f), path(p), present(0), values(0), bytes(0),
+        number_count(0), int_min(0), int_max(0), uint_min(0), uint_max(0),
+        double_min(0), double_max(0), sum(0),
+        length_min(0), length_max(0), length_sum(0),
+        distinct(NULL), top(NULL), child(NULL)
+    {
+        std::memset(length_bucket,0,sizeof(length_bucket));
+        if( f->cpp_type() != FieldDescriptor::CPPTYPE_MESSAGE ) {
+            distinct = new hyperloglog();
+        }
+        if( f->cpp_type() == FieldDescriptor::CPPTYPE_ENUM ||
+            f->cpp_type() == FieldDescriptor::CPPTYPE_BOOL ||
+            f->type() == FieldDescriptor::TYPE_STRING ) {
+            top = new space_saving();
+        }
+    }
+    ~entry();
+
+    bool is_signed() const {
+        switch( field->cpp_type() ) {
+            case FieldDescriptor::CPPTYPE_INT32:
+            case FieldDescriptor::CPPTYPE_INT64:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    bool is_real() const {
+        return field->cpp_type() == FieldDescriptor::CPPTYPE_FLOAT ||
+               field->cpp_type() == FieldDescriptor::CPPTYPE_DOUBLE;
+    }
+
+    bool has_number() const {
+        switch( field->cpp_type() ) {
+            case FieldDescriptor::CPPTYPE_ENUM:
+            case FieldDescriptor::CPPTYPE_BOOL:
+            case FieldDescriptor::CPPTYPE_MESSAGE:
+                return false;
+            default:
+                return true;
+        }
+    }
+
+    void add_int( int64_t v ) {
+        if( number_count == 0 || v < int_min ) int_min = v;
+        if( number_count == 0 || v > int_max ) int_max = v;
+        sum += static_cast<double>(v);
+        ++number_count;
+    }
+
+    void add_uint( uint64_t v ) {
+        if( number_count == 0 || v < uint_min ) uint_min = v;
+        if( number_count == 0 || v > uint_max ) uint_max = v;
+        sum += static_cast<double>(v);
+        ++number_count;
+    }
+
+    void add_double( double v ) {
+        if( number_count == 0 || v < double_min ) double_min = v;
+        if( number_count == 0 || v > double_max ) double_max = v;
+        sum += v;
+        ++number_count;
+    }
+
+    void add_length( uint64_t length ) {
+        if( present == 1 || length < length_min ) length_min = length;
+        if( present == 1 || length > length_max ) length_max = length;
+        length_sum += length;
+        const int bucket = 63 - __builtin_clzll(length);
+        ++length_bucket[std::min(bucket,kLengthBucket-1)];
+    }
+
+    void merge( const entry& that ) {
+        if( that.number_count != 0 ) {
+            if( number_count == 0 ) {
+                int_min = that.int_min; int_max = that.int_max;
+                uint_min = that.uint_min; uint_max = that.uint_max;
+                double_min = that.double_min; double_max = that.double_max;
+            } else {
+                int_min = std::min(int_min,that.int_min);
+                int_max = std::max(int_max,that.int_max);
+                uint_min = std::min(uint_min,that.uint_min);
+                uint_max = std::max(uint_max,that.uint_max);
+                double_min = std::min(double_min,that.double_min);
+                double_max = std::max(double_max,that.double_max);
+            }
+            number_count += that.number_count;
+            sum += that.sum;
+        }
+        if( field->is_repeated() && that.present != 0 ) {
+            if( present == 0 ) {
+                length_min = that.length_min;
+                length_max = that.length_max;
+            } else {
+                length_min = std::min(length_min,that.length_min);
+                length_max = std::max(length_max,that.length_max);
+            }
+            length_sum += that.length_sum;
+            for( int i = 0 ; i < kLengthBucket ; ++i ) {
+                length_bucket[i] += that.length_bucket[i];
+            }
+        }
+        present += that.present;
+        values += that.values;
+        bytes += that.bytes;
+        if( distinct != NULL ) distinct->merge(*that.distinct);
+        if( top != NULL ) top->merge(*that.top);
+    }
+};
+
+struct field_stats::node {
+    const Descriptor* descriptor;
+    std::string path;                 // Prefix of the field paths
+    std::vector<entry*> fields;       // By field index , NULL until seen
+    std::vector<entry*> extensions;   // In the order first seen
+
+    node( const Descriptor* d , const std::string& p ):
+        descriptor(d), path(p),
+        fields(static_cast<std::size_t>(d->field_count()),NULL),
+        extensions()
+    {}
+
+    ~node() {
+        for( std::size_t i = 0 ; i < fields.size() ; ++i ) delete fields[i];
+        for( std::size_t i = 0 ; i < extensions.size() ; ++i ) delete extensions[i];
+    }
+
+    entry* find( const FieldDescriptor* field ) {
+        if( !field->is_extension() ) {
+            entry*& e = fields[field->index()];
+            if( e == NULL ) {
+                e = new entry(field,path + field->name());
+            }
+            return e;
+        }
+        for( std::size_t i = 0 ; i < extensions.size() ; ++i ) {
+            if( extensions[i]->field == field ) {
+                return extensions[i];
+            }
+        }
+        extensions.push_back(new entry(field,path + "[" + field->full_name() + "]"));
+        return extensions.back();
+    }
+};
+
+field_stats::entry::~entry() {
+    delete distinct;
+    delete top;
+    delete child;
+}
+
+field_stats::field_stats( const Descriptor* descriptor ):
+    m_root(new node(descriptor,"")),
+    m_record_count(0),
+    m_record_bytes(0)
+{}
+
+field_stats::~field_stats() {
+    delete m_root;
+}
+
+void field_stats::add( const Message& record ) {
+    assert(record.GetDescriptor() == m_root->descriptor);
+    m_record_bytes += add_message(m_root,record,0);
+    ++m_record_count;
+}
+
+// Fold every present field of the message , return its wire size. Size of a
+// submessage comes back from the walk into it , so nested messages are not
+// measured again at every level above them.
+std::size_t field_stats::add_message( node* n , const Message& message , int depth ) {
+    const Reflection* reflection = message.GetReflection();
+    std::vector<const FieldDescriptor*> fields;
+    reflection->ListFields(message,&fields);
+    std::size_t size = WireFormat::ComputeUnknownFieldsSize(
+            reflection->GetUnknownFields(message));
+    for( std::size_t i = 0 ; i < fields.size() ; ++i ) {
+        entry* e = n->find(fields[i]);
+        const uint64_t before = e->bytes;
+        add_field(e,message,depth);
+        size += static_cast<std::size_t>(e->bytes - before);
+    }
+    return size;
+}
+
+void field_stats::add_field( entry* e , const Message& message , int depth ) {
+    const Reflection* reflection = message.GetReflection();
+    const FieldDescriptor* field = e->field;
+    const bool repeated = field->is_repeated();
+    const int count = repeated ? reflection->FieldSize(message,field) : 1;
+
+    ++e->present;
+    e->values += count;
+    if( repeated ) {
+        e->add_length(static_cast<uint64_t>(count));
+    }
+
+    if( field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE ) {
+        if( depth >= kMaxDepth ) {
+            e->bytes += WireFormat::FieldByteSize(field,message);
+            return;
+        }
+        if( e->child == NULL ) {
+            e->child = new node(field->message_type(),e->path + ".");
+        }
+        const std::size_t tag = WireFormat::TagSize(field->number(),field->type());
+        for( int i = 0 ; i < count ; ++i ) {
+            const Message& sub = repeated ?
+                reflection->GetRepeatedMessage(message,field,i) :
+                reflection->GetMessage(message,field);
+            const std::size_t size = add_message(e->child,sub,depth+1);
+            // Group tag size already counts the end group tag
+            e->bytes += tag + size;
+            if( field->type() != FieldDescriptor::TYPE_GROUP ) {
+                e->bytes += io::CodedOutputStream::VarintSize64(size);
+            }
+        }
+        return;
+    }
+
+    e->bytes += WireFormat::FieldByteSize(field,message);
+    std::string scratch;
+    for( int i = 0 ; i < count ; ++i ) {
+        switch( field->cpp_type() ) {
+#define FOLD_VALUE(CPPTYPE,TYPE,GET,ADD) \
+            case FieldDescriptor::CPPTYPE: { \
+                const TYPE v = repeated ? \
+                    reflection->GetRepeated##GET(message,field,i) : \
+                    reflection->Get##GET(message,field); \
+                e->ADD(v); \
+                e->distinct->add(hash_bits(v)); \
+                break; \
+            }
+            FOLD_VALUE(CPPTYPE_INT32,int32_t,Int32,add_int)
+            FOLD_VALUE(CPPTYPE_INT64,int64_t,Int64,add_int)
+            FOLD_VALUE(CPPTYPE_UINT32,uint32_t,UInt32,add_uint)
+            FOLD_VALUE(CPPTYPE_UINT64,uint64_t,UInt64,add_uint)
+            FOLD_VALUE(CPPTYPE_FLOAT,float,Float,add_double)
+            FOLD_VALUE(CPPTYPE_DOUBLE,double,Double,add_double)
+#undef FOLD_VALUE
+            case FieldDescriptor::CPPTYPE_BOOL: {
+                const bool v = repeated ?
+                    reflection->GetRepeatedBool(message,field,i) :
+                    reflection->GetBool(message,field);
+                e->distinct->add(hash_bits(v));
+                e->top->add(v ? "true" : "false");
+                break;
+            }
+            case FieldDescriptor::CPPTYPE_ENUM: {
+                const int v = repeated ?
+                    reflection->GetRepeatedEnumValue(message,field,i) :
+                    reflection->GetEnumValue(message,field);
+                e->distinct->add(hash_bits(v));
+                const EnumValueDescriptor* value = field->enum_type()->FindValueByNumber(v);
+                if( value != NULL ) {
+                    e->top->add(value->name());
+                } else {
+                    // Open enum keeps numbers unknown to the schema
+                    char buf[16];
+                    snprintf(buf,sizeof(buf),"%d",v);
+                    e->top->add(buf);
+                }
+                break;
+            }
+            case FieldDescriptor::CPPTYPE_STRING: {
+                const std::string& v = repeated ?
+                    reflection->GetRepeatedStringReference(message,field,i,&scratch) :
+                    reflection->GetStringReference(message,field,&scratch);
+                e->add_uint(v.size());
+                e->distinct->add(hash_bytes(v));
+                if( e->top != NULL ) {
+                    e->top->add(v);
+                }
+                break;
+            }
+            default:
+                assert(!"Unreachable");
+                break;
+        }
+    }
+}
+
+void field_stats::merge( const field_stats& that ) {
+    assert(that.m_root->descriptor == m_root->descriptor);
+    merge_node(m_root,*that.m_root);
+    m_record_count += that.m_record_count;
+    m_record_bytes += that.m_record_bytes;
+}
+
+void field_stats::merge_node( node* n , const node& that ) {
+    for( std::size_t i = 0 ; i < that.fields.size() ; ++i ) {
+        if( that.fields[i] != NULL ) {
+            entry* e = n->find(that.fields[i]->field);
+            e->merge(*that.fields[i]);
+            if( that.fields[i]->child != NULL ) {
+                if( e->child == NULL ) {
+                    e->child = new node(e->field->message_type(),e->path + ".");
+                }
+                merge_node(e->child,*that.fields[i]->child);
+            }
+        }
+    }
+    for( std::size_t i = 0 ; i < that.extensions.size() ; ++i ) {
+        entry* e = n->find(that.extensions[i]->field);
+        e->merge(*that.extensions[i]);
+        if( that.extensions[i]->child != NULL ) {
+            if( e->child == NULL ) {
+                e->child = new node(e->field->message_type(),e->path + ".");
+            }
+            merge_node(e->child,*that.extensions[i]->child);
+        }
+    }
+}
+
+// Entries seen , parent first and in declaration order
+void field_stats::collect( const node& n , std::vector<const entry*>* entries ) const {
+    for( std::size_t i = 0 ; i < n.fields.size() + n.extensions.size() ; ++i ) {
+        const entry* e = i < n.fields.size() ? n.fields[i] : n.extensions[i-n.fields.size()];
+        if( e == NULL ) {
+            continue;
+        }
+        entries->push_back(e);
+        if( e->child != NULL ) {
+            collect(*e->child,entries);
+        }
+    }
+}
+
+void field_stats::report( writer& output ) const {
+    std::vector<const entry*> entries;
+    collect(*m_root,&entries);
+
+    output.begin_record();
+    output.begin_object(3);
+    output.key("records");
+    output.uint_value(m_record_count,false);
+    output.key("bytes");
+    output.uint_value(m_record_bytes,false);
+    output.key("fields");
+    output.begin_object(entries.size());
+    for( std::size_t i = 0 ; i < entries.size() ; ++i ) {
+        output.key(entries[i]->path);
+        report_entry(*entries[i],output);
+    }
+    output.end_object();
+    output.end_object();
+}
+
+void field_stats::report_entry( const entry& e , writer& output ) const {
+    const bool repeated = e.field->is_repeated();
+    const bool is_string = e.field->cpp_type() == FieldDescriptor::CPPTYPE_STRING;
+    std::vector<space_saving::item> top;
+    if( e.top != NULL ) {
+        e.top->top(&top);
+    }
+    int histogram = 0;
+    for( int i = 0 ; i < kLengthBucket ; ++i ) {
+        if( e.length_bucket[i] != 0 ) histogram = i + 1;
+    }
+
+    output.begin_object(3 + (e.distinct != NULL) + (e.has_number() ? 1 : 0) +
+                        (e.top != NULL) + repeated);
+    output.key("present");
+    output.uint_value(e.present,false);
+    output.key("values");
+    output.uint_value(e.values,false);
+    output.key("bytes");
+    output.uint_value(e.bytes,false);
+    if( e.distinct != NULL ) {
+        output.key("distinct");
+        output.uint_value(e.distinct->estimate(),false);
+    }
+    if( e.has_number() ) {
+        // String and bytes report the size of their values
+        output.key(is_string ? "size" : "value");
+        output.begin_object(3);
+        output.key("min");
+        if( e.is_real() ) {
+            output.double_value(e.double_min,false);
+        } else if( e.is_signed() ) {
+            output.int_value(e.int_min,false);
+        } else {
+            output.uint_value(e.uint_min,false);
+        }
+        output.key("max");
+        if( e.is_real() ) {
+            output.double_value(e.double_max,false);
+        } else if( e.is_signed() ) {
+            output.int_value(e.int_max,false);
+        } else {
+            output.uint_value(e.uint_max,false);
+        }
+        output.key("mean");
+        output.double_value(e.number_count == 0 ? 0 : e.sum / e.number_count,false);
+        output.end_object();
+    }
+    if( e.top != NULL ) {
+        output.key("top");
+        output.begin_array(top.size());
+        for( std::size_t i = 0 ; i < top.size() ; ++i ) {
+            output.begin_object(3);
+            output.key("value");
+            output.string_value(top[i].first);
+            output.key("count");
+            output.uint_value(top[i].second.count,false);
+            output.key("error");
+            output.uint_value(top[i].second.error,false);
+            output.end_object();
+        }
+        output.end_array();
+    }
+    if( repeated ) {
+        output.key("length");
+        output.begin_object(4);
+        output.key("min");
+        output.uint_value(e.length_min,false);
+        output.key("max");
+        output.uint_value(e.length_max,false);
+        output.key("mean");
+        output.double_value(e.present == 0 ? 0 :
+                static_cast<double>(e.length_sum) / e.present,false);
+        output.key("histogram");
+        output.begin_array(histogram);
+        for( int i = 0 ; i < histogram ; ++i ) {
+            output.uint_value(e.length_bucket[i],false);
+        }
+        output.end_array();
+        output.end_object();
+    }
+    output.end_object();
+}
+
+}// namespace proto2json
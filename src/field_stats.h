@@ -0,0 +1,73 @@
+#ifndef _FIELD_STATS_H_
+#define _FIELD_STATS_H_
+#include <cstddef>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+
+#include "writer.h"
+
+// =====================================================================
+// Field statistics
+// Records are walked through reflection , like the converter does , and
+// every field path folds its values into an accumulator instead of
+// writing them out. Per field path :
+//   present   : messages holding the field
+//   values    : values seen , every element of a repeated field counts
+//   bytes     : wire size of the field , tags included
+//   distinct  : approximate distinct values , by HyperLogLog
+//   value     : min , max and mean of a number field
+//   size      : the same of the value size of a string or bytes field
+//   top       : most frequent enum , bool and string values , by
+//               Space-Saving , each with its count and overestimation
+//   length    : min , max and mean element count of a repeated field ,
+//               with a histogram of power of two buckets
+// Sketches have a fixed size , so memory only grows with the number of
+// field paths seen , never with the number of records or values.
+// Accumulators filled by separate threads are merged at the end ; a
+// merged HyperLogLog is exact as if one had seen every value , a merged
+// Space-Saving keeps its error bound.
+// =====================================================================
+
+namespace proto2json {
+
+class field_stats {
+public:
+    explicit field_stats( const google::protobuf::Descriptor* descriptor );
+    ~field_stats();
+
+    void add( const google::protobuf::Message& record );
+
+    // Fold the accumulators of another instance of the same message type
+    void merge( const field_stats& that );
+
+    uint64_t record_count() const { return m_record_count; }
+
+    // Write the report as one object keyed by field path
+    void report( writer& output ) const;
+
+private:
+    struct entry;
+    struct node;
+
+    std::size_t add_message( node* n , const google::protobuf::Message& message ,
+                             int depth );
+    void add_field( entry* e , const google::protobuf::Message& message ,
+                    int depth );
+    void merge_node( node* n , const node& that );
+    void collect( const node& n , std::vector<const entry*>* entries ) const;
+    void report_entry( const entry& e , writer& output ) const;
+
+    node* m_root;
+    uint64_t m_record_count;
+    uint64_t m_record_bytes;
+
+    void operator=( const field_stats& );
+    field_stats( const field_stats& );
+};
+
+}// namespace proto2json
+#endif // _FIELD_STATS_H_
@@ -0,0 +1,232 @@
+#include "file_follower.h"
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+namespace proto2json {
+
+file_follower::file_follower( std::ostream& log ):
+    m_log( log ),
+    m_path(),
+    m_offset_path(),
+    m_fd( -1 ),
+    m_offset_fd( -1 ),
+    m_inotify( -1 ),
+    m_watch_file( -1 ),
+    m_watch_dir( -1 ),
+    m_device( 0 ),
+    m_inode( 0 ),
+    m_base( 0 ),
+    m_buffer(),
+    m_begin( 0 ),
+    m_committed( UINT64_MAX ),
+    m_error()
+{}
+
+file_follower::~file_follower() {
+    if( m_fd >= 0 ) close(m_fd);
+    if( m_offset_fd >= 0 ) close(m_offset_fd);
+    if( m_inotify >= 0 ) close(m_inotify);
+}
+
+bool file_follower::fail( const std::string& what ) {
+    m_error = what + ":" + m_path + " : " + strerror(errno);
+    return false;
+}
+
+bool file_follower::open( const std::string& path , const std::string& offset_path ) {
+    m_path = path;
+    m_offset_path = offset_path;
+    const std::size_t slash = path.find_last_of('/');
+    const std::string directory = slash == std::string::npos ? "." :
+        (slash == 0 ? "/" : path.substr(0,slash));
+
+    m_inotify = inotify_init1(IN_CLOEXEC);
+    if( m_inotify < 0 ) {
+        return fail("Cannot initialize inotify");
+    }
+    m_watch_dir = inotify_add_watch(m_inotify,directory.c_str(),IN_CREATE|IN_MOVED_TO);
+    if( m_watch_dir < 0 ) {
+        return fail("Cannot watch the directory of");
+    }
+    m_offset_fd = ::open(offset_path.c_str(),O_RDWR|O_CREAT|O_CLOEXEC,0644);
+    if( m_offset_fd < 0 ) {
+        m_path = offset_path;
+        return fail("Cannot open offset file");
+    }
+    return open_file(true);
+}
+
+bool file_follower::open_file( bool resume ) {
+    m_fd = ::open(m_path.c_str(),O_RDONLY|O_CLOEXEC);
+    if( m_fd < 0 ) {
+        // Rotated away and not created again yet , the directory watch tells
+        return errno == ENOENT && !resume ? true : fail("Cannot open input file");
+    }
+    struct stat info;
+    if( fstat(m_fd,&info) != 0 ) {
+        return fail("Cannot stat input file");
+    }
+    m_device = info.st_dev;
+    m_inode = info.st_ino;
+    if( m_watch_file >= 0 ) {
+        inotify_rm_watch(m_inotify,m_watch_file);
+    }
+    m_watch_file = inotify_add_watch(m_inotify,m_path.c_str(),
+            IN_MODIFY|IN_ATTRIB|IN_MOVE_SELF|IN_DELETE_SELF);
+    if( m_watch_file < 0 ) {
+        return fail("Cannot watch input file");
+    }
+
+    m_base = 0;
+    m_buffer.clear();
+    m_begin = 0;
+    if( resume ) {
+        char line[kOffsetLineSize+1];
+        const ssize_t size = pread(m_offset_fd,line,kOffsetLineSize,0);
+        unsigned long long device , inode , offset;
+        if( size > 0 ) {
+            line[size] = 0;
+            if( sscanf(line,"%llu %llu %llu",&device,&inode,&offset) == 3 &&
+                    device == static_cast<unsigned long long>(m_device) &&
+                    inode == static_cast<unsigned long long>(m_inode) &&
+                    offset <= static_cast<unsigned long long>(info.st_size) ) {
+                m_base = offset;
+            }
+        }
+    }
+    if( lseek(m_fd,static_cast<off_t>(m_base),SEEK_SET) < 0 ) {
+        return fail("Cannot seek input file");
+    }
+    m_committed = UINT64_MAX;
+    return true;
+}
+
+bool file_follower::next( const char** data , std::size_t* size ) {
+    while( m_fd >= 0 ) {
+        // Length prefix , then the payload , both could still be incomplete
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(m_buffer.data()) + m_begin;
+        const std::size_t available = m_buffer.size() - m_begin;
+        uint64_t length = 0;
+        std::size_t prefix = 0;
+        bool complete = false;
+        while( prefix < available && prefix < 5 ) {
+            length |= static_cast<uint64_t>(p[prefix] & 0x7f) << (7 * prefix);
+            if( p[prefix++] < 0x80 ) {
+                complete = true;
+                break;
+            }
+        }
+        if( !complete && prefix == 5 ) {
+            m_error = "Broken length prefix in input file:" + m_path;
+            return false;
+        }
+        if( complete && length > INT_MAX ) {
+            m_error = "Record too large in input file:" + m_path;
+            return false;
+        }
+        if( complete && available - prefix >= length ) {
+            *data = reinterpret_cast<const char*>(p + prefix);
+            *size = static_cast<std::size_t>(length);
+            m_begin += prefix + length;
+            return true;
+        }
+
+        // Keep only the partial record and read more behind it
+        if( m_begin > 0 ) {
+            m_base += m_begin;
+            m_buffer.erase(0,m_begin);
+            m_begin = 0;
+        }
+        const std::size_t used = m_buffer.size();
+        m_buffer.resize(used + kReadSize);
+        ssize_t got;
+        do {
+            got = read(m_fd,&m_buffer[used],kReadSize);
+        } while( got < 0 && errno == EINTR );
+        m_buffer.resize(used + (got > 0 ? got : 0));
+        if( got < 0 ) {
+            return fail("Cannot read input file");
+        }
+        if( got == 0 ) {
+            return false;
+        }
+    }
+    return false;
+}
+
+bool file_follower::drop_partial() {
+    const std::size_t partial = m_buffer.size() - m_begin;
+    if( partial > 0 ) {
+        m_log<<"Dropped "<<partial<<" bytes of a partial record at the end of "
+             <<m_path<<std::endl;
+    }
+    close(m_fd);
+    m_fd = -1;
+    return true;
+}
+
+bool file_follower::wait() {
+    if( !m_error.empty() ) {
+        return false;
+    }
+    const uint64_t position = m_base + m_begin;
+    if( m_fd >= 0 && position != m_committed ) {
+        char line[kOffsetLineSize+1];
+        snprintf(line,sizeof(line),"%20llu %20llu %20llu\n",
+                static_cast<unsigned long long>(m_device),
+                static_cast<unsigned long long>(m_inode),
+                static_cast<unsigned long long>(position));
+        if( pwrite(m_offset_fd,line,kOffsetLineSize,0) != static_cast<ssize_t>(kOffsetLineSize) ) {
+            m_path = m_offset_path;
+            return fail("Cannot write offset file");
+        }
+        m_committed = position;
+    }
+
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while( true ) {
+        // Checked before sleeping , whatever happened after the last read is
+        // still queued on the watches , so no change is missed in between.
+        struct stat now;
+        if( m_fd >= 0 ) {
+            struct stat info;
+            if( fstat(m_fd,&info) != 0 ) {
+                return fail("Cannot stat input file");
+            }
+            const uint64_t read_end = m_base + m_buffer.size();
+            if( static_cast<uint64_t>(info.st_size) > read_end ) {
+                return true;
+            }
+            if( static_cast<uint64_t>(info.st_size) < read_end ) {
+                m_log<<"Input file truncated , reading it again from the start:"<<m_path<<std::endl;
+                close(m_fd);
+                m_fd = -1;
+                return open_file(false);
+            }
+            if( stat(m_path.c_str(),&now) != 0 ||
+                    now.st_dev != m_device || now.st_ino != m_inode ) {
+                // Rotated , and everything the old file holds is read already
+                drop_partial();
+                return open_file(false);
+            }
+        } else if( stat(m_path.c_str(),&now) == 0 ) {
+            return open_file(false);
+        }
+
+        ssize_t size;
+        do {
+            size = read(m_inotify,events,sizeof(events));
+        } while( size < 0 && errno == EINTR );
+        if( size <= 0 ) {
+            return fail("Cannot read inotify events for");
+        }
+    }
+}
+
+}// namespace proto2json
@@ -0,0 +1,73 @@
+#ifndef _FILE_FOLLOWER_H_
+#define _FILE_FOLLOWER_H_
+#include <cstddef>
+#include <stdint.h>
+#include <ostream>
+#include <string>
+#include <sys/types.h>
+
+// =====================================================================
+// File follower
+// Follow a delimited capture file while collectors append to it , the
+// way tail -F does. Records are handed out as soon as they are complete ;
+// a trailing record still being written stays buffered until the rest of
+// its bytes arrive. When nothing is left , the offset past the last
+// record handed out is saved and the reader sleeps on inotify until the
+// file changes : the file itself is watched for appends and for being
+// moved or deleted , its directory for a new file taking its name. A
+// rotated file is drained before the new one is opened , a truncated file
+// is read again from the start. The offset file holds the device , inode
+// and offset , so a restart resumes in the same file and starts over in a
+// file that replaced it. Linux only , for inotify.
+// =====================================================================
+
+namespace proto2json {
+
+class file_follower {
+public:
+    // A rotation or truncation is told to log , one line each
+    explicit file_follower( std::ostream& log );
+    ~file_follower();
+
+    bool open( const std::string& path , const std::string& offset_path );
+
+    // Next complete record from what the file holds now. Return false when
+    // there is none yet , or when the reader broke , see error().
+    bool next( const char** data , std::size_t* size );
+
+    // Save the offset past the records handed out so far , then block until
+    // the file grows , is truncated or is replaced. Return false on error.
+    bool wait();
+
+    const std::string& error() const { return m_error; }
+
+private:
+    static const std::size_t kReadSize = 1 << 20;
+    static const std::size_t kOffsetLineSize = 63;
+
+    bool open_file( bool resume );
+    bool fail( const std::string& what );
+    bool drop_partial();
+
+    std::ostream& m_log;
+    std::string m_path;
+    std::string m_offset_path;
+    int m_fd;                   // -1 while the rotated file is not created yet
+    int m_offset_fd;
+    int m_inotify;
+    int m_watch_file;
+    int m_watch_dir;
+    dev_t m_device;
+    ino_t m_inode;
+    uint64_t m_base;            // File offset of the first byte of the buffer
+    std::string m_buffer;
+    std::size_t m_begin;        // First byte of the buffer not handed out
+    uint64_t m_committed;       // Offset last saved
+    std::string m_error;
+
+    void operator=( const file_follower& );
+    file_follower( const file_follower& );
+};
+
+}// namespace proto2json
+#endif // _FILE_FOLLOWER_H_
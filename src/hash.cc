@@ -0,0 +1,100 @@
+#include "hash.h"
+#include <cstring>
+
+// =====================================================================
+// xxh64
+// Four independent lanes take 8 bytes each per round , so the multiplies
+// of a round overlap ; the lanes are folded together at the end and the
+// tail shorter than a round is mixed in 8 , 4 and 1 byte steps. Words are
+// read in host order , which is little endian on every target built for ,
+// so the values match the reference implementation.
+// =====================================================================
+
+namespace {
+
+static const uint64_t kPrime1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t kPrime2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t kPrime3 = 0x165667B19E3779F9ULL;
+static const uint64_t kPrime4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t kPrime5 = 0x27D4EB2F165667C5ULL;
+
+inline uint64_t Rotate( uint64_t v , int bits ) {
+    return (v << bits) | (v >> (64 - bits));
+}
+
+inline uint64_t Read64( const unsigned char* p ) {
+    uint64_t v;
+    std::memcpy(&v,p,sizeof(v));
+    return v;
+}
+
+inline uint32_t Read32( const unsigned char* p ) {
+    uint32_t v;
+    std::memcpy(&v,p,sizeof(v));
+    return v;
+}
+
+inline uint64_t Round( uint64_t acc , uint64_t input ) {
+    acc += input * kPrime2;
+    return Rotate(acc,31) * kPrime1;
+}
+
+inline uint64_t Merge( uint64_t acc , uint64_t lane ) {
+    acc ^= Round(0,lane);
+    return acc * kPrime1 + kPrime4;
+}
+
+}// namespace
+
+namespace util {
+
+uint64_t Hash64( const void* input , std::size_t length , uint64_t seed ) {
+    const unsigned char* p = static_cast<const unsigned char*>(input);
+    const unsigned char* end = p + length;
+    uint64_t h;
+    if( length >= 32 ) {
+        uint64_t v1 = seed + kPrime1 + kPrime2;
+        uint64_t v2 = seed + kPrime2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - kPrime1;
+        const unsigned char* last = end - 32;
+        do {
+            v1 = Round(v1,Read64(p));
+            v2 = Round(v2,Read64(p+8));
+            v3 = Round(v3,Read64(p+16));
+            v4 = Round(v4,Read64(p+24));
+            p += 32;
+        } while( p <= last );
+        h = Rotate(v1,1) + Rotate(v2,7) + Rotate(v3,12) + Rotate(v4,18);
+        h = Merge(h,v1);
+        h = Merge(h,v2);
+        h = Merge(h,v3);
+        h = Merge(h,v4);
+    } else {
+        h = seed + kPrime5;
+    }
+    h += static_cast<uint64_t>(length);
+
+    for( ; p + 8 <= end ; p += 8 ) {
+        h ^= Round(0,Read64(p));
+        h = Rotate(h,27) * kPrime1 + kPrime4;
+    }
+    if( p + 4 <= end ) {
+        h ^= static_cast<uint64_t>(Read32(p)) * kPrime1;
+        h = Rotate(h,23) * kPrime2 + kPrime3;
+        p += 4;
+    }
+    for( ; p < end ; ++p ) {
+        h ^= static_cast<uint64_t>(*p) * kPrime5;
+        h = Rotate(h,11) * kPrime1;
+    }
+
+    h ^= h >> 33;
+    h *= kPrime2;
+    h ^= h >> 29;
+    h *= kPrime3;
+    h ^= h >> 32;
+    return h;
+}
+
+}// namespace util
@@ -0,0 +1,10 @@
+#ifndef _HASH_H_
+#define _HASH_H_
+#include <cstddef>
+#include <stdint.h>
+namespace util {
+// 64 bits hash of a byte string , the xxh64 algorithm. It reads 32 bytes per
+// round , fast enough to key caches by the content of large payloads.
+uint64_t Hash64( const void* input , std::size_t length , uint64_t seed = 0 );
+}// namespace util
+#endif // _HASH_H_
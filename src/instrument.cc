@@ -0,0 +1,331 @@
+#include "instrument.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// =====================================================================
+// Instrumentation
+// Allocation counters are plain thread locals bumped by operator new , so
+// counting costs two adds per allocation and no lock. Hardware counters
+// are one perf event group per thread , opened on first use and read with
+// a single read() per sample. Per thread tables are never freed , they
+// are still there to be merged when the report is written at exit , after
+// the worker threads are gone.
+// =====================================================================
+
+namespace {
+
+thread_local uint64_t t_allocs = 0;
+thread_local uint64_t t_bytes = 0;
+
+void* Allocate( std::size_t size ) {
+    ++t_allocs;
+    t_bytes += size;
+    void* p = std::malloc(size == 0 ? 1 : size);
+    if( p == NULL ) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* AllocateAligned( std::size_t size , std::size_t alignment ) {
+    ++t_allocs;
+    t_bytes += size;
+    void* p = NULL;
+    if( posix_memalign(&p,alignment < sizeof(void*) ? sizeof(void*) : alignment,
+                       size == 0 ? 1 : size) != 0 ) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+using ::util::instrument::sample;
+using ::util::instrument::STAGE_COUNT;
+using ::util::instrument::COUNTER_COUNT;
+
+const bool kPerfWanted = std::getenv("PROTO2JSON_PERF") != NULL &&
+                         std::strcmp(std::getenv("PROTO2JSON_PERF"),"0") != 0;
+
+// Why the counters could not be opened , 0 while they could
+int g_perf_error = 0;
+
+class perf_group {
+public:
+    perf_group():
+        m_fd()
+    {
+        static const uint64_t kConfig[COUNTER_COUNT] = {
+            PERF_COUNT_HW_CPU_CYCLES,
+            PERF_COUNT_HW_CACHE_MISSES,
+            PERF_COUNT_HW_BRANCH_MISSES
+        };
+        for( int i = 0 ; i < COUNTER_COUNT ; ++i ) {
+            m_fd[i] = -1;
+        }
+        for( int i = 0 ; i < COUNTER_COUNT ; ++i ) {
+            perf_event_attr attr;
+            std::memset(&attr,0,sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = kConfig[i];
+            attr.read_format = PERF_FORMAT_GROUP;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            // This thread on any cpu , the first event leads the group
+            m_fd[i] = static_cast<int>(syscall(__NR_perf_event_open,&attr,0,-1,
+                                               i == 0 ? -1 : m_fd[0],0));
+            if( m_fd[i] < 0 ) {
+                g_perf_error = errno;
+                close_all();
+                return;
+            }
+        }
+    }
+
+    ~perf_group() {
+        close_all();
+    }
+
+    bool read( uint64_t* value ) const {
+        if( m_fd[0] < 0 ) {
+            return false;
+        }
+        struct {
+            uint64_t count;
+            uint64_t value[COUNTER_COUNT];
+        } group;
+        if( ::read(m_fd[0],&group,sizeof(group)) != static_cast<ssize_t>(sizeof(group)) ) {
+            return false;
+        }
+        std::memcpy(value,group.value,sizeof(group.value));
+        return true;
+    }
+
+private:
+    void close_all() {
+        for( int i = 0 ; i < COUNTER_COUNT ; ++i ) {
+            if( m_fd[i] >= 0 ) {
+                close(m_fd[i]);
+                m_fd[i] = -1;
+            }
+        }
+    }
+
+    int m_fd[COUNTER_COUNT];
+
+    void operator=( const perf_group& );
+    perf_group( const perf_group& );
+};
+
+struct totals {
+    uint64_t records;
+    uint64_t allocs;
+    uint64_t bytes;
+    uint64_t hardware[COUNTER_COUNT];
+};
+
+struct type_totals {
+    totals stage[STAGE_COUNT];
+};
+
+typedef std::map<std::string,type_totals> thread_table;
+
+std::mutex g_table_lock;
+std::vector<thread_table*> g_table; // Every thread that ended a stage
+
+thread_local thread_table* t_table = NULL;
+
+const char* const kStageName[STAGE_COUNT] = { "parse" , "convert" };
+
+class reporter {
+public:
+    reporter() {}
+
+    // Merge the tables of all threads and write one line per type and stage
+    ~reporter() {
+        thread_table merged;
+        {
+            std::lock_guard<std::mutex> guard(g_table_lock);
+            for( std::size_t i = 0 ; i < g_table.size() ; ++i ) {
+                thread_table::const_iterator itr = g_table[i]->begin();
+                for( ; itr != g_table[i]->end() ; ++itr ) {
+                    type_totals& into = merged[itr->first];
+                    for( int s = 0 ; s < STAGE_COUNT ; ++s ) {
+                        const totals& from = itr->second.stage[s];
+                        into.stage[s].records += from.records;
+                        into.stage[s].allocs += from.allocs;
+                        into.stage[s].bytes += from.bytes;
+                        for( int c = 0 ; c < COUNTER_COUNT ; ++c ) {
+                            into.stage[s].hardware[c] += from.hardware[c];
+                        }
+                    }
+                }
+            }
+        }
+        if( merged.empty() ) {
+            return;
+        }
+        const bool hardware = kPerfWanted && g_perf_error == 0;
+        std::fprintf(stderr,"%-40s %-8s %12s %14s %12s %12s",
+                     "type","stage","records","allocs","allocs/rec","bytes/rec");
+        if( hardware ) {
+            std::fprintf(stderr," %12s %14s %15s","cycles/rec","cache-miss/rec","branch-miss/rec");
+        }
+        std::fputc('\n',stderr);
+        thread_table::const_iterator itr = merged.begin();
+        for( ; itr != merged.end() ; ++itr ) {
+            for( int s = 0 ; s < STAGE_COUNT ; ++s ) {
+                const totals& t = itr->second.stage[s];
+                if( t.records == 0 ) {
+                    continue;
+                }
+                const double n = static_cast<double>(t.records);
+                std::fprintf(stderr,"%-40s %-8s %12llu %14llu %12.2f %12.1f",
+                             itr->first.c_str(),kStageName[s],
+                             static_cast<unsigned long long>(t.records),
+                             static_cast<unsigned long long>(t.allocs),
+                             t.allocs / n,t.bytes / n);
+                if( hardware ) {
+                    std::fprintf(stderr," %12.0f %14.2f %15.2f",
+                                 t.hardware[::util::instrument::COUNTER_CYCLES] / n,
+                                 t.hardware[::util::instrument::COUNTER_CACHE_MISSES] / n,
+                                 t.hardware[::util::instrument::COUNTER_BRANCH_MISSES] / n);
+                }
+                std::fputc('\n',stderr);
+            }
+        }
+        if( kPerfWanted && g_perf_error != 0 ) {
+            std::fprintf(stderr,"Hardware counters unavailable:%s\n",std::strerror(g_perf_error));
+        }
+    }
+
+private:
+    void operator=( const reporter& );
+    reporter( const reporter& );
+};
+
+// Defined after the tables , so it is destroyed before them
+reporter g_reporter;
+
+}// namespace
+
+void* operator new( std::size_t size ) {
+    return Allocate(size);
+}
+
+void* operator new[]( std::size_t size ) {
+    return Allocate(size);
+}
+
+void* operator new( std::size_t size , const std::nothrow_t& ) noexcept {
+    try {
+        return Allocate(size);
+    } catch( const std::bad_alloc& ) {
+        return NULL;
+    }
+}
+
+void* operator new[]( std::size_t size , const std::nothrow_t& ) noexcept {
+    try {
+        return Allocate(size);
+    } catch( const std::bad_alloc& ) {
+        return NULL;
+    }
+}
+
+void* operator new( std::size_t size , std::align_val_t alignment ) {
+    return AllocateAligned(size,static_cast<std::size_t>(alignment));
+}
+
+void* operator new[]( std::size_t size , std::align_val_t alignment ) {
+    return AllocateAligned(size,static_cast<std::size_t>(alignment));
+}
+
+void operator delete( void* p ) noexcept {
+    std::free(p);
+}
+
+void operator delete[]( void* p ) noexcept {
+    std::free(p);
+}
+
+void operator delete( void* p , std::size_t ) noexcept {
+    std::free(p);
+}
+
+void operator delete[]( void* p , std::size_t ) noexcept {
+    std::free(p);
+}
+
+void operator delete( void* p , const std::nothrow_t& ) noexcept {
+    std::free(p);
+}
+
+void operator delete[]( void* p , const std::nothrow_t& ) noexcept {
+    std::free(p);
+}
+
+void operator delete( void* p , std::align_val_t ) noexcept {
+    std::free(p);
+}
+
+void operator delete[]( void* p , std::align_val_t ) noexcept {
+    std::free(p);
+}
+
+void operator delete( void* p , std::size_t , std::align_val_t ) noexcept {
+    std::free(p);
+}
+
+void operator delete[]( void* p , std::size_t , std::align_val_t ) noexcept {
+    std::free(p);
+}
+
+namespace util {
+namespace instrument {
+
+void Begin( sample* begin ) {
+    begin->allocs = t_allocs;
+    begin->bytes = t_bytes;
+    std::memset(begin->hardware,0,sizeof(begin->hardware));
+    if( kPerfWanted ) {
+        // Opened by the first sample of the thread , closed at its exit
+        static thread_local perf_group group;
+        group.read(begin->hardware);
+    }
+}
+
+void End( const std::string& type , stage s , const sample& begin ) {
+    sample now;
+    Begin(&now);
+    if( t_table == NULL ) {
+        t_table = new thread_table();
+        std::lock_guard<std::mutex> guard(g_table_lock);
+        g_table.push_back(t_table);
+    }
+    thread_table::iterator itr = t_table->find(type);
+    if( itr == t_table->end() ) {
+        type_totals zero;
+        std::memset(&zero,0,sizeof(zero));
+        itr = t_table->insert(std::make_pair(type,zero)).first;
+    }
+    totals& t = itr->second.stage[s];
+    ++t.records;
+    t.allocs += now.allocs - begin.allocs;
+    t.bytes += now.bytes - begin.bytes;
+    for( int c = 0 ; c < COUNTER_COUNT ; ++c ) {
+        t.hardware[c] += now.hardware[c] - begin.hardware[c];
+    }
+}
+
+}// namespace instrument
+}// namespace util
@@ -0,0 +1,58 @@
+#ifndef _INSTRUMENT_H_
+#define _INSTRUMENT_H_
+#include <cstddef>
+#include <stdint.h>
+#include <string>
+
+// =====================================================================
+// Instrumentation
+// Built only by `make instrument` , which defines PROTO2JSON_INSTRUMENT
+// and links instrument.cc : it replaces the global operator new to count
+// the heap allocations and bytes of each thread , and with PROTO2JSON_PERF=1
+// in the environment reads cycles , cache misses and branch misses of the
+// thread through perf_event_open. A stage is bracketed by INSTRUMENT_BEGIN
+// and INSTRUMENT_END , which add the difference to a table of the thread
+// keyed by record type and stage. Tables are merged into one report on
+// stderr at exit. In the normal build both macros are empty.
+// =====================================================================
+
+namespace util {
+namespace instrument {
+
+enum stage {
+    STAGE_PARSE = 0,
+    STAGE_CONVERT,
+    STAGE_COUNT
+};
+
+enum counter {
+    COUNTER_CYCLES = 0,
+    COUNTER_CACHE_MISSES,
+    COUNTER_BRANCH_MISSES,
+    COUNTER_COUNT
+};
+
+// Counters of the calling thread at some point
+struct sample {
+    uint64_t allocs;
+    uint64_t bytes;
+    uint64_t hardware[COUNTER_COUNT];
+};
+
+void Begin( sample* begin );
+// Add what the calling thread did since begin to type and stage. Looking the
+// type up only allocates the first time it is seen by the thread.
+void End( const std::string& type , stage s , const sample& begin );
+
+}// namespace instrument
+}// namespace util
+
+#ifdef PROTO2JSON_INSTRUMENT
+#define INSTRUMENT_BEGIN(S) ::util::instrument::sample S; ::util::instrument::Begin(&S)
+#define INSTRUMENT_END(TYPE,STAGE,S) ::util::instrument::End(TYPE,::util::instrument::STAGE,S)
+#else
+#define INSTRUMENT_BEGIN(S)
+#define INSTRUMENT_END(TYPE,STAGE,S)
+#endif
+
+#endif // _INSTRUMENT_H_
@@ -0,0 +1,118 @@
+#include "itoa.h"
+#include <cstring>
+
+// =====================================================================
+// Integer formatting
+// The ostream path for integer goes through locale facets and a virtual
+// call chain for every single value. Here we use the classic digit pair
+// table : each loop retires 2 digits with one division by 100 and a 2
+// bytes copy from the table. The digit count is computed up front, so
+// we write backward from the end of number directly into the output and
+// never need to reverse the buffer. The 64 bits version splits the value
+// into 32 bits chunks so most of the division work is done with 32 bits
+// arithmetic which is way cheaper than the 64 bits one.
+// =====================================================================
+
+namespace {
+
+static const char kDigitPair[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+inline int CountDigit32( uint32_t v ) {
+    // Branches here are well predicted since the magnitude of field values
+    // normally does not jump around a lot within a record stream.
+    if( v < 10 ) return 1;
+    if( v < 100 ) return 2;
+    if( v < 1000 ) return 3;
+    if( v < 10000 ) return 4;
+    if( v < 100000 ) return 5;
+    if( v < 1000000 ) return 6;
+    if( v < 10000000 ) return 7;
+    if( v < 100000000 ) return 8;
+    if( v < 1000000000 ) return 9;
+    return 10;
+}
+
+// Write exactly digit characters of v ending at end.
+inline void WriteBackward( uint32_t v , char* end ) {
+    while( v >= 100 ) {
+        const uint32_t idx = (v % 100) * 2;
+        v /= 100;
+        end -= 2;
+        std::memcpy(end,kDigitPair+idx,2);
+    }
+    if( v < 10 ) {
+        *--end = static_cast<char>('0' + v);
+    } else {
+        end -= 2;
+        std::memcpy(end,kDigitPair+v*2,2);
+    }
+}
+
+// Write exactly 8 digits including leading zeros , v < 100000000.
+inline void WriteFixed8( uint32_t v , char* buffer ) {
+    const uint32_t hi = v / 10000;
+    const uint32_t lo = v % 10000;
+    std::memcpy(buffer  ,kDigitPair+(hi/100)*2,2);
+    std::memcpy(buffer+2,kDigitPair+(hi%100)*2,2);
+    std::memcpy(buffer+4,kDigitPair+(lo/100)*2,2);
+    std::memcpy(buffer+6,kDigitPair+(lo%100)*2,2);
+}
+
+}// namespace
+
+namespace util {
+
+char* FormatUInt32( uint32_t value , char* buffer ) {
+    char* end = buffer + CountDigit32(value);
+    WriteBackward(value,end);
+    return end;
+}
+
+char* FormatInt32( int32_t value , char* buffer ) {
+    uint32_t u = static_cast<uint32_t>(value);
+    if( value < 0 ) {
+        *buffer++ = '-';
+        u = ~u + 1;
+    }
+    return FormatUInt32(u,buffer);
+}
+
+char* FormatUInt64( uint64_t value , char* buffer ) {
+    if( value <= 0xffffffffu ) {
+        return FormatUInt32(static_cast<uint32_t>(value),buffer);
+    }
+    static const uint64_t kE8 = 100000000;
+    if( value < kE8 * kE8 ) {
+        // 10 to 16 digits : high part is variable , low part is 8 fixed.
+        buffer = FormatUInt32(static_cast<uint32_t>(value / kE8),buffer);
+        WriteFixed8(static_cast<uint32_t>(value % kE8),buffer);
+        return buffer + 8;
+    }
+    // 17 to 20 digits : at most 4 digits on top and 2 fixed 8 groups.
+    const uint64_t rest = value % (kE8 * kE8);
+    buffer = FormatUInt32(static_cast<uint32_t>(value / (kE8 * kE8)),buffer);
+    WriteFixed8(static_cast<uint32_t>(rest / kE8),buffer);
+    WriteFixed8(static_cast<uint32_t>(rest % kE8),buffer+8);
+    return buffer + 16;
+}
+
+char* FormatInt64( int64_t value , char* buffer ) {
+    uint64_t u = static_cast<uint64_t>(value);
+    if( value < 0 ) {
+        *buffer++ = '-';
+        u = ~u + 1;
+    }
+    return FormatUInt64(u,buffer);
+}
+
+}// namespace util
@@ -0,0 +1,17 @@
+#ifndef _ITOA_H_
+#define _ITOA_H_
+#include <cstddef>
+#include <stdint.h>
+namespace util {
+// Largest output of any routine below : 20 digits plus a sign.
+static const std::size_t kIntegerBufferSize = 24;
+
+// Write the decimal form of the value into buffer , which must have at least
+// kIntegerBufferSize bytes. No terminating zero is written. Return pointer to
+// the end of the written characters.
+char* FormatUInt32( uint32_t value , char* buffer );
+char* FormatInt32 ( int32_t  value , char* buffer );
+char* FormatUInt64( uint64_t value , char* buffer );
+char* FormatInt64 ( int64_t  value , char* buffer );
+}// namespace util
+#endif // _ITOA_H_
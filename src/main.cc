@@ -0,0 +1,1682 @@
+#include <iostream>
+#include <fstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <getopt.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+#include <google/protobuf/io/zero_copy_stream_impl.h> // For reading stdin
+#include <google/protobuf/io/coded_stream.h>   // For delimited records
+
+#include "proto2json.h"  // For the converter library
+#include "thread_pool.h" // For parallel conversion
+#include "columnar.h"    // For columnar output
+#include "record_index.h" // For random access into delimited input
+#include "field_stats.h"  // For --stats_only
+#include "wire_validator.h" // For --validate and --skip_corrupt
+#include "partition_writer.h" // For --partition_by
+#include "record_diff.h"  // For --diff
+#include "record_sampler.h" // For --sample , --every and --sample_count
+#include "record_salvager.h" // For --skip_corrupt
+#include "file_follower.h" // For --follow
+
+
+#define DISALLOW_COPY_AND_ASSIGN(X) \
+  void operator=( const X& ); \
+  X(const X&)
+
+namespace {
+using namespace google::protobuf;
+
+// Destination of serialized records , one implementation per output format
+class record_sink {
+public:
+  virtual ~record_sink() {}
+  virtual bool write( const char* data , std::size_t size ) = 0;
+  // Push the records written so far out , when more could take a while
+  virtual bool flush() { return true; }
+  // Called once after the last record
+  virtual bool finish() { return flush(); }
+};
+
+// Record goes through the library converter into json , msgpack or cbor
+class converter_sink : public record_sink {
+public:
+  converter_sink( proto2json::converter* conv , // Owned
+                  std::ostream& output ,
+                  bool line ):
+    m_converter( conv ),
+    m_output( output ),
+    m_line( line ),
+    m_record()
+  {}
+
+  ~converter_sink() {
+    delete m_converter;
+  }
+
+  virtual bool write( const char* data , std::size_t size ) {
+    m_record.clear();
+    if( !m_converter->convert(data,size,&m_record) ) {
+      return false;
+    }
+    if( m_line ) {
+      m_record.push_back('\n');
+    }
+    m_output.write(m_record.data(),m_record.size());
+    return m_output.good();
+  }
+
+  virtual bool flush() {
+    m_output.flush();
+    return m_output.good();
+  }
+
+private:
+  proto2json::converter* m_converter;
+  std::ostream& m_output;
+  bool m_line; // One record per line
+  std::string m_record; // Reused output buffer
+
+  DISALLOW_COPY_AND_ASSIGN(converter_sink);
+};
+
+class columnar_sink : public record_sink {
+public:
+  columnar_sink( std::ostream& output , std::size_t row_group_size ):
+    m_writer( output , row_group_size ),
+    m_message( NULL )
+  {}
+
+  ~columnar_sink() {
+    delete m_message;
+  }
+
+  bool init( const Descriptor* descriptor , const Message* prototype ) {
+    m_message = prototype->New();
+    return m_writer.init(descriptor);
+  }
+
+  virtual bool write( const char* data , std::size_t size ) {
+    if( size > static_cast<std::size_t>(INT_MAX) ||
+        !m_message->ParseFromArray(data,static_cast<int>(size)) ) {
+      return false;
+    }
+    m_writer.append(*m_message);
+    return true;
+  }
+
+  virtual bool finish() {
+    return m_writer.finish();
+  }
+
+private:
+  proto2json::columnar_writer m_writer;
+  Message* m_message;
+
+  DISALLOW_COPY_AND_ASSIGN(columnar_sink);
+};
+
+// Record is only folded into field statistics , nothing is written. With a
+// pool , records are gathered into batches and every batch is cut into one
+// slice per thread ; each slice owns its accumulator and message , so the
+// threads share nothing until finish() merges the accumulators into total.
+class stats_sink : public record_sink {
+public:
+  stats_sink( const Descriptor* descriptor , const Message* prototype ,
+              ::util::thread_pool* pool ,
+              proto2json::field_stats* total , std::mutex* total_lock ):
+    m_pool( pool ),
+    m_total( total ),
+    m_total_lock( total_lock ),
+    m_stats(),
+    m_message(),
+    m_batch(),
+    m_batch_size( 0 )
+  {
+    const std::size_t slices = pool == NULL ? 1 : pool->thread_count();
+    for( std::size_t i = 0 ; i < slices ; ++i ) {
+      m_stats.push_back(new proto2json::field_stats(descriptor));
+      m_message.push_back(prototype->New());
+    }
+  }
+
+  ~stats_sink() {
+    for( std::size_t i = 0 ; i < m_stats.size() ; ++i ) {
+      delete m_stats[i];
+      delete m_message[i];
+    }
+  }
+
+  virtual bool write( const char* data , std::size_t size ) {
+    if( m_pool == NULL ) {
+      return fold(0,data,size);
+    }
+    // Batch strings are reused , so their buffers are only grown
+    if( m_batch_size == m_batch.size() ) {
+      m_batch.push_back(std::string());
+    }
+    m_batch[m_batch_size++].assign(data,size);
+    return m_batch_size < kBatchSize || flush();
+  }
+
+  virtual bool finish() {
+    if( !flush() ) {
+      return false;
+    }
+    std::lock_guard<std::mutex> guard(*m_total_lock);
+    for( std::size_t i = 0 ; i < m_stats.size() ; ++i ) {
+      m_total->merge(*m_stats[i]);
+    }
+    return true;
+  }
+
+private:
+  static const std::size_t kBatchSize = 4096;
+
+  bool fold( std::size_t slice , const char* data , std::size_t size ) {
+    if( size > static_cast<std::size_t>(INT_MAX) ||
+        !m_message[slice]->ParseFromArray(data,static_cast<int>(size)) ) {
+      return false;
+    }
+    m_stats[slice]->add(*m_message[slice]);
+    return true;
+  }
+
+  bool flush() {
+    if( m_batch_size == 0 ) {
+      return true;
+    }
+    std::atomic<bool> ok(true);
+    const std::size_t slices = m_stats.size();
+    std::vector< ::util::thread_pool::task > tasks;
+    for( std::size_t i = 0 ; i < slices ; ++i ) {
+      const std::size_t begin = m_batch_size * i / slices;
+      const std::size_t end = m_batch_size * (i + 1) / slices;
+      tasks.push_back( [this,&ok,i,begin,end]() {
+        for( std::size_t j = begin ; j < end ; ++j ) {
+          if( !fold(i,m_batch[j].data(),m_batch[j].size()) ) {
+            ok = false;
+          }
+        }
+      });
+    }
+    m_pool->run(&tasks);
+    m_batch_size = 0;
+    return ok;
+  }
+
+  ::util::thread_pool* m_pool;
+  proto2json::field_stats* m_total;
+  std::mutex* m_total_lock;
+  std::vector<proto2json::field_stats*> m_stats;  // One per slice
+  std::vector<Message*> m_message;                // One per slice
+  std::vector<std::string> m_batch;
+  std::size_t m_batch_size;
+
+  DISALLOW_COPY_AND_ASSIGN(stats_sink);
+};
+
+// Record is converted and appended to the partition of its key. The key is
+// picked from the wire bytes before converting , without parsing them.
+class partition_sink : public record_sink {
+public:
+  partition_sink( proto2json::converter* conv ,
+                  const std::vector<const FieldDescriptor*>& path ,
+                  proto2json::partition_writer* writer , bool line ):
+    m_converter( conv ),
+    m_path( path ),
+    m_writer( writer ),
+    m_line( line ),
+    m_key(),
+    m_record()
+  {}
+
+  ~partition_sink() {
+    delete m_converter;
+  }
+
+  virtual bool write( const char* data , std::size_t size ) {
+    const bool missing = !proto2json::extract_field_key(data,size,m_path,&m_key);
+    if( !missing ) {
+      proto2json::name_index_key(m_path.back(),&m_key);
+    }
+    m_record.clear();
+    if( !m_converter->convert(data,size,&m_record) ) {
+      return false;
+    }
+    if( m_line ) {
+      m_record.push_back('\n');
+    }
+    return m_writer->write(m_key,missing,m_record.data(),m_record.size());
+  }
+
+  virtual bool finish() {
+    return m_writer->finish();
+  }
+
+private:
+  proto2json::converter* m_converter;
+  const std::vector<const FieldDescriptor*>& m_path;
+  proto2json::partition_writer* m_writer;
+  bool m_line;
+  std::string m_key;
+  std::string m_record;
+
+  DISALLOW_COPY_AND_ASSIGN(partition_sink);
+};
+
+// Read the next record framed with a varint length prefix , which is what
+// writeDelimitedTo produces. Return false at the end of input or on error ,
+// eof tells them apart. A NULL record skips the record by its length prefix :
+// the payload is never copied and , on a seekable input , not even read.
+bool read_delimited( io::ZeroCopyInputStream* input , std::string* record , bool* eof ) {
+  // Fresh CodedInputStream per record keeps its int position counter small
+  io::CodedInputStream coded(input);
+  const void* data;
+  int size;
+  *eof = false;
+  if( !coded.GetDirectBufferPointer(&data,&size) ) {
+    *eof = true;
+    return false;
+  }
+  uint32_t length;
+  if( !coded.ReadVarint32(&length) ) {
+    return false;
+  }
+  if( record == NULL ) {
+    return coded.Skip(static_cast<int>(length));
+  }
+  return coded.ReadString(record,static_cast<int>(length));
+}
+
+struct option kOptions[] = {
+  {"proto",required_argument,0,'p'},
+  {"import_path",required_argument,0,'I'},
+  {"message",required_argument,0,'m'},
+  {"double_to_string",optional_argument,0,'d'},
+  {"float_to_string",optional_argument,0,'f'},
+  {"display_enum_index",optional_argument,0,'e'},
+  {"proto3_integer",no_argument,0,'i'},
+  {"stream",no_argument,0,'s'},
+  {"jobs",required_argument,0,'j'},
+  {"lazy",no_argument,0,'l'},
+  {"max_depth",required_argument,0,'D'},
+  {"memo_cache",required_argument,0,'Q'},
+  {"truncate_marker",no_argument,0,'T'},
+  {"unknown_fields",no_argument,0,'u'},
+  {"emit_defaults",no_argument,0,'E'},
+  {"sort_map_keys",no_argument,0,'M'},
+  {"delimited",no_argument,0,'r'},
+  {"format",required_argument,0,'F'},
+  {"row_group_size",required_argument,0,'G'},
+  {"type_field",required_argument,0,'t'},
+  {"payload_field",required_argument,0,'y'},
+  {"input_dir",required_argument,0,'n'},
+  {"output_dir",required_argument,0,'o'},
+  {"build_index",no_argument,0,'b'},
+  {"index_key",required_argument,0,'k'},
+  {"range",required_argument,0,'a'},
+  {"key",required_argument,0,'K'},
+  {"sample",required_argument,0,'S'},
+  {"every",required_argument,0,'N'},
+  {"sample_count",required_argument,0,'C'},
+  {"stats_only",no_argument,0,'Z'},
+  {"validate",no_argument,0,'V'},
+  {"follow",no_argument,0,'w'},
+  {"skip_corrupt",no_argument,0,'X'},
+  {"partition_by",required_argument,0,'P'},
+  {"partition_size",required_argument,0,'R'},
+  {"max_open_files",required_argument,0,'L'},
+  {"gzip",no_argument,0,'z'},
+  {"diff",no_argument,0,'x'},
+  {0,0,0,0}
+};
+
+struct command_option {
+  std::string proto_path;
+  std::vector<std::string> import_path;
+  std::string message;
+  bool stream;
+  bool lazy;
+  bool delimited;
+  int jobs;
+  std::string format;
+  int row_group_size;
+  std::vector<std::string> inputs; // Input files , stdin when empty
+  std::string input_dir;
+  std::string output_dir;
+  bool build_index;
+  std::string index_key;  // Field whose value is indexed
+  bool range;
+  uint64_t range_begin;
+  uint64_t range_end;
+  bool key;
+  std::string key_value;
+  double sample;          // Probability a record is picked , 0 for no sampling
+  uint64_t every;         // Pick every Nth record , 0 for no sampling
+  uint64_t sample_count;  // Reservoir size , 0 for no sampling
+  bool stats_only;
+  bool validate;
+  bool follow;
+  bool skip_corrupt;
+  std::string partition_by;     // Field path whose value picks the partition
+  uint64_t partition_size;      // Rotate part files at this size , 0 never
+  int max_open_files;
+  bool gzip;
+  bool diff;
+  proto2json::option option;
+
+  command_option():
+    proto_path(),
+    import_path(),
+    message(),
+    stream( false ),
+    lazy( false ),
+    delimited( false ),
+    jobs( 1 ),
+    format( "json" ),
+    row_group_size( 65536 ),
+    inputs(),
+    input_dir(),
+    output_dir(),
+    build_index( false ),
+    index_key(),
+    range( false ),
+    range_begin( 0 ),
+    range_end( 0 ),
+    key( false ),
+    key_value(),
+    sample( 0 ),
+    every( 0 ),
+    sample_count( 0 ),
+    stats_only( false ),
+    validate( false ),
+    follow( false ),
+    skip_corrupt( false ),
+    partition_by(),
+    partition_size( 0 ),
+    max_open_files( 64 ),
+    gzip( false ),
+    diff( false ),
+    option()
+  {}
+};
+
+void show_error() {
+  std::cerr<<"Usage: proto2json [options] [input files]\n";
+  std::cerr<<"Convert a protocol buffer record to json format!\n";
+  std::cerr<<" --proto,-p                           Protocol buffer schema file path\n";
+  std::cerr<<" --import_path,-I                     Directory searched for imports , could repeat. Without --proto\n";
+  std::cerr<<"                                      the file declaring --message is found under these directories\n";
+  std::cerr<<" --message,-m                         Message name\n";
+  std::cerr<<" --double_to_string,-d                Output double as string instead of numeric number\n";
+  std::cerr<<" --float_to_string,-f                 Output float as string instead of numeric number\n";
+  std::cerr<<" --display_enum_index,-e              Display enum value's index\n";
+  std::cerr<<" --proto3_integer,-i                  Quote only 64 bits integer , as proto3 json mapping\n";
+  std::cerr<<" --stream,-s                          Convert top level repeated message field one element at a time\n";
+  std::cerr<<" --jobs,-j                            Threads used to convert input files , or huge repeated message field\n";
+  std::cerr<<" --lazy,-l                            Decode submessage only when it is written , packed integers in one pass\n";
+  std::cerr<<" --max_depth,-D                       Write submessage deeper than this as raw base64 bytes , implies --lazy\n";
+  std::cerr<<" --memo_cache,-Q                      MB of converted submessages kept per thread , identical submessage\n";
+  std::cerr<<"                                      bytes are written from it without decoding , implies --lazy\n";
+  std::cerr<<" --truncate_marker,-T                 Write \"<truncated>\" instead of raw bytes beyond --max_depth\n";
+  std::cerr<<" --unknown_fields,-u                  Write fields not in schema keyed by field number\n";
+  std::cerr<<" --emit_defaults,-E                   Write absent fields as well , as null or empty array\n";
+  std::cerr<<" --sort_map_keys,-M                   Write the entries of map fields ordered by key\n";
+  std::cerr<<" --delimited,-r                       Input is a stream of varint length prefixed records\n";
+  std::cerr<<" --format,-F                          Output format : json(default) , msgpack , cbor or columnar\n";
+  std::cerr<<" --row_group_size,-G                  Records per row group of columnar output\n";
+  std::cerr<<" --type_field,-t                      String field naming the message type of the payload field\n";
+  std::cerr<<" --payload_field,-y                   Bytes field decoded as the type named by --type_field\n";
+  std::cerr<<" --input_dir,-n                       Convert every file of the directory , like listing them as inputs\n";
+  std::cerr<<" --output_dir,-o                      Directory of per input outputs , default is next to the input\n";
+  std::cerr<<" --build_index,-b                     Write the record offsets of a delimited input file into <input>.idx\n";
+  std::cerr<<" --index_key,-k                       Top level field whose value is indexed as well , for --key\n";
+  std::cerr<<" --range,-a                           Convert records a to b-1 , given as a:b , of an indexed input file\n";
+  std::cerr<<" --key,-K                             Convert the records whose index key equals the value\n";
+  std::cerr<<" --sample,-S                          Convert each delimited record with this probability , skip the rest unparsed\n";
+  std::cerr<<" --every,-N                           Convert every Nth delimited record , skip the rest unparsed\n";
+  std::cerr<<" --sample_count,-C                    Convert K delimited records picked uniformly in one pass\n";
+  std::cerr<<" --stats_only,-Z                      Write per field statistics of all the inputs instead of the records\n";
+  std::cerr<<" --validate,-V                        Check the inputs are well formed against the schema , without converting\n";
+  std::cerr<<" --follow,-w                          Keep converting the records appended to a delimited input file ,\n";
+  std::cerr<<"                                      across rotation , resuming from <input>.offset\n";
+  std::cerr<<" --skip_corrupt,-X                    Log and skip malformed delimited records , resynchronize past a broken\n";
+  std::cerr<<"                                      length prefix , instead of failing the input\n";
+  std::cerr<<" --partition_by,-P                    Field path , like a.b , whose value splits delimited records into\n";
+  std::cerr<<"                                      <output_dir>/<field>=<value>/ directories\n";
+  std::cerr<<" --partition_size,-R                  Start a new part file of a partition once it has this many bytes\n";
+  std::cerr<<" --max_open_files,-L                  Partition files kept open at once , default is 64\n";
+  std::cerr<<" --gzip,-z                            Compress partition files with gzip\n";
+  std::cerr<<" --diff,-x                            Compare the records of two input files pair by pair and write a json\n";
+  std::cerr<<"                                      patch per differing pair , exit status 1 when any differs\n";
+}
+
+// Range is a:b , either side could be left out for the first record or the
+// end of the input
+bool parse_range( const char* value , command_option* opt ) {
+  const char* colon = strchr(value,':');
+  if( colon == NULL ) {
+    return false;
+  }
+  char* end;
+  opt->range = true;
+  opt->range_begin = 0;
+  opt->range_end = UINT64_MAX;
+  if( colon != value ) {
+    opt->range_begin = strtoull(value,&end,10);
+    if( end != colon ) {
+      return false;
+    }
+  }
+  if( colon[1] != 0 ) {
+    opt->range_end = strtoull(colon+1,&end,10);
+    if( *end != 0 ) {
+      return false;
+    }
+  }
+  return opt->range_begin <= opt->range_end;
+}
+
+bool parse_command( int argc, char* argv[] , command_option* opt ) {
+  int opt_index = 0;
+  int c;
+  while((c = getopt_long(argc,argv,"p:I:m:dfpreisj:lD:TuEMrF:G:t:y:n:o:bk:a:K:S:N:C:ZVwXP:R:L:zQ:x",kOptions,&opt_index))!=-1) {
+    switch(c) {
+      case 'p':
+        opt->proto_path = optarg;
+        break;
+      case 'I':
+        opt->import_path.push_back(optarg);
+        break;
+      case 'm':
+        opt->message = optarg;
+        break;
+      case 'd':
+        opt->option.double_to_string = true;
+        break;
+      case 'f':
+        opt->option.float_to_string = true;
+        break;
+      case 'e':
+        opt->option.display_enum_index = true;
+        break;
+      case 'i':
+        opt->option.set_proto3_integer();
+        break;
+      case 's':
+        opt->stream = true;
+        break;
+      case 'l':
+        opt->lazy = true;
+        break;
+      case 'D':
+        opt->lazy = true;
+        opt->option.max_depth = atoi(optarg);
+        if( opt->option.max_depth < 0 ) {
+          show_error();
+          return false;
+        }
+        break;
+      case 'Q':
+        opt->lazy = true;
+        opt->option.memo_size = static_cast<std::size_t>(strtoull(optarg,NULL,10)) << 20;
+        if( opt->option.memo_size == 0 ) {
+          show_error();
+          return false;
+        }
+        break;
+      case 'T':
+        opt->option.truncate_marker = true;
+        break;
+      case 'u':
+        opt->option.unknown_fields = true;
+        break;
+      case 'E':
+        opt->option.emit_defaults = true;
+        break;
+      case 'M':
+        opt->option.sort_map_keys = true;
+        break;
+      case 'r':
+        opt->delimited = true;
+        break;
+      case 'F':
+        opt->format = optarg;
+        if( opt->format != "json" && opt->format != "msgpack" &&
+            opt->format != "cbor" && opt->format != "columnar" ) {
+          show_error();
+          return false;
+        }
+        break;
+      case 'G':
+        opt->row_group_size = atoi(optarg);
+        if( opt->row_group_size <= 0 ) {
+          show_error();
+          return false;
+        }
+        break;
+      case 't':
+        opt->option.type_field = optarg;
+        break;
+      case 'y':
+        opt->option.payload_field = optarg;
+        break;
+      case 'n':
+        opt->input_dir = optarg;
+        break;
+      case 'o':
+        opt->output_dir = optarg;
+        break;
+      case 'b':
+        opt->build_index = true;
+        break;
+      case 'k':
+        opt->index_key = optarg;
+        break;
+      case 'a':
+        if( !parse_range(optarg,opt) ) {
+          show_error();
+          return false;
+        }
+        break;
+      case 'K':
+        opt->key = true;
+        opt->key_value = optarg;
+        break;
+      case 'S':
+        opt->sample = atof(optarg);
+        if( !(opt->sample > 0 && opt->sample <= 1) ) {
+          show_error();
+          return false;
+        }
+        break;
+      case 'N':
+        opt->every = strtoull(optarg,NULL,10);
+        if( opt->every == 0 ) {
+          show_error();
+          return false;
+        }
+        break;
+      case 'C':
+        opt->sample_count = strtoull(optarg,NULL,10);
+        if( opt->sample_count == 0 ) {
+          show_error();
+          return false;
+        }
+        break;
+      case 'Z':
+        opt->stats_only = true;
+        break;
+      case 'V':
+        opt->validate = true;
+        break;
+      case 'w':
+        opt->follow = true;
+        break;
+      case 'X':
+        opt->skip_corrupt = true;
+        break;
+      case 'P':
+        opt->partition_by = optarg;
+        break;
+      case 'R':
+        opt->partition_size = strtoull(optarg,NULL,10);
+        if( opt->partition_size == 0 ) {
+          show_error();
+          return false;
+        }
+        break;
+      case 'L':
+        opt->max_open_files = atoi(optarg);
+        if( opt->max_open_files <= 0 ) {
+          show_error();
+          return false;
+        }
+        break;
+      case 'z':
+        opt->gzip = true;
+        break;
+      case 'x':
+        opt->diff = true;
+        break;
+      case 'j':
+        opt->jobs = atoi(optarg);
+        if( opt->jobs <= 0 ) {
+          show_error();
+          return false;
+        }
+        break;
+      default:
+        show_error();
+        return false;
+    }
+  }
+  for( int i = optind ; i < argc ; ++i ) {
+    opt->inputs.push_back(argv[i]);
+  }
+  if( (opt->proto_path.empty() && opt->import_path.empty()) || opt->message.empty() ) {
+    show_error();
+    return false;
+  }
+  if( opt->stream && (opt->delimited || opt->format != "json") ) {
+    std::cerr<<"--stream only works with a single record and json output\n";
+    return false;
+  }
+  if( opt->build_index || opt->range || opt->key ) {
+    if( !opt->delimited || opt->inputs.size() != 1 || !opt->input_dir.empty() ) {
+      std::cerr<<"--build_index , --range and --key need --delimited and one input file\n";
+      return false;
+    }
+    if( opt->build_index + opt->range + opt->key > 1 ) {
+      std::cerr<<"Only one of --build_index , --range and --key could be given\n";
+      return false;
+    }
+  }
+  if( opt->sample > 0 || opt->every > 0 || opt->sample_count > 0 ) {
+    if( !opt->delimited || opt->build_index || opt->range || opt->key ) {
+      std::cerr<<"Sampling needs --delimited and does not work with the index\n";
+      return false;
+    }
+    if( (opt->sample > 0) + (opt->every > 0) + (opt->sample_count > 0) > 1 ) {
+      std::cerr<<"Only one of --sample , --every and --sample_count could be given\n";
+      return false;
+    }
+  }
+  if( opt->stats_only ) {
+    if( opt->stream || opt->build_index || opt->range || opt->key ||
+        opt->format == "columnar" || !opt->option.type_field.empty() ) {
+      std::cerr<<"--stats_only does not work with --stream , the index , "
+                 "columnar output or --type_field\n";
+      return false;
+    }
+  }
+  if( opt->validate ) {
+    if( opt->stream || opt->stats_only || opt->build_index || opt->range || opt->key ||
+        opt->sample > 0 || opt->every > 0 || opt->sample_count > 0 ) {
+      std::cerr<<"--validate does not work with --stream , --stats_only , the index or sampling\n";
+      return false;
+    }
+  }
+  if( opt->skip_corrupt ) {
+    if( !opt->delimited ) {
+      std::cerr<<"--skip_corrupt needs --delimited\n";
+      return false;
+    }
+    if( opt->follow || opt->validate || opt->build_index || opt->range || opt->key ||
+        opt->sample > 0 || opt->every > 0 || opt->sample_count > 0 ) {
+      std::cerr<<"--skip_corrupt does not work with --follow , --validate , the index or sampling\n";
+      return false;
+    }
+  }
+  if( !opt->partition_by.empty() ) {
+    if( !opt->delimited || opt->output_dir.empty() ) {
+      std::cerr<<"--partition_by needs --delimited and --output_dir\n";
+      return false;
+    }
+    if( opt->stream || opt->stats_only || opt->validate || opt->follow || opt->build_index ||
+        opt->range || opt->key || opt->format == "columnar" ) {
+      std::cerr<<"--partition_by does not work with --stream , --stats_only , --validate , "
+                 "--follow , the index or columnar output\n";
+      return false;
+    }
+  } else if( opt->partition_size > 0 || opt->gzip ) {
+    std::cerr<<"--partition_size and --gzip need --partition_by\n";
+    return false;
+  }
+  if( opt->follow ) {
+    if( !opt->delimited || opt->inputs.size() != 1 || !opt->input_dir.empty() ) {
+      std::cerr<<"--follow needs --delimited and one input file\n";
+      return false;
+    }
+    if( opt->stream || opt->stats_only || opt->validate || opt->build_index ||
+        opt->range || opt->key || opt->sample > 0 || opt->every > 0 ||
+        opt->sample_count > 0 || opt->format == "columnar" ) {
+      std::cerr<<"--follow does not work with --stream , --stats_only , --validate , "
+                 "the index , sampling or columnar output\n";
+      return false;
+    }
+  }
+  if( opt->diff ) {
+    if( opt->inputs.size() != 2 || !opt->input_dir.empty() || !opt->output_dir.empty() ) {
+      std::cerr<<"--diff needs two input files and writes to stdout\n";
+      return false;
+    }
+    if( opt->stream || opt->stats_only || opt->validate || opt->follow || opt->skip_corrupt ||
+        !opt->partition_by.empty() || opt->build_index || opt->range || opt->key ||
+        opt->sample > 0 || opt->every > 0 || opt->sample_count > 0 || opt->format != "json" ) {
+      std::cerr<<"--diff does not work with --stream , --stats_only , --validate , --follow , "
+                 "--skip_corrupt , --partition_by , the index , sampling or another format than json\n";
+      return false;
+    }
+  }
+  if( !opt->index_key.empty() && !opt->build_index ) {
+    std::cerr<<"--index_key only works with --build_index\n";
+    return false;
+  }
+  if( opt->option.type_field.empty() != opt->option.payload_field.empty() ) {
+    std::cerr<<"--type_field and --payload_field must be given together\n";
+    return false;
+  }
+  if( !opt->option.type_field.empty() && opt->format == "columnar" ) {
+    std::cerr<<"--type_field does not work with columnar output\n";
+    return false;
+  }
+  if( opt->lazy && opt->format == "columnar" ) {
+    std::cerr<<"--lazy , --max_depth and --memo_cache do not work with columnar output\n";
+    return false;
+  }
+  return true;
+}
+
+// Read the whole input , return false on read error
+bool read_all( int input , std::string* data ) {
+  char buffer[65536];
+  while( true ) {
+    const ssize_t size = read(input,buffer,sizeof(buffer));
+    if( size == 0 ) {
+      return true;
+    } else if( size < 0 ) {
+      if( errno == EINTR ) {
+        continue;
+      }
+      return false;
+    }
+    data->append(buffer,size);
+  }
+}
+
+// Convert the sampled records of a delimited input , return false on a broken
+// input or a record which does not parse.
+bool convert_sampled( proto2json::record_sampler* sampler , io::ZeroCopyInputStream* stream ,
+                      record_sink* sink ) {
+  std::string data;
+  bool eof = false;
+  uint64_t position = 0;
+  while( true ) {
+    bool ok = true;
+    for( uint64_t skip = sampler->next_skip() ; skip > 0 && ok ; --skip , ++position ) {
+      ok = read_delimited(stream,NULL,&eof);
+    }
+    if( !ok || !read_delimited(stream,&data,&eof) ) {
+      break;
+    }
+    if( sampler->take(position++,&data) && !sink->write(data.data(),data.size()) ) {
+      return false;
+    }
+  }
+  if( !eof ) {
+    return false;
+  }
+  if( sampler->is_reservoir() ) {
+    std::vector< std::pair<uint64_t,std::string> >* reservoir = sampler->reservoir();
+    for( std::size_t i = 0 ; i < reservoir->size() ; ++i ) {
+      const std::string& record = (*reservoir)[i].second;
+      if( !sink->write(record.data(),record.size()) ) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+
+// Hand the records of a damaged delimited input to the sink , skipping what
+// is malformed. Return false on a read error only.
+bool read_salvaged( const proto2json::wire_validator& validator , const Descriptor* descriptor ,
+                    int input , const std::string& name , record_sink* sink ) {
+  proto2json::record_salvager salvager(descriptor,validator,input,name,std::cerr);
+  const char* data;
+  std::size_t size;
+  uint64_t offset;
+  while( salvager.next(&data,&size,&offset) ) {
+    if( !sink->write(data,size) ) {
+      salvager.refused(offset);
+    }
+  }
+  salvager.report();
+  return !salvager.failed();
+}
+
+// Hand every record of input , or the sampled ones , to the sink. Return
+// false on a broken input or a record the sink refused. With --skip_corrupt
+// the salvager reads instead , checking records against desp , and logs
+// what it skips under the name of the input.
+bool read_input( const command_option& opt , const Descriptor* desp , int input ,
+                 const std::string& name , record_sink* sink ) {
+  proto2json::record_sampler::option sample;
+  sample.sample = opt.sample;
+  sample.every = opt.every;
+  sample.count = opt.sample_count;
+  proto2json::record_sampler sampler(sample);
+  if( opt.skip_corrupt ) {
+    const proto2json::wire_validator validator(desp);
+    return read_salvaged(validator,desp,input,name,sink);
+  } else if( opt.delimited && sampler.enabled() ) {
+    io::FileInputStream stream(input);
+    return convert_sampled(&sampler,&stream,sink);
+  } else if( opt.delimited ) {
+    io::FileInputStream stream(input);
+    std::string data;
+    bool eof;
+    while( read_delimited(&stream,&data,&eof) ) {
+      if( !sink->write(data.data(),data.size()) ) {
+        return false;
+      }
+    }
+    return eof;
+  }
+  // Now readin the data stream
+  std::string data;
+  return read_all(input,&data) && sink->write(data.data(),data.size());
+}
+
+// Converter format of --format , which is not columnar
+proto2json::writer::format writer_format( const command_option& opt ) {
+  if( opt.format == "msgpack" ) {
+    return proto2json::writer::FORMAT_MSGPACK;
+  } else if( opt.format == "cbor" ) {
+    return proto2json::writer::FORMAT_CBOR;
+  }
+  return proto2json::writer::FORMAT_JSON;
+}
+
+// Sink for one input as asked by the command line. Pool , when given , is
+// used for the shards of huge repeated message fields. Return NULL and
+// describe the problem in error on failure.
+record_sink* new_sink( const command_option& opt , const proto2json::schema& schema ,
+                       std::ostream& output , ::util::thread_pool* pool ,
+                       std::string* error ) {
+  if( opt.format == "columnar" ) {
+    const Descriptor* desp = schema.find(opt.message);
+    if( desp == NULL ) {
+      error->assign("Cannot find message type in schema file:" + opt.message);
+      return NULL;
+    }
+    columnar_sink* columnar = new columnar_sink(output,opt.row_group_size);
+    if( !columnar->init(desp,schema.prototype(desp)) ) {
+      error->assign("Message nests too deep for columnar output:" + opt.message);
+      delete columnar;
+      return NULL;
+    }
+    return columnar;
+  }
+
+  const proto2json::writer::format format = writer_format(opt);
+  proto2json::converter* conv = new proto2json::converter(schema,format,opt.option);
+  if( !conv->init(opt.message,error) ) {
+    delete conv;
+    return NULL;
+  }
+  if( pool != NULL ) {
+    conv->set_thread_pool(pool);
+  }
+  // Binary formats are self delimiting , only json needs a line break
+  return new converter_sink(conv,output,
+      opt.delimited && format == proto2json::writer::FORMAT_JSON);
+}
+
+// Convert everything read from input into output , name is the input in
+// the messages of --skip_corrupt
+bool convert_input( const command_option& opt , const proto2json::schema& schema ,
+                    int input , const std::string& name , std::ostream& output ,
+                    ::util::thread_pool* pool , std::string* error ) {
+  if( opt.stream ) {
+    proto2json::converter conv(schema,proto2json::writer::FORMAT_JSON,opt.option);
+    if( !conv.init(opt.message,error) ) {
+      return false;
+    }
+    io::FileInputStream stream(input);
+    if( !conv.convert_stream(&stream,output) ) {
+      error->assign("Cannot parse the input stream!");
+      return false;
+    }
+    output.flush();
+    return output.good();
+  }
+
+  record_sink* sink = new_sink(opt,schema,output,pool,error);
+  if( sink == NULL ) {
+    return false;
+  }
+  bool ret = read_input(opt,schema.find(opt.message),input,name,sink);
+  if( !ret ) {
+    error->assign("Cannot parse the input stream!");
+  } else if( !sink->finish() ) {
+    error->assign("Cannot write the output!");
+    ret = false;
+  }
+  delete sink;
+  return ret;
+}
+
+struct input_file {
+  std::string path;
+  off_t size;
+
+  bool operator<( const input_file& that ) const {
+    return size > that.size;
+  }
+};
+
+// Expand the input list and the input directory into regular files , largest
+// first. Return false if an input cannot be found.
+bool list_input( const command_option& opt , std::vector<input_file>* inputs ) {
+  std::vector<std::string> paths(opt.inputs);
+  if( !opt.input_dir.empty() ) {
+    DIR* dir = opendir(opt.input_dir.c_str());
+    if( dir == NULL ) {
+      std::cerr<<"Cannot open input directory:"<<opt.input_dir<<std::endl;
+      return false;
+    }
+    struct dirent* entry;
+    while( (entry = readdir(dir)) != NULL ) {
+      if( entry->d_name[0] == '.' ) {
+        continue;
+      }
+      paths.push_back(opt.input_dir + "/" + entry->d_name);
+    }
+    closedir(dir);
+  }
+  for( std::size_t i = 0 ; i < paths.size() ; ++i ) {
+    struct stat info;
+    if( stat(paths[i].c_str(),&info) != 0 ) {
+      std::cerr<<"Cannot find input file:"<<paths[i]<<std::endl;
+      return false;
+    }
+    // Directory listing could hold sub directories , just skip them
+    if( !S_ISREG(info.st_mode) ) {
+      continue;
+    }
+    input_file file;
+    file.path = paths[i];
+    file.size = info.st_size;
+    inputs->push_back(file);
+  }
+  // Thread pool deals tasks round robin and steals from the back , so the
+  // largest files start first and the small ones fill the tail.
+  std::stable_sort(inputs->begin(),inputs->end());
+  return true;
+}
+
+std::string output_path( const command_option& opt , const std::string& input ) {
+  std::string ret;
+  if( opt.output_dir.empty() ) {
+    ret = input;
+  } else {
+    std::size_t slash = input.find_last_of('/');
+    ret = opt.output_dir + "/" +
+      (slash == std::string::npos ? input : input.substr(slash+1));
+  }
+  ret.append(opt.format == "columnar" ? ".p2jc" : "." + opt.format);
+  return ret;
+}
+
+// Run one task per input file on up to --jobs threads
+void run_tasks( const command_option& opt , std::vector< ::util::thread_pool::task >* tasks ) {
+  const std::size_t thread_count = std::min(static_cast<std::size_t>(opt.jobs),tasks->size());
+  if( thread_count <= 1 ) {
+    for( std::size_t i = 0 ; i < tasks->size() ; ++i ) {
+      (*tasks)[i]();
+    }
+  } else {
+    ::util::thread_pool pool(thread_count);
+    pool.run(tasks);
+  }
+}
+
+// Convert every input file into its own output. Files are the unit of work ,
+// the schema is shared read only by all the workers. Return the number of
+// files failed.
+int convert_files( const command_option& opt , const proto2json::schema& schema ,
+                   const std::vector<input_file>& inputs ) {
+  std::atomic<int> failed(0);
+  std::mutex error_lock;
+  std::vector< ::util::thread_pool::task > tasks;
+  tasks.reserve(inputs.size());
+  for( std::size_t i = 0 ; i < inputs.size() ; ++i ) {
+    const input_file* file = &inputs[i];
+    tasks.push_back( [&opt,&schema,&failed,&error_lock,file]() {
+      std::string error;
+      const std::string output = output_path(opt,file->path);
+      bool ok = false;
+      const int input = open(file->path.c_str(),O_RDONLY);
+      if( input < 0 ) {
+        error = "Cannot open input file";
+      } else {
+        std::ofstream stream(output.c_str(),std::ios_base::out | std::ios_base::binary);
+        if( !stream.is_open() ) {
+          error = "Cannot open output file:" + output;
+        } else {
+          ok = convert_input(opt,schema,input,file->path,stream,NULL,&error);
+          stream.close();
+          // Do not leave a partial output looking like a converted file
+          if( !ok ) {
+            unlink(output.c_str());
+          }
+        }
+        close(input);
+      }
+      if( !ok ) {
+        ++failed;
+        std::lock_guard<std::mutex> guard(error_lock);
+        std::cerr<<file->path<<":"<<error<<std::endl;
+      }
+    });
+  }
+  run_tasks(opt,&tasks);
+  return failed;
+}
+
+// Scan the framing of the delimited input and write <input>.idx next to it
+bool build_index( const command_option& opt , const proto2json::schema& schema ,
+                  std::string* error ) {
+  const FieldDescriptor* key = NULL;
+  if( !opt.index_key.empty() ) {
+    const Descriptor* desp = schema.find(opt.message);
+    if( desp == NULL ) {
+      error->assign("Cannot find message type in schema file:" + opt.message);
+      return false;
+    }
+    key = desp->FindFieldByName(opt.index_key);
+    if( !proto2json::is_index_key(key) ) {
+      error->assign("Index key must be a singular integer , enum , string or bytes field:" +
+          opt.index_key);
+      return false;
+    }
+  }
+  const std::string& input = opt.inputs[0];
+  proto2json::mapped_file data;
+  if( !data.open(input) ) {
+    error->assign("Cannot open input file:" + input);
+    return false;
+  }
+  const std::string path = input + ".idx";
+  std::ofstream output(path.c_str(),std::ios_base::out | std::ios_base::binary);
+  if( !output.is_open() ) {
+    error->assign("Cannot open index file:" + path);
+    return false;
+  }
+  if( !proto2json::build_record_index(data.data(),data.size(),key,output,error) ) {
+    output.close();
+    unlink(path.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Convert the records picked by --range or --key , reaching them through the
+// index instead of reading the records before them
+bool convert_indexed( const command_option& opt , const proto2json::schema& schema ,
+                      ::util::thread_pool* pool , std::string* error ) {
+  const std::string& input = opt.inputs[0];
+  proto2json::mapped_file data;
+  if( !data.open(input) ) {
+    error->assign("Cannot open input file:" + input);
+    return false;
+  }
+  proto2json::record_index index;
+  if( !index.open(input + ".idx",data.size(),error) ) {
+    return false;
+  }
+
+  std::vector<uint64_t> records;
+  uint64_t begin = 0;
+  uint64_t end = 0;
+  if( opt.range ) {
+    begin = std::min(opt.range_begin,index.size());
+    end = std::min(opt.range_end,index.size());
+  } else {
+    if( index.key_number() == 0 ) {
+      error->assign("Index has no key , build it with --index_key");
+      return false;
+    }
+    // Enum key could be given by the name of its value
+    const Descriptor* desp = schema.find(opt.message);
+    const FieldDescriptor* field = desp == NULL ? NULL :
+      desp->FindFieldByNumber(static_cast<int>(index.key_number()));
+    std::string key = opt.key_value;
+    if( field != NULL ) {
+      proto2json::parse_index_key(field,opt.key_value,&key);
+    }
+    index.find(key,&records);
+  }
+
+  record_sink* sink = new_sink(opt,schema,std::cout,pool,error);
+  if( sink == NULL ) {
+    return false;
+  }
+  bool ret = true;
+  const std::size_t count = opt.range ? end - begin : records.size();
+  for( std::size_t i = 0 ; i < count && ret ; ++i ) {
+    const char* record;
+    std::size_t size;
+    index.record(data.data(),opt.range ? begin + i : records[i],&record,&size);
+    ret = sink->write(record,size);
+  }
+  if( !ret ) {
+    error->assign("Cannot parse the input stream!");
+  } else if( !sink->finish() ) {
+    error->assign("Cannot write the output!");
+    ret = false;
+  }
+  delete sink;
+  return ret;
+}
+
+// Fold the records of the input files , or of stdin when inputs is NULL , into
+// one set of field statistics and write it to stdout. Every file is folded
+// into an accumulator of its own , merged into the total once it is done.
+bool collect_stats( const command_option& opt , const proto2json::schema& schema ,
+                    const std::vector<input_file>* inputs , std::string* error ) {
+  const Descriptor* desp = schema.find(opt.message);
+  if( desp == NULL ) {
+    error->assign("Cannot find message type in schema file:" + opt.message);
+    return false;
+  }
+  const Message* prototype = schema.prototype(desp);
+  proto2json::field_stats total(desp);
+  std::mutex total_lock;
+
+  if( inputs != NULL ) {
+    std::atomic<int> failed(0);
+    std::mutex error_lock;
+    std::vector< ::util::thread_pool::task > tasks;
+    tasks.reserve(inputs->size());
+    for( std::size_t i = 0 ; i < inputs->size() ; ++i ) {
+      const input_file* file = &(*inputs)[i];
+      tasks.push_back( [&opt,&failed,&error_lock,&total,&total_lock,desp,prototype,file]() {
+        const char* message = "Cannot parse the input stream!";
+        bool ok = false;
+        const int input = open(file->path.c_str(),O_RDONLY);
+        if( input < 0 ) {
+          message = "Cannot open input file";
+        } else {
+          stats_sink sink(desp,prototype,NULL,&total,&total_lock);
+          ok = read_input(opt,desp,input,file->path,&sink) && sink.finish();
+          close(input);
+        }
+        if( !ok ) {
+          ++failed;
+          std::lock_guard<std::mutex> guard(error_lock);
+          std::cerr<<file->path<<":"<<message<<std::endl;
+        }
+      });
+    }
+    run_tasks(opt,&tasks);
+    if( failed != 0 ) {
+      error->assign("Statistics are not written since some input failed");
+      return false;
+    }
+  } else {
+    ::util::thread_pool* pool = NULL;
+    if( opt.jobs > 1 ) {
+      pool = new ::util::thread_pool(opt.jobs);
+    }
+    stats_sink sink(desp,prototype,pool,&total,&total_lock);
+    const bool ok = read_input(opt,desp,STDIN_FILENO,"stdin",&sink) && sink.finish();
+    delete pool;
+    if( !ok ) {
+      error->assign("Cannot parse the input stream!");
+      return false;
+    }
+  }
+
+  proto2json::writer* output = proto2json::writer::create(opt.format,std::cout);
+  total.report(*output);
+  if( output->type() == proto2json::writer::FORMAT_JSON ) {
+    std::cout<<'\n';
+  }
+  delete output;
+  std::cout.flush();
+  if( !std::cout.good() ) {
+    error->assign("Cannot write the output!");
+    return false;
+  }
+  return true;
+}
+
+// Fields of --partition_by , a dotted path of singular message fields down
+// to a field which could be an index key. Return false and describe the
+// problem in error if it does not name one.
+bool partition_path( const command_option& opt , const Descriptor* desp ,
+                     std::vector<const FieldDescriptor*>* path , std::string* error ) {
+  std::size_t begin = 0;
+  while( true ) {
+    const std::size_t dot = opt.partition_by.find('.',begin);
+    const std::string name = opt.partition_by.substr(begin,
+        dot == std::string::npos ? std::string::npos : dot - begin);
+    const FieldDescriptor* field = desp == NULL ? NULL : desp->FindFieldByName(name);
+    if( dot == std::string::npos ) {
+      if( !proto2json::is_index_key(field) ) {
+        break;
+      }
+      path->push_back(field);
+      return true;
+    }
+    if( field == NULL || field->is_repeated() ||
+        field->type() != FieldDescriptor::TYPE_MESSAGE ) {
+      break;
+    }
+    path->push_back(field);
+    desp = field->message_type();
+    begin = dot + 1;
+  }
+  error->assign("Partition field must be a singular integer , enum , string or bytes field , "
+                "reached through singular message fields:" + opt.partition_by);
+  return false;
+}
+
+// Convert the records of one input into the partitions under --output_dir ,
+// id tells the part files of this input from the ones of other inputs.
+bool partition_input( const command_option& opt , const proto2json::schema& schema ,
+                      const std::vector<const FieldDescriptor*>& path ,
+                      const proto2json::partition_writer::option& writer_option ,
+                      int id , int input , const std::string& name , std::string* error ) {
+  const proto2json::writer::format format = writer_format(opt);
+  proto2json::converter* conv = new proto2json::converter(schema,format,opt.option);
+  if( !conv->init(opt.message,error) ) {
+    delete conv;
+    return false;
+  }
+  proto2json::partition_writer writer(opt.output_dir,id,writer_option);
+  partition_sink sink(conv,path,&writer,format == proto2json::writer::FORMAT_JSON);
+  if( !read_input(opt,schema.find(opt.message),input,name,&sink) ) {
+    error->assign(writer.error().empty() ? "Cannot parse the input stream!" : writer.error());
+    return false;
+  }
+  if( !sink.finish() ) {
+    error->assign(writer.error());
+    return false;
+  }
+  return true;
+}
+
+// Split the records of the input files , or of stdin when inputs is NULL ,
+// into partitions by the value of --partition_by. Every input file has a
+// writer of its own , so files convert in parallel with nothing shared but
+// the directories ; the open file limit is split between the threads.
+bool partition_inputs( const command_option& opt , const proto2json::schema& schema ,
+                       const std::vector<input_file>* inputs , std::string* error ) {
+  std::vector<const FieldDescriptor*> path;
+  if( !partition_path(opt,schema.find(opt.message),&path,error) ) {
+    return false;
+  }
+  const std::size_t threads = inputs == NULL ? 1 :
+    std::max<std::size_t>(1,std::min(static_cast<std::size_t>(opt.jobs),inputs->size()));
+  proto2json::partition_writer::option writer_option;
+  writer_option.field = opt.partition_by;
+  writer_option.suffix = opt.format;
+  writer_option.max_open = std::max<std::size_t>(1,opt.max_open_files / threads);
+  writer_option.rotate_size = opt.partition_size;
+  writer_option.gzip = opt.gzip;
+
+  if( inputs == NULL ) {
+    return partition_input(opt,schema,path,writer_option,0,STDIN_FILENO,"stdin",error);
+  }
+  std::atomic<int> failed(0);
+  std::mutex error_lock;
+  std::vector< ::util::thread_pool::task > tasks;
+  tasks.reserve(inputs->size());
+  for( std::size_t i = 0 ; i < inputs->size() ; ++i ) {
+    const input_file* file = &(*inputs)[i];
+    const int id = static_cast<int>(i);
+    tasks.push_back( [&opt,&schema,&path,&writer_option,&failed,&error_lock,file,id]() {
+      std::string error;
+      bool ok = false;
+      const int input = open(file->path.c_str(),O_RDONLY);
+      if( input < 0 ) {
+        error = "Cannot open input file";
+      } else {
+        ok = partition_input(opt,schema,path,writer_option,id,input,file->path,&error);
+        close(input);
+      }
+      if( !ok ) {
+        ++failed;
+        std::lock_guard<std::mutex> guard(error_lock);
+        std::cerr<<file->path<<":"<<error<<std::endl;
+      }
+    });
+  }
+  run_tasks(opt,&tasks);
+  if( failed != 0 ) {
+    char buf[64];
+    snprintf(buf,sizeof(buf),"%d input files failed",static_cast<int>(failed));
+    error->assign(buf);
+    return false;
+  }
+  return true;
+}
+
+// Compare the records of the two input files pair by pair , by position , and
+// write one line per pair which differs :
+//   {"record":N,"patch":[...]}
+// A record only in one of the files is added or removed as a whole. Pairs
+// are cut in chunks diffed in parallel , a wave of chunks at a time so the
+// output held stays bounded , and written in record order. Count of pairs
+// differing goes to changed.
+bool diff_inputs( const command_option& opt , const proto2json::schema& schema ,
+                  uint64_t* changed , std::string* error ) {
+  static const std::size_t kChunkSize = 4096;
+  proto2json::mapped_file file[2];
+  std::vector< std::pair<uint64_t,uint64_t> > records[2];
+  for( int i = 0 ; i < 2 ; ++i ) {
+    const std::string& path = opt.inputs[i];
+    if( !file[i].open(path) ) {
+      error->assign("Cannot open input file:" + path);
+      return false;
+    }
+    if( !opt.delimited ) {
+      records[i].push_back(std::make_pair(static_cast<uint64_t>(0),
+                                          static_cast<uint64_t>(file[i].size())));
+    } else if( !proto2json::scan_records(file[i].data(),file[i].size(),&records[i],error) ) {
+      error->insert(0,path + ":");
+      return false;
+    }
+  }
+
+  const std::size_t count = std::max(records[0].size(),records[1].size());
+  const std::size_t chunk_count = (count + kChunkSize - 1) / kChunkSize;
+  const std::size_t wave = static_cast<std::size_t>(opt.jobs) * 4;
+  std::vector<std::string> output(wave);
+  std::vector<std::string> failure(wave);
+  std::vector<uint64_t> differ(wave);
+  *changed = 0;
+  for( std::size_t first = 0 ; first < chunk_count ; first += wave ) {
+    const std::size_t size = std::min(wave,chunk_count - first);
+    std::vector< ::util::thread_pool::task > tasks;
+    tasks.reserve(size);
+    for( std::size_t c = 0 ; c < size ; ++c ) {
+      const std::size_t begin = (first + c) * kChunkSize;
+      const std::size_t end = std::min(begin + kChunkSize,count);
+      tasks.push_back( [&opt,&schema,&file,&records,&output,&failure,&differ,c,begin,end]() {
+        output[c].clear();
+        failure[c].clear();
+        differ[c] = 0;
+        proto2json::record_diff diff(schema,opt.option);
+        if( !diff.init(opt.message,&failure[c]) ) {
+          return;
+        }
+        const char* data[2];
+        std::size_t length[2];
+        char number[64];
+        std::string patch;
+        for( std::size_t r = begin ; r < end ; ++r ) {
+          for( int i = 0 ; i < 2 ; ++i ) {
+            data[i] = r < records[i].size() ? file[i].data() + records[i][r].first : NULL;
+            length[i] = r < records[i].size() ? records[i][r].second : 0;
+          }
+          patch.clear();
+          if( !diff.diff(data[0],length[0],data[1],length[1],&patch) ) {
+            snprintf(number,sizeof(number),"Cannot parse record %zu",r);
+            failure[c].assign(number);
+            return;
+          }
+          if( !patch.empty() ) {
+            snprintf(number,sizeof(number),"{\"record\":%zu,\"patch\":",r);
+            output[c].append(number).append(patch).append("}\n");
+            ++differ[c];
+          }
+        }
+      });
+    }
+    run_tasks(opt,&tasks);
+    for( std::size_t c = 0 ; c < size ; ++c ) {
+      if( !failure[c].empty() ) {
+        error->assign(failure[c]);
+        return false;
+      }
+      std::cout.write(output[c].data(),output[c].size());
+      *changed += differ[c];
+    }
+  }
+  std::cout.flush();
+  if( !std::cout.good() ) {
+    error->assign("Cannot write the output!");
+    return false;
+  }
+  return true;
+}
+
+// Check one input , whole in memory , and describe the outcome in result
+bool validate_data( const command_option& opt , const proto2json::wire_validator& validator ,
+                    const char* data , std::size_t size , std::string* result ) {
+  proto2json::wire_validator::failure fail;
+  char buf[128];
+  if( !opt.delimited ) {
+    if( validator.validate(data,size,&fail) ) {
+      result->assign("ok");
+      return true;
+    }
+    snprintf(buf,sizeof(buf),"offset %zu:",fail.offset);
+    result->assign(buf).append(fail.reason);
+    return false;
+  }
+  uint64_t record;
+  std::size_t record_offset;
+  if( validator.validate_delimited(data,size,&record,&record_offset,&fail) ) {
+    snprintf(buf,sizeof(buf),"%llu records ok",static_cast<unsigned long long>(record));
+    result->assign(buf);
+    return true;
+  }
+  snprintf(buf,sizeof(buf),"record %llu at offset %zu:",
+      static_cast<unsigned long long>(record),record_offset);
+  result->assign(buf).append(fail.reason);
+  snprintf(buf,sizeof(buf)," at offset %zu",fail.offset);
+  result->append(buf);
+  return false;
+}
+
+// Check the input files , or stdin when inputs is NULL , against the schema
+// and write one line per input : how many records are fine , or where the
+// first bad record is. Return false if any input is malformed.
+bool validate_inputs( const command_option& opt , const proto2json::schema& schema ,
+                      const std::vector<input_file>* inputs , std::string* error ) {
+  const Descriptor* desp = schema.find(opt.message);
+  if( desp == NULL ) {
+    error->assign("Cannot find message type in schema file:" + opt.message);
+    return false;
+  }
+  // Read only once built , shared by every task
+  const proto2json::wire_validator validator(desp);
+
+  if( inputs == NULL ) {
+    std::string data;
+    std::string result;
+    if( !read_all(STDIN_FILENO,&data) ) {
+      error->assign("Cannot read the input stream!");
+      return false;
+    }
+    const bool ok = validate_data(opt,validator,data.data(),data.size(),&result);
+    std::cout<<"stdin:"<<result<<std::endl;
+    if( !ok ) {
+      error->assign("Input is malformed");
+    }
+    return ok;
+  }
+
+  std::atomic<int> failed(0);
+  std::vector<std::string> results(inputs->size());
+  std::vector< ::util::thread_pool::task > tasks;
+  tasks.reserve(inputs->size());
+  for( std::size_t i = 0 ; i < inputs->size() ; ++i ) {
+    const input_file* file = &(*inputs)[i];
+    std::string* result = &results[i];
+    tasks.push_back( [&opt,&validator,&failed,file,result]() {
+      proto2json::mapped_file data;
+      if( !data.open(file->path) ) {
+        result->assign("Cannot open input file");
+        ++failed;
+      } else if( !validate_data(opt,validator,data.data(),data.size(),result) ) {
+        ++failed;
+      }
+    });
+  }
+  run_tasks(opt,&tasks);
+  for( std::size_t i = 0 ; i < inputs->size() ; ++i ) {
+    std::cout<<(*inputs)[i].path<<":"<<results[i]<<"\n";
+  }
+  std::cout.flush();
+  if( failed != 0 ) {
+    char buf[64];
+    snprintf(buf,sizeof(buf),"%d input files are malformed",static_cast<int>(failed));
+    error->assign(buf);
+    return false;
+  }
+  return true;
+}
+
+// Convert the records of one growing input file forever , return false on a
+// record which does not parse or an error of the file or the output.
+bool follow_input( const command_option& opt , const proto2json::schema& schema ,
+                   std::string* error ) {
+  proto2json::file_follower follower(std::cerr);
+  if( !follower.open(opt.inputs[0],opt.inputs[0] + ".offset") ) {
+    error->assign(follower.error());
+    return false;
+  }
+  record_sink* sink = new_sink(opt,schema,std::cout,NULL,error);
+  if( sink == NULL ) {
+    return false;
+  }
+  bool ret = true;
+  while( ret ) {
+    const char* data = NULL;
+    std::size_t size = 0;
+    while( follower.next(&data,&size) ) {
+      if( !sink->write(data,size) ) {
+        error->assign("Cannot parse a record of the input file!");
+        ret = false;
+        break;
+      }
+    }
+    // Output goes out before the offset is saved , a record is written at
+    // least once even if the process dies in between
+    if( ret && !sink->flush() ) {
+      error->assign("Cannot write the output!");
+      ret = false;
+    }
+    if( ret && !follower.wait() ) {
+      error->assign(follower.error());
+      ret = false;
+    }
+  }
+  delete sink;
+  return ret;
+}
+
+} // namespace
+
+
+int main( int argc, char* argv[] ) {
+  command_option opt;
+  if( !parse_command(argc,argv,&opt) )
+    return -1;
+
+  // Now read in the proto schema file , once for all the inputs
+  proto2json::schema schema;
+  std::string error;
+  for( std::size_t i = 0 ; i < opt.import_path.size() ; ++i ) {
+    schema.add_import_path(opt.import_path[i]);
+  }
+  const bool loaded = opt.proto_path.empty() ?
+    schema.load_message(opt.message,opt.lazy,&error) :
+    schema.load(opt.proto_path,opt.lazy,&error);
+  if( !loaded ) {
+    std::cerr<<error<<std::endl;
+    return -1;
+  }
+
+  if( opt.build_index ) {
+    if( !build_index(opt,schema,&error) ) {
+      std::cerr<<error<<std::endl;
+      return -1;
+    }
+    return 0;
+  }
+
+  if( opt.diff ) {
+    uint64_t changed = 0;
+    if( !diff_inputs(opt,schema,&changed,&error) ) {
+      std::cerr<<error<<std::endl;
+      return -1;
+    }
+    // Same as diff(1) , so a regression check could test the exit status
+    return changed == 0 ? 0 : 1;
+  }
+
+  if( opt.stats_only || opt.validate ) {
+    std::vector<input_file> inputs;
+    const bool has_input = !opt.inputs.empty() || !opt.input_dir.empty();
+    if( has_input && !list_input(opt,&inputs) ) {
+      return -1;
+    }
+    const bool ok = opt.validate ?
+      validate_inputs(opt,schema,has_input ? &inputs : NULL,&error) :
+      collect_stats(opt,schema,has_input ? &inputs : NULL,&error);
+    if( !ok ) {
+      std::cerr<<error<<std::endl;
+      return -1;
+    }
+    return 0;
+  }
+
+  if( !opt.partition_by.empty() ) {
+    std::vector<input_file> inputs;
+    const bool has_input = !opt.inputs.empty() || !opt.input_dir.empty();
+    if( has_input && !list_input(opt,&inputs) ) {
+      return -1;
+    }
+    if( !partition_inputs(opt,schema,has_input ? &inputs : NULL,&error) ) {
+      std::cerr<<error<<std::endl;
+      return -1;
+    }
+    return 0;
+  }
+
+  if( opt.follow ) {
+    if( !follow_input(opt,schema,&error) ) {
+      std::cerr<<error<<std::endl;
+      return -1;
+    }
+    return 0;
+  }
+
+  if( (!opt.inputs.empty() || !opt.input_dir.empty()) && !opt.range && !opt.key ) {
+    std::vector<input_file> inputs;
+    if( !list_input(opt,&inputs) ) {
+      return -1;
+    }
+    return convert_files(opt,schema,inputs) == 0 ? 0 : -1;
+  }
+
+  ::util::thread_pool* thread_pool = NULL;
+  if( opt.jobs > 1 && !opt.stream ) {
+    thread_pool = new ::util::thread_pool(opt.jobs);
+  }
+  int ret = 0;
+  const bool ok = opt.range || opt.key ?
+    convert_indexed(opt,schema,thread_pool,&error) :
+    convert_input(opt,schema,STDIN_FILENO,"stdin",std::cout,thread_pool,&error);
+  if( !ok ) {
+    std::cerr<<error<<std::endl;
+    ret = -1;
+  }
+  delete thread_pool;
+  return ret;
+}
@@ -0,0 +1,258 @@
+#include "partition_writer.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+namespace proto2json {
+
+namespace {
+
+// Buffer of a partition is written out once it holds this much
+static const std::size_t kBufferSize = 64 * 1024;
+// Every buffer is written out once all of them together hold this much
+static const std::size_t kMaxBuffered = 64 * 1024 * 1024;
+// Compressed bytes handed to the file at a time
+static const std::size_t kDeflateChunk = 64 * 1024;
+static const char kMissing[] = "__missing__";
+
+inline bool keeps( char c ) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           (c >= '0' && c <= '9') || c == '_' || c == '-' || c == '.';
+}
+
+bool write_all( int fd , const char* data , std::size_t size ) {
+    while( size > 0 ) {
+        const ssize_t written = ::write(fd,data,size);
+        if( written < 0 ) {
+            if( errno == EINTR ) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        size -= static_cast<std::size_t>(written);
+    }
+    return true;
+}
+
+}// namespace
+
+struct partition_writer::partition {
+    std::string path;               // Directory of the partition
+    std::string buffer;
+    int fd;                         // -1 while not in the open list
+    int part;                       // Sequence number of the current part
+    uint64_t part_size;             // Bytes in the current part file
+    bool created;                   // Current part exists , opening appends
+    z_stream* stream;               // Gzip member being written
+    std::list<partition*>::iterator lru;
+
+    partition(): path(), buffer(), fd(-1), part(0), part_size(0),
+                 created(false), stream(NULL), lru() {}
+};
+
+partition_writer::partition_writer( const std::string& directory , int id ,
+                                    const option& opt ):
+    m_directory( directory ),
+    m_id( id ),
+    m_option( opt ),
+    m_partition(),
+    m_missing( NULL ),
+    m_open(),
+    m_buffered( 0 ),
+    m_error()
+{
+    if( m_option.max_open == 0 ) {
+        m_option.max_open = 1;
+    }
+}
+
+partition_writer::~partition_writer() {
+    while( !m_open.empty() ) {
+        close(m_open.front());
+    }
+    for( std::unordered_map<std::string,partition*>::iterator itr = m_partition.begin() ;
+         itr != m_partition.end() ; ++itr ) {
+        delete itr->second;
+    }
+    delete m_missing;
+}
+
+std::string partition_writer::partition_name( const std::string& key , bool missing ) const {
+    std::string ret(m_option.field);
+    ret.push_back('=');
+    if( missing ) {
+        return ret.append(kMissing);
+    }
+    for( std::size_t i = 0 ; i < key.size() ; ++i ) {
+        // A leading dot would make "." and ".." or a hidden directory , a
+        // leading underscore could name the partition of missing keys
+        if( keeps(key[i]) && !(i == 0 && (key[i] == '.' || key[i] == '_')) ) {
+            ret.push_back(key[i]);
+        } else {
+            char buf[4];
+            snprintf(buf,sizeof(buf),"%%%02X",static_cast<unsigned char>(key[i]));
+            ret.append(buf);
+        }
+    }
+    return ret;
+}
+
+bool partition_writer::fail( const std::string& what , const std::string& path ) {
+    m_error = what + ":" + path + " : " + strerror(errno);
+    return false;
+}
+
+bool partition_writer::write( const std::string& key , bool missing ,
+                              const char* data , std::size_t size ) {
+    partition*& slot = missing ? m_missing : m_partition[key];
+    if( slot == NULL ) {
+        partition* p = new partition();
+        p->path = m_directory + "/" + partition_name(key,missing);
+        slot = p;
+        if( (mkdir(m_directory.c_str(),0755) != 0 && errno != EEXIST) ||
+            (mkdir(p->path.c_str(),0755) != 0 && errno != EEXIST) ) {
+            return fail("Cannot create partition directory",p->path);
+        }
+    }
+    partition* p = slot;
+    p->buffer.append(data,size);
+    m_buffered += size;
+    if( p->buffer.size() >= kBufferSize ) {
+        return flush(p,false);
+    }
+    if( m_buffered >= kMaxBuffered ) {
+        for( std::unordered_map<std::string,partition*>::iterator itr = m_partition.begin() ;
+             itr != m_partition.end() ; ++itr ) {
+            if( !flush(itr->second,false) ) {
+                return false;
+            }
+        }
+        return m_missing == NULL || flush(m_missing,false);
+    }
+    return true;
+}
+
+bool partition_writer::finish() {
+    for( std::unordered_map<std::string,partition*>::iterator itr = m_partition.begin() ;
+         itr != m_partition.end() ; ++itr ) {
+        if( !flush(itr->second,true) ) {
+            return false;
+        }
+    }
+    return m_missing == NULL || flush(m_missing,true);
+}
+
+bool partition_writer::flush( partition* p , bool final ) {
+    if( !p->buffer.empty() ) {
+        if( p->fd < 0 ) {
+            if( !open(p) ) {
+                return false;
+            }
+        } else if( p->lru != m_open.begin() ) {
+            m_open.splice(m_open.begin(),m_open,p->lru);
+        }
+        if( !write_file(p,p->buffer.data(),p->buffer.size()) ) {
+            return false;
+        }
+        m_buffered -= p->buffer.size();
+        p->buffer.clear();
+    }
+    const bool rotate = m_option.rotate_size > 0 && p->part_size >= m_option.rotate_size;
+    if( p->fd >= 0 && (final || rotate) && !close(p) ) {
+        return false;
+    }
+    if( rotate ) {
+        ++p->part;
+        p->part_size = 0;
+        p->created = false;
+    }
+    return true;
+}
+
+bool partition_writer::open( partition* p ) {
+    if( m_open.size() >= m_option.max_open && !close(m_open.back()) ) {
+        return false;
+    }
+    char name[64];
+    snprintf(name,sizeof(name),"/part-%05d-%05d.",m_id,p->part);
+    std::string path = p->path + name + m_option.suffix;
+    if( m_option.gzip ) {
+        path.append(".gz");
+    }
+    // The first opening of a part replaces what an earlier run left
+    const int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (p->created ? O_APPEND : O_TRUNC);
+    p->fd = ::open(path.c_str(),flags,0644);
+    if( p->fd < 0 ) {
+        return fail("Cannot open partition file",path);
+    }
+    p->created = true;
+    if( m_option.gzip ) {
+        p->stream = new z_stream();
+        // 16 more window bits ask zlib for a gzip header and trailer
+        if( deflateInit2(p->stream,Z_DEFAULT_COMPRESSION,Z_DEFLATED,15 + 16,8,
+                         Z_DEFAULT_STRATEGY) != Z_OK ) {
+            delete p->stream;
+            p->stream = NULL;
+            ::close(p->fd);
+            p->fd = -1;
+            m_error = "Cannot initialize gzip stream:" + path;
+            return false;
+        }
+    }
+    m_open.push_front(p);
+    p->lru = m_open.begin();
+    return true;
+}
+
+bool partition_writer::close( partition* p ) {
+    bool ret = true;
+    if( p->stream != NULL ) {
+        // Ends the gzip member
+        ret = write_file(p,NULL,0);
+        deflateEnd(p->stream);
+        delete p->stream;
+        p->stream = NULL;
+    }
+    if( ::close(p->fd) != 0 && ret ) {
+        ret = fail("Cannot write partition",p->path);
+    }
+    p->fd = -1;
+    m_open.erase(p->lru);
+    return ret;
+}
+
+// Without gzip the data goes straight to the file. With gzip , NULL data
+// finishes the member.
+bool partition_writer::write_file( partition* p , const char* data , std::size_t size ) {
+    if( p->stream == NULL ) {
+        if( !write_all(p->fd,data,size) ) {
+            return fail("Cannot write partition",p->path);
+        }
+        p->part_size += size;
+        return true;
+    }
+    char out[kDeflateChunk];
+    z_stream* z = p->stream;
+    const int mode = data == NULL ? Z_FINISH : Z_NO_FLUSH;
+    z->next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    z->avail_in = static_cast<uInt>(size);
+    int status;
+    do {
+        z->next_out = reinterpret_cast<Bytef*>(out);
+        z->avail_out = sizeof(out);
+        status = deflate(z,mode);
+        const std::size_t produced = sizeof(out) - z->avail_out;
+        if( !write_all(p->fd,out,produced) ) {
+            return fail("Cannot write partition",p->path);
+        }
+        p->part_size += produced;
+    } while( z->avail_out == 0 || (mode == Z_FINISH && status != Z_STREAM_END) );
+    return true;
+}
+
+}// namespace proto2json
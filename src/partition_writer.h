@@ -0,0 +1,87 @@
+#ifndef _PARTITION_WRITER_H_
+#define _PARTITION_WRITER_H_
+#include <cstddef>
+#include <stdint.h>
+#include <list>
+#include <string>
+#include <unordered_map>
+
+// =====================================================================
+// Partition writer
+// Spread converted records over one directory per value of a key field ,
+// named the way hive and spark lay out partitioned tables :
+//   <directory>/<field>=<value>/part-<writer>-<sequence>.<suffix>
+// so the shards load as they are. Characters of the value which do not
+// belong in a file name are written as %XX , a record without the field ,
+// one with presence or a submessage of its path , goes to the partition
+// named __missing__. A leading underscore of a value is written as %5F , so
+// no value names that partition.
+// Every partition buffers its records and only writes out whole buffers ,
+// through a file descriptor kept open in a least recently used list of
+// bounded length ; the partition pushed out of the list is flushed and
+// closed , and opened again for appending when it is written next. Once
+// a part file reaches the rotation size , the next buffer starts a new
+// part. With gzip every opening of a part writes one gzip member , the
+// members of a file make one gzip stream for any reader.
+// Writers with different ids never touch the same file , one writer per
+// thread converts in parallel into the same directory.
+// =====================================================================
+
+namespace proto2json {
+
+class partition_writer {
+public:
+    struct option {
+        std::string field;          // Key name in the directory names
+        std::string suffix;         // File name suffix , without the dot
+        std::size_t max_open;       // Files open at once
+        uint64_t rotate_size;       // Bytes of a part file , 0 never rotates
+        bool gzip;
+
+        option(): field(), suffix(), max_open(64), rotate_size(0), gzip(false) {}
+    };
+
+    partition_writer( const std::string& directory , int id , const option& opt );
+    ~partition_writer();
+
+    // Append one converted record to the partition of key. Missing tells a
+    // record without the key field. Return false on an error of the file
+    // system , see error().
+    bool write( const std::string& key , bool missing , const char* data , std::size_t size );
+
+    // Write out every buffer and close every file
+    bool finish();
+
+    std::size_t partition_count() const { return m_partition.size(); }
+    const std::string& error() const { return m_error; }
+
+private:
+    struct partition;
+
+    // Directory name of the partition of key
+    std::string partition_name( const std::string& key , bool missing ) const;
+
+    // Write the buffer of the partition into its part file , opening it
+    // first. Close the part when final , or when it reaches the rotation
+    // size.
+    bool flush( partition* p , bool final );
+    bool open( partition* p );
+    bool close( partition* p );
+    bool write_file( partition* p , const char* data , std::size_t size );
+    bool fail( const std::string& what , const std::string& path );
+
+    std::string m_directory;
+    int m_id;
+    option m_option;
+    std::unordered_map<std::string,partition*> m_partition;
+    partition* m_missing;                   // Records without the key field
+    std::list<partition*> m_open;           // Most recently used first
+    std::size_t m_buffered;                 // Bytes in every buffer
+    std::string m_error;
+
+    void operator=( const partition_writer& );
+    partition_writer( const partition_writer& );
+};
+
+}// namespace proto2json
+#endif // _PARTITION_WRITER_H_
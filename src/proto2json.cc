@@ -1,18 +1,38 @@
-#include <iostream>
 #include <fstream>
+#include <streambuf>
 #include <stdio.h>
-#include <iterator>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
 #include <cassert>
 #include <vector>
+#include <algorithm>
+#include <set>
+#include <map>
+#include <deque>
+#include <list>
+#include <sstream>
+#include <unordered_map>
+#include <mutex>
 #include <inttypes.h>
-#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <google/protobuf/compiler/importer.h> // For loading the schema file
 #include <google/protobuf/descriptor.h>        // For descriptor
 #include <google/protobuf/dynamic_message.h>   // For parsing from stream
 #include <google/protobuf/io/zero_copy_stream_impl.h> // For io wrapper class
+#include <google/protobuf/io/coded_stream.h>   // For streaming mode
+#include <google/protobuf/wire_format.h>       // For streaming mode
 
-#include "base64.h" // For base64 encoding
+#include "proto2json.h"
+#include "itoa.h"   // For integer formatting
+#include "time_format.h" // For Timestamp and Duration
+#include "varint.h" // For packed repeated fields
+#include "hash.h"   // For the submessage memo cache
+#include "thread_pool.h" // For parallel conversion
+#include "schema_registry.h" // For finding the schema file of a message
+#include "instrument.h" // For the instrumented build
 
 
 #define DISALLOW_COPY_AND_ASSIGN(X) \
@@ -24,115 +44,792 @@
 namespace {
 using namespace google::protobuf;
 
-std::string to_string( double );
-std::string to_string( float  );
+// Lazy schema is a shadow copy of the schema where every field of message type
+// is turned into a bytes field with the same number. Parsing with the shadow
+// prototype therefore only records the raw bytes of the submessage instead of
+// decoding it , and the converter decodes it only when it really descends into
+// that field. Group and map fields are left as they are : group has its own
+// wire type and map entry is tiny. The shadow keeps the full names , so the
+// real descriptor could always be found by name.
+class lazy_schema {
+public:
+  lazy_schema():
+    m_pool(),
+    m_factory(&m_pool),
+    m_lazy_field(),
+    m_packed_field(),
+    m_prototype()
+  {}
 
-class message_to_json {
+  // Build the shadow for the file and all its dependencies , could be called
+  // for several files before the schema is used.
+  bool init( const FileDescriptor* file );
+
+  const Descriptor* shadow( const Descriptor* real ) const {
+    return m_pool.FindMessageTypeByName(real->full_name());
+  }
+
+  const FileDescriptor* shadow( const FileDescriptor* real ) const {
+    return m_pool.FindFileByName(real->name());
+  }
+
+  // Return shadow message type of the field if it is a lazy submessage field ,
+  // otherwise NULL.
+  const Descriptor* message_type( const FieldDescriptor* field ) const {
+    std::map<const FieldDescriptor*,const Descriptor*>::const_iterator
+      itr = m_lazy_field.find(field);
+    return itr == m_lazy_field.end() ? NULL : itr->second;
+  }
+
+  // Return the real field of a shadow packed field , which holds the raw
+  // packed payloads as bytes , otherwise NULL.
+  const FieldDescriptor* packed_field( const FieldDescriptor* field ) const {
+    std::map<const FieldDescriptor*,const FieldDescriptor*>::const_iterator
+      itr = m_packed_field.find(field);
+    return itr == m_packed_field.end() ? NULL : itr->second;
+  }
+
+  // Elements of a packed field which came unpacked do not match the bytes
+  // type , the shadow message keeps them as unknown fields. Return the shadow
+  // packed field of such an unknown field number , otherwise NULL.
+  const FieldDescriptor* unpacked_field( const Descriptor* shadow_type , int number ) const {
+    const FieldDescriptor* field = shadow_type->FindFieldByNumber(number);
+    if( field == NULL ) {
+      field = m_pool.FindExtensionByNumber(shadow_type,number);
+    }
+    return field != NULL && packed_field(field) != NULL ? field : NULL;
+  }
+
+  const Message* prototype( const Descriptor* shadow_type ) const {
+    std::map<const Descriptor*,const Message*>::const_iterator
+      itr = m_prototype.find(shadow_type);
+    return itr == m_prototype.end() ? NULL : itr->second;
+  }
+
+private:
+  bool build_file( const FileDescriptor* real );
+  void rewrite_field( const FieldDescriptor& real , FieldDescriptorProto* field ,
+                      DescriptorProto* message );
+  void rewrite_message( const Descriptor& real , DescriptorProto* message );
+  void index_field( const FieldDescriptor& real , const FieldDescriptor& shadow );
+  void index_message( const Descriptor& real , const Descriptor& shadow );
+
+  static bool is_lazy( const FieldDescriptor& real ) {
+    return real.type() == FieldDescriptor::TYPE_MESSAGE &&
+           !real.message_type()->options().map_entry();
+  }
+
+  // Packed varint field is kept as its raw payloads and decoded in one pass
+  // by the converter. Fixed width integers are not varints and stay with the
+  // runtime , so does enum , which alone knows how to name a value missing
+  // from the schema.
+  static bool is_packed_varint( const FieldDescriptor& real ) {
+    if( !real.is_packed() ) {
+      return false;
+    }
+    switch( real.type() ) {
+      case FieldDescriptor::TYPE_INT32:
+      case FieldDescriptor::TYPE_INT64:
+      case FieldDescriptor::TYPE_UINT32:
+      case FieldDescriptor::TYPE_UINT64:
+      case FieldDescriptor::TYPE_SINT32:
+      case FieldDescriptor::TYPE_SINT64:
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  DescriptorPool m_pool;
+  DynamicMessageFactory m_factory;
+  // All of the lookup tables are filled by init() and only read afterwards , so
+  // the schema could be shared by converters of different threads.
+  std::map<const FieldDescriptor*,const Descriptor*> m_lazy_field;
+  std::map<const FieldDescriptor*,const FieldDescriptor*> m_packed_field;
+  std::map<const Descriptor*,const Message*> m_prototype;
+
+  DISALLOW_COPY_AND_ASSIGN(lazy_schema);
+};
+
+void lazy_schema::rewrite_field( const FieldDescriptor& real ,
+                                 FieldDescriptorProto* field ,
+                                 DescriptorProto* message ) {
+  if( is_packed_varint(real) ) {
+    // Each packed run on the wire becomes one bytes element
+    field->set_type(FieldDescriptorProto::TYPE_BYTES);
+    field->clear_type_name();
+    field->mutable_options()->clear_packed();
+    return;
+  }
+  if( !is_lazy(real) ) {
+    return;
+  }
+  field->set_type(FieldDescriptorProto::TYPE_BYTES);
+  field->clear_type_name();
+  // Proto3 bytes field has no presence while message field has. Add the
+  // synthetic oneof , as protoc does for proto3 optional , to keep it.
+  if( message != NULL &&
+      real.file()->syntax() == FileDescriptor::SYNTAX_PROTO3 &&
+      !real.is_repeated() &&
+      real.containing_oneof() == NULL ) {
+    field->set_proto3_optional(true);
+    field->set_oneof_index(message->oneof_decl_size());
+    message->add_oneof_decl()->set_name("_" + real.name());
+  }
+}
+
+void lazy_schema::rewrite_message( const Descriptor& real , DescriptorProto* message ) {
+  // Synthetic oneof must come after all the real ones , so they are appended
+  // once the existing declarations are in place.
+  for( int i = 0 ; i < real.field_count() ; ++i ) {
+    rewrite_field(*real.field(i),message->mutable_field(i),message);
+  }
+  for( int i = 0 ; i < real.extension_count() ; ++i ) {
+    rewrite_field(*real.extension(i),message->mutable_extension(i),NULL);
+  }
+  for( int i = 0 ; i < real.nested_type_count() ; ++i ) {
+    rewrite_message(*real.nested_type(i),message->mutable_nested_type(i));
+  }
+}
+
+bool lazy_schema::build_file( const FileDescriptor* real ) {
+  if( m_pool.FindFileByName(real->name()) != NULL ) {
+    return true;
+  }
+  for( int i = 0 ; i < real->dependency_count() ; ++i ) {
+    if( !build_file(real->dependency(i)) ) {
+      return false;
+    }
+  }
+  FileDescriptorProto file;
+  real->CopyTo(&file);
+  for( int i = 0 ; i < real->message_type_count() ; ++i ) {
+    rewrite_message(*real->message_type(i),file.mutable_message_type(i));
+  }
+  for( int i = 0 ; i < real->extension_count() ; ++i ) {
+    rewrite_field(*real->extension(i),file.mutable_extension(i),NULL);
+  }
+  const FileDescriptor* shadow = m_pool.BuildFile(file);
+  if( shadow == NULL ) {
+    return false;
+  }
+  for( int i = 0 ; i < real->message_type_count() ; ++i ) {
+    index_message(*real->message_type(i),*shadow->message_type(i));
+  }
+  for( int i = 0 ; i < real->extension_count() ; ++i ) {
+    index_field(*real->extension(i),*shadow->extension(i));
+  }
+  return true;
+}
+
+void lazy_schema::index_field( const FieldDescriptor& real , const FieldDescriptor& shadow ) {
+  if( is_lazy(real) ) {
+    m_lazy_field[&shadow] = m_pool.FindMessageTypeByName(real.message_type()->full_name());
+  } else if( is_packed_varint(real) ) {
+    m_packed_field[&shadow] = &real;
+  }
+}
+
+void lazy_schema::index_message( const Descriptor& real , const Descriptor& shadow ) {
+  m_prototype[&shadow] = m_factory.GetPrototype(&shadow);
+  for( int i = 0 ; i < real.field_count() ; ++i ) {
+    index_field(*real.field(i),*shadow.field(i));
+  }
+  for( int i = 0 ; i < real.extension_count() ; ++i ) {
+    index_field(*real.extension(i),*shadow.extension(i));
+  }
+  for( int i = 0 ; i < real.nested_type_count() ; ++i ) {
+    index_message(*real.nested_type(i),*shadow.nested_type(i));
+  }
+}
+
+bool lazy_schema::init( const FileDescriptor* file ) {
+  return build_file(file);
+}
+
+// Resolve message types by name for Any payloads and for records wrapped in a
+// typed envelope , where one field names the type of the bytes in another.
+// Names are looked up in the schema once and then served from a hash table ,
+// unresolvable names are cached as well. The table is guarded by a mutex since
+// the converters of the pool threads share it.
+// The well known types with a json mapping of their own are recognized here
+// as well , by descriptor , both the real and the shadow one. That table is
+// filled by the constructor and only read afterwards.
+class type_resolver {
+public:
+  struct entry {
+    const Descriptor* descriptor; // NULL for an unknown name
+    const Message* prototype;
+  };
+
+  enum well_known_type {
+    WKT_NONE ,
+    WKT_ANY ,
+    WKT_TIMESTAMP ,
+    WKT_DURATION ,
+    WKT_WRAPPER ,     // Any of the scalar wrappers , written as its value
+    WKT_STRUCT ,
+    WKT_VALUE ,
+    WKT_LIST_VALUE
+  };
+
+  type_resolver( const DescriptorPool* pool ,
+                 MessageFactory* factory ,
+                 const lazy_schema* lazy );
+
+  // Name could be a full message name or an Any type url , in which case
+  // only the part after the last '/' is used.
+  const entry* resolve( const std::string& name );
+
+  well_known_type well_known( const Descriptor& descriptor ) const {
+    std::map<const Descriptor*,well_known_type>::const_iterator
+      itr = m_well_known.find(&descriptor);
+    return itr == m_well_known.end() ? WKT_NONE : itr->second;
+  }
+
+private:
+  const DescriptorPool* m_pool;
+  MessageFactory* m_factory;
+  const lazy_schema* m_lazy;
+  std::map<const Descriptor*,well_known_type> m_well_known;
+  std::unordered_map<std::string,entry> m_cache;
+  std::mutex m_lock;
+
+  DISALLOW_COPY_AND_ASSIGN(type_resolver);
+};
+
+type_resolver::type_resolver( const DescriptorPool* pool ,
+                              MessageFactory* factory ,
+                              const lazy_schema* lazy ):
+  m_pool( pool ),
+  m_factory( factory ),
+  m_lazy( lazy ),
+  m_well_known(),
+  m_cache(),
+  m_lock()
+{
+  static const struct {
+    const char* name;
+    well_known_type type;
+  } kWellKnownType[] = {
+    { "google.protobuf.Any" , WKT_ANY },
+    { "google.protobuf.Timestamp" , WKT_TIMESTAMP },
+    { "google.protobuf.Duration" , WKT_DURATION },
+    { "google.protobuf.DoubleValue" , WKT_WRAPPER },
+    { "google.protobuf.FloatValue" , WKT_WRAPPER },
+    { "google.protobuf.Int64Value" , WKT_WRAPPER },
+    { "google.protobuf.UInt64Value" , WKT_WRAPPER },
+    { "google.protobuf.Int32Value" , WKT_WRAPPER },
+    { "google.protobuf.UInt32Value" , WKT_WRAPPER },
+    { "google.protobuf.BoolValue" , WKT_WRAPPER },
+    { "google.protobuf.StringValue" , WKT_WRAPPER },
+    { "google.protobuf.BytesValue" , WKT_WRAPPER },
+    { "google.protobuf.Struct" , WKT_STRUCT },
+    { "google.protobuf.Value" , WKT_VALUE },
+    { "google.protobuf.ListValue" , WKT_LIST_VALUE },
+    { NULL , WKT_NONE }
+  };
+  for( int i = 0 ; kWellKnownType[i].name != NULL ; ++i ) {
+    const Descriptor* real = pool->FindMessageTypeByName(kWellKnownType[i].name);
+    if( real == NULL ) {
+      continue;
+    }
+    m_well_known[real] = kWellKnownType[i].type;
+    const Descriptor* shadow = lazy != NULL ? lazy->shadow(real) : NULL;
+    if( shadow != NULL ) {
+      m_well_known[shadow] = kWellKnownType[i].type;
+    }
+  }
+}
+
+const type_resolver::entry* type_resolver::resolve( const std::string& name ) {
+  std::lock_guard<std::mutex> guard(m_lock);
+  std::unordered_map<std::string,entry>::iterator itr = m_cache.find(name);
+  if( itr != m_cache.end() ) {
+    return &(itr->second);
+  }
+  entry& ret = m_cache[name];
+  ret.descriptor = NULL;
+  ret.prototype = NULL;
+
+  const std::size_t slash = name.find_last_of('/');
+  const Descriptor* real = m_pool->FindMessageTypeByName(
+      slash == std::string::npos ? name : name.substr(slash+1));
+  if( real == NULL ) {
+    return &ret;
+  }
+  // Type outside of the shadow pool is decoded eagerly , converter handles a
+  // mix of lazy and real messages.
+  if( m_lazy != NULL ) {
+    const Descriptor* shadow = m_lazy->shadow(real);
+    if( shadow != NULL && m_lazy->prototype(shadow) != NULL ) {
+      ret.descriptor = shadow;
+      ret.prototype = m_lazy->prototype(shadow);
+      return &ret;
+    }
+  }
+  ret.prototype = m_factory->GetPrototype(real);
+  if( ret.prototype != NULL ) {
+    ret.descriptor = real;
+  }
+  return &ret;
+}
+
+// Field keys encoded once , at startup , for the writer format in use. The
+// table is filled before any conversion starts and only read afterwards , so
+// it is shared by the converters of all threads. Key of a field not in the
+// table is encoded on the fly.
+class key_table {
+public:
+  explicit key_table( const proto2json::writer& w ):
+    m_writer( w ),
+    m_key()
+  {}
+
+  // Add keys of all the fields of the message types declared in the file and
+  // its dependencies , which covers every type an Any payload or an envelope
+  // could resolve to. Extensions known to the pool and the lazy submessage
+  // types are included.
+  void add( const FileDescriptor* file , const lazy_schema* lazy );
+
+  const std::string* find( const FieldDescriptor* field ) const {
+    std::map<const FieldDescriptor*,std::string>::const_iterator itr = m_key.find(field);
+    return itr == m_key.end() ? NULL : &(itr->second);
+  }
+
+  void encode( const FieldDescriptor& field , std::string* output ) const {
+    // Extension uses its full name in bracket as key , as proto3 json mapping
+    if( field.is_extension() ) {
+      m_writer.encode_key("[" + field.full_name() + "]",output);
+    } else {
+      m_writer.encode_key(field.name(),output);
+    }
+  }
+
+private:
+  void add_field( const FieldDescriptor* field , const lazy_schema* lazy ,
+                  std::set<const Descriptor*>* visited );
+  void add_message( const Descriptor* descriptor , const lazy_schema* lazy ,
+                    std::set<const Descriptor*>* visited );
+  void add_nested( const Descriptor* descriptor , const lazy_schema* lazy ,
+                   std::set<const Descriptor*>* visited );
+  void add_file( const FileDescriptor* file , const lazy_schema* lazy ,
+                 std::set<const FileDescriptor*>* visited_file ,
+                 std::set<const Descriptor*>* visited );
+
+  const proto2json::writer& m_writer;
+  std::map<const FieldDescriptor*,std::string> m_key;
+
+  DISALLOW_COPY_AND_ASSIGN(key_table);
+};
+
+void key_table::add_field( const FieldDescriptor* field , const lazy_schema* lazy ,
+                           std::set<const Descriptor*>* visited ) {
+  // Type shared by several of the added files is walked once per file
+  std::string& key = m_key[field];
+  if( key.empty() ) {
+    encode(*field,&key);
+  }
+  if( field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE ) {
+    add_message(field->message_type(),lazy,visited);
+  } else if( lazy != NULL && lazy->message_type(field) != NULL ) {
+    add_message(lazy->message_type(field),lazy,visited);
+  }
+}
+
+void key_table::add_message( const Descriptor* descriptor , const lazy_schema* lazy ,
+                             std::set<const Descriptor*>* visited ) {
+  if( !visited->insert(descriptor).second ) {
+    return;
+  }
+  for( int i = 0 ; i < descriptor->field_count() ; ++i ) {
+    add_field(descriptor->field(i),lazy,visited);
+  }
+  std::vector<const FieldDescriptor*> extension;
+  descriptor->file()->pool()->FindAllExtensions(descriptor,&extension);
+  for( std::size_t i = 0 ; i < extension.size() ; ++i ) {
+    add_field(extension[i],lazy,visited);
+  }
+}
+
+void key_table::add_nested( const Descriptor* descriptor , const lazy_schema* lazy ,
+                            std::set<const Descriptor*>* visited ) {
+  add_message(descriptor,lazy,visited);
+  for( int i = 0 ; i < descriptor->nested_type_count() ; ++i ) {
+    add_nested(descriptor->nested_type(i),lazy,visited);
+  }
+}
+
+void key_table::add_file( const FileDescriptor* file , const lazy_schema* lazy ,
+                          std::set<const FileDescriptor*>* visited_file ,
+                          std::set<const Descriptor*>* visited ) {
+  if( !visited_file->insert(file).second ) {
+    return;
+  }
+  for( int i = 0 ; i < file->dependency_count() ; ++i ) {
+    add_file(file->dependency(i),lazy,visited_file,visited);
+  }
+  for( int i = 0 ; i < file->message_type_count() ; ++i ) {
+    add_nested(file->message_type(i),lazy,visited);
+  }
+}
+
+void key_table::add( const FileDescriptor* file , const lazy_schema* lazy ) {
+  std::set<const FileDescriptor*> visited_file;
+  std::set<const Descriptor*> visited;
+  add_file(file,lazy,&visited_file,&visited);
+}
+
+// Rendered output of lazy submessages keyed by their type , the depth they
+// were written at and their bytes , in least recently used order within a
+// byte budget. Entries are found by the hash of the bytes and then compared
+// byte for byte , a hash collision is only a miss. Each converter has its
+// own , so no locking.
+// A miss costs a hash and a copy on top of the conversion. Once a window of
+// lookups mostly misses , only one submessage in kProbeRate goes through the
+// cache , until a window of those hits again , so input without repeats
+// converts about as fast as without a cache.
+class memo_cache {
 public:
-  // Option for the converstion
-  struct option {
-    bool double_to_string;
-    bool float_to_string;
-
-    // Not allow real number to be output as number digits
-    // but force them as string literal there.
-    void set_real_to_string() {
-      double_to_string = true;
-      float_to_string = true;
-    }
-
-    // For enum type, not only display the name of enum value but
-    // also display the index of this enum value
-    bool display_enum_index;
-
-    option():
-      double_to_string( false ),
-      float_to_string( false ),
-      display_enum_index( false )
-    {}
+  explicit memo_cache( std::size_t capacity ):
+    m_capacity( capacity ),
+    m_size( 0 ),
+    m_entry(),
+    m_index(),
+    m_lookup( 0 ),
+    m_hit( 0 ),
+    m_sparse( false ),
+    m_skip( 0 )
+  {}
+
+  // Whether the next submessage should be looked up
+  bool wanted() {
+    if( m_skip > 0 ) {
+      --m_skip;
+      return false;
+    }
+    if( m_sparse ) {
+      m_skip = kProbeRate - 1;
+    }
+    return true;
+  }
+
+  // Output of the submessage if cached. Hash is set either way , for insert.
+  const std::string* find( const Descriptor* type , int depth ,
+                           const std::string& data , uint64_t* hash ) {
+    if( ++m_lookup == kWindow ) {
+      m_sparse = m_hit * 4 < m_lookup;
+      m_lookup = 0;
+      m_hit = 0;
+    }
+    *hash = ::util::Hash64(data.data(),data.size(),
+                           reinterpret_cast<uintptr_t>(type) + static_cast<uint64_t>(depth));
+    std::unordered_map<uint64_t,entry_list::iterator>::iterator itr = m_index.find(*hash);
+    if( itr == m_index.end() ) {
+      return NULL;
+    }
+    entry& e = *itr->second;
+    if( e.type != type || e.depth != depth || e.data != data ) {
+      return NULL;
+    }
+    if( itr->second != m_entry.begin() ) {
+      m_entry.splice(m_entry.begin(),m_entry,itr->second);
+    }
+    ++m_hit;
+    return &e.output;
+  }
+
+  void insert( uint64_t hash , const Descriptor* type , int depth ,
+               const std::string& data , const std::string& output ) {
+    const std::size_t size = footprint(data,output);
+    // One entry taking a good part of the budget would only flush the others
+    if( size > m_capacity / 4 ) {
+      return;
+    }
+    std::unordered_map<uint64_t,entry_list::iterator>::iterator itr = m_index.find(hash);
+    if( itr != m_index.end() ) {
+      remove(itr->second);
+    }
+    m_entry.push_front(entry());
+    entry& e = m_entry.front();
+    e.hash = hash;
+    e.type = type;
+    e.depth = depth;
+    e.data = data;
+    e.output = output;
+    m_index[hash] = m_entry.begin();
+    m_size += size;
+    while( m_size > m_capacity ) {
+      entry_list::iterator last = m_entry.end();
+      remove(--last);
+    }
+  }
+
+private:
+  struct entry {
+    uint64_t hash;
+    const Descriptor* type;
+    int depth;
+    std::string data;
+    std::string output;
   };
+  typedef std::list<entry> entry_list;
 
+  static std::size_t footprint( const std::string& data , const std::string& output ) {
+    return data.size() + output.size() + sizeof(entry) + 64;
+  }
+
+  void remove( entry_list::iterator e ) {
+    m_size -= footprint(e->data,e->output);
+    m_index.erase(e->hash);
+    m_entry.erase(e);
+  }
+
+  static const int kWindow = 1024;
+  static const int kProbeRate = 16;
+
+  const std::size_t m_capacity;
+  std::size_t m_size;
+  entry_list m_entry; // Most recently used first
+  std::unordered_map<uint64_t,entry_list::iterator> m_index;
+  int m_lookup; // Lookups and hits of the current window
+  int m_hit;
+  bool m_sparse; // Only probing , the last window mostly missed
+  int m_skip; // Submessages left before the next probe
+
+  DISALLOW_COPY_AND_ASSIGN(memo_cache);
+};
+
+// Walk a message and describe it to a writer. Despite the name the output
+// format is whatever the writer produces : json , msgpack or cbor.
+// Fields of an envelope record type , see option::type_field. They belong to
+// the converted type , the shadow one with a lazy schema.
+struct envelope {
+  const FieldDescriptor* type;
+  const FieldDescriptor* payload;
+};
+
+class message_to_json {
+public:
+  typedef proto2json::option option;
 
   message_to_json( Message* message , // Input message
-                   std::ostream& output ,
+                   proto2json::writer& output ,
                    const option& opt ):
     m_message( message ),
     m_output ( output ),
-    m_option( opt )
+    m_option( opt ),
+    m_pool( NULL ),
+    m_lazy( NULL ),
+    m_keys( NULL ),
+    m_types( NULL ),
+    m_envelope( NULL ),
+    m_memo( NULL ),
+    m_memo_stream( NULL ),
+    m_memo_writer( NULL ),
+    m_memo_conv( NULL ),
+    m_depth( 0 ),
+    m_present(),
+    m_packed(),
+    m_map_slot(),
+    m_map_key(),
+    m_date(),
+    m_text()
   {}
 
+  ~message_to_json() {
+    delete m_memo_conv;
+    delete m_memo_writer;
+    delete m_memo_stream;
+  }
+
+  // Converter could be reused for another message of the same type , which
+  // keeps its scratch buffers.
+  void set_message( Message* message ) {
+    m_message = message;
+  }
+
+  // With a lazy schema the message is an instance of the shadow type , and
+  // submessage is only decoded from its raw bytes when it is written.
+  void set_lazy_schema( const lazy_schema* lazy ) {
+    m_lazy = lazy;
+  }
+
+  // Pre encoded keys for the writer format , not owned.
+  void set_key_table( const key_table* keys ) {
+    m_keys = keys;
+  }
+
+  // Without a resolver Any and the other well known types are written as
+  // plain messages and the envelope payload as bytes. Not owned.
+  void set_type_resolver( type_resolver* types ) {
+    m_types = types;
+  }
+
+  // Payload of the envelope is only decoded with a type resolver. Not owned.
+  void set_envelope( const envelope* fields ) {
+    m_envelope = fields;
+  }
+
+  // Lazy submessages are written from the cache when their bytes were seen
+  // before. Not owned.
+  void set_memo_cache( memo_cache* memo ) {
+    m_memo = memo;
+  }
+
+  // Nesting depth of the converted message inside of the whole record , used
+  // when a record is converted piece by piece.
+  void set_base_depth( int depth ) {
+    m_depth = depth;
+  }
+
+  // Repeated message field larger than kParallelThreshold is split into shards
+  // which are converted by the pool into their own buffer and concatenated in
+  // order. The pool is not owned by the converter.
+  void set_thread_pool( ::util::thread_pool* pool ) {
+    m_pool = pool;
+  }
+
+  typedef std::set<const FieldDescriptor*> field_set;
+
   void convert();
 
+  // Convert the fields of the top level message into the object the writer
+  // currently has open , without opening a new one. Fields inside of skip are
+  // not written.
+  void convert_fields( const field_set& skip );
+
 private:
+  // Map entry in the written order , see convert_map_field
+  struct map_slot {
+    uint64_t order;   // Integer key mapped so that unsigned order is key order
+    std::string key;  // Key as written
+    int index;        // Entry index in the repeated view of the map
+    int position;     // Index of the first entry of the key , for wire order
+  };
 
   // This function convert an atomic field value into a json field.
   void convert_atomic_field( const Message* message , const FieldDescriptor& field );
   void convert_nested_field( const Message* message , const Descriptor& field );
   void convert_enum_field( const Message* message , const FieldDescriptor& field );
+  void convert_enum_value( const EnumValueDescriptor* value );
+  void convert_field_list( const Message* message , const Descriptor& message_descriptor ,
+                           const field_set* skip , bool object ,
+                           const std::string* type_url );
+  void convert_field( const Message* message , const FieldDescriptor& field );
+  void convert_absent_field( const Message* message , const FieldDescriptor& field );
+  void convert_unknown_field( const UnknownField& field );
+  void convert_unknown_field_list( const UnknownFieldSet& unknown , const Descriptor* owner );
+  void convert_repeated_parallel( const Message* message , const FieldDescriptor& field ,
+                                  const std::vector<map_slot>* slot );
+  void convert_map_field( const Message* message , const FieldDescriptor& field );
+  void convert_map_entry( const Message& entry , const std::string& key );
+  void convert_value( const Message& message , const FieldDescriptor& field , int index );
+  bool convert_well_known( const Message* message , const Descriptor& message_descriptor ,
+                           type_resolver::well_known_type type );
+  static void map_key( const Message& entry , const FieldDescriptor& key_field ,
+                       map_slot* slot );
+  static bool map_slot_less( const map_slot& l , const map_slot& r ) {
+    if( l.order != r.order ) {
+      return l.order < r.order;
+    }
+    const int c = l.key.compare(r.key);
+    return c != 0 ? c < 0 : l.index < r.index;
+  }
+  static bool map_slot_position_less( const map_slot& l , const map_slot& r ) {
+    return l.position < r.position;
+  }
+  void convert_lazy_field( const Message* message , const FieldDescriptor& field ,
+                           const Descriptor& message_type );
+  void convert_lazy_message( const std::string& data , const Descriptor& message_type );
+  void render_lazy_message( const std::string& data , const Descriptor& message_type ,
+                            std::string* output );
+  void convert_packed_field( const Message* message , const FieldDescriptor& field ,
+                             const FieldDescriptor& real );
+  void add_unpacked_field( const Descriptor& message_descriptor ,
+                           const UnknownFieldSet& unknown ,
+                           std::vector<const FieldDescriptor*>* present );
+  void convert_any( const Message* message , const Descriptor& message_descriptor );
+  void convert_payload_field( const Message* message , const FieldDescriptor& field );
+  void write_key( const FieldDescriptor& field );
+
+  static const int kParallelThreshold = 4096;
+  static const int kMinShardSize = 256;
+  // Smaller submessage converts about as fast as it is hashed and looked up
+  static const std::size_t kMinMemoSize = 64;
 
   Message* m_message;
-  std::ostream& m_output;
-  option m_option;
+  proto2json::writer& m_output;
+  const option& m_option;
+  ::util::thread_pool* m_pool;
+  const lazy_schema* m_lazy;
+  const key_table* m_keys;
+  type_resolver* m_types;
+  const envelope* m_envelope;
+  memo_cache* m_memo;
+  // Submessage missed in the cache is rendered by this converter into its
+  // own stream , created on the first miss
+  std::ostringstream* m_memo_stream;
+  proto2json::writer* m_memo_writer;
+  message_to_json* m_memo_conv;
+  int m_depth; // Number of json object currently open
+  // Per depth scratch , deque keeps reference of outer depth valid on growth
+  std::deque< std::vector<const FieldDescriptor*> > m_present;
+  std::vector<uint64_t> m_packed; // Decoded values of a packed field
+  std::deque< std::vector<map_slot> > m_map_slot; // Per depth , as m_present
+  std::string m_map_key; // Encoded key of a map entry
+  ::util::date_cache m_date; // Last day a Timestamp was written on
+  std::string m_text; // Formatted Timestamp or Duration
 };
 
+void message_to_json::write_key( const FieldDescriptor& field ) {
+  const std::string* key = m_keys != NULL ? m_keys->find(&field) : NULL;
+  if( key != NULL ) {
+    m_output.encoded_key(*key);
+  } else {
+    std::string buf;
+    if( field.is_extension() ) {
+      m_output.encode_key("[" + field.full_name() + "]",&buf);
+    } else {
+      m_output.encode_key(field.name(),&buf);
+    }
+    m_output.encoded_key(buf);
+  }
+}
 
 void message_to_json::convert_atomic_field( const Message* message , const FieldDescriptor& field ) {
   const Reflection* reflection = message->GetReflection();
 
 #define DO_(Type,type,OUTPUT) \
     do { \
+      write_key(field); \
       if( field.is_repeated() ) { \
         const int size = reflection->FieldSize(*message,&field); \
-        m_output<<"\""<<field.name()<<"\":["; \
+        m_output.begin_array(size); \
         for( int i = 0 ; i < size ; ++i ) { \
-          m_output << reflection->GetRepeated##Type(*message,&field,i); \
-          if( i != size - 1 ) { \
-            m_output << ","; \
-          } \
+          type value = reflection->GetRepeated##Type(*message,&field,i); \
+          OUTPUT(m_output,value); \
         } \
-        m_output <<"]"; \
+        m_output.end_array(); \
       } else { \
         if( reflection->HasField(*message,&field) ) { \
-          m_output<<"\""<<field.name()<<"\":"; \
           type value = reflection->Get##Type(*message,&field); \
           OUTPUT(m_output,value); \
         } else { \
-          m_output<<"\""<<field.name()<<"\":null"; \
+          m_output.null_value(); \
         } \
       } \
     } while(0); break
 
-#define VALUE_OUTPUT(O,V) O<<"\""<<V<<"\""
-
-#define BOOLEAN_OUTPUT(O,V) \
-  do { \
-    O << (V?"true":"false"); \
-  } while(0)
-
-#define FLOAT_OUTPUT(O,V) \
-  do { \
-    if( m_option.float_to_string ) { \
-      O << "\""<<to_string(V)<<"\""; \
-    } else { \
-      O << V; \
-    } \
-  } while(0)
-
-#define DOUBLE_OUTPUT(O,V) \
-  do { \
-    if( m_option.double_to_string ) { \
-      O << "\""<<to_string(V)<<"\""; \
-    } else { \
-      O << V; \
-    } \
-  } while(0)
-
-#define BASE64_OUTPUT(O,V) \
-  do { \
-    std::string output; \
-    util::Base64Encode(V.c_str(),V.size(),&output); \
-    O << "\"" << output << "\""; \
-  } while(0)
+#define STRING_OUTPUT(O,V) O.string_value(V)
+#define BYTES_OUTPUT(O,V) O.bytes_value(V)
+#define BOOLEAN_OUTPUT(O,V) O.bool_value(V)
+#define INT32_OUTPUT(O,V) O.int_value(V,m_option.int32_to_string)
+#define INT64_OUTPUT(O,V) O.int_value(V,m_option.int64_to_string)
+#define UINT32_OUTPUT(O,V) O.uint_value(V,m_option.int32_to_string)
+#define UINT64_OUTPUT(O,V) O.uint_value(V,m_option.int64_to_string)
+#define FLOAT_OUTPUT(O,V) O.float_value(V,m_option.float_to_string)
+#define DOUBLE_OUTPUT(O,V) O.double_value(V,m_option.double_to_string)
 
   switch( field.cpp_type() ) {
     case FieldDescriptor::CPPTYPE_BOOL:
@@ -142,307 +839,1608 @@ void message_to_json::convert_atomic_field( const Message* message , const Field
     case FieldDescriptor::CPPTYPE_DOUBLE:
       DO_(Double,double,DOUBLE_OUTPUT);
     case FieldDescriptor::CPPTYPE_INT32:
-      DO_(Int32,int32_t,VALUE_OUTPUT);
+      DO_(Int32,int32_t,INT32_OUTPUT);
     case FieldDescriptor::CPPTYPE_INT64:
-      DO_(Int64,int64_t,VALUE_OUTPUT);
+      DO_(Int64,int64_t,INT64_OUTPUT);
     case FieldDescriptor::CPPTYPE_UINT32:
-      DO_(UInt32,uint32_t,VALUE_OUTPUT);
+      DO_(UInt32,uint32_t,UINT32_OUTPUT);
     case FieldDescriptor::CPPTYPE_UINT64:
-      DO_(UInt64,uint64_t,VALUE_OUTPUT);
+      DO_(UInt64,uint64_t,UINT64_OUTPUT);
     case FieldDescriptor::CPPTYPE_STRING:
+      if( m_envelope != NULL && m_types != NULL && &field == m_envelope->payload ) {
+        convert_payload_field(message,field);
+        return;
+      }
+      if( m_lazy != NULL && field.type() == FieldDescriptor::TYPE_BYTES ) {
+        const Descriptor* message_type = m_lazy->message_type(&field);
+        if( message_type != NULL ) {
+          convert_lazy_field(message,field,*message_type);
+          return;
+        }
+        const FieldDescriptor* packed = m_lazy->packed_field(&field);
+        if( packed != NULL ) {
+          convert_packed_field(message,field,*packed);
+          return;
+        }
+      }
       if( field.type() == FieldDescriptor::TYPE_STRING ) {
-        DO_(String,std::string,VALUE_OUTPUT);
+        DO_(String,std::string,STRING_OUTPUT);
       } else {
-        DO_(String,std::string,BASE64_OUTPUT);
+        DO_(String,std::string,BYTES_OUTPUT);
       }
     default:
       UNREACHABLE();
       return;
   }
 #undef DO_
-#undef VALUE_OUTPUT
+#undef STRING_OUTPUT
+#undef BYTES_OUTPUT
 #undef BOOLEAN_OUTPUT
+#undef INT32_OUTPUT
+#undef INT64_OUTPUT
+#undef UINT32_OUTPUT
+#undef UINT64_OUTPUT
 #undef FLOAT_OUTPUT
 #undef DOUBLE_OUTPUT
 }
 
+void message_to_json::convert_enum_value( const EnumValueDescriptor* enum_value ) {
+  if( m_option.display_enum_index ) {
+    m_output.begin_object(2);
+    m_output.key("value");
+    m_output.string_value(enum_value->name());
+    m_output.key("index");
+    m_output.int_value(enum_value->index(),false);
+    m_output.end_object();
+  } else {
+    m_output.string_value(enum_value->name());
+  }
+}
+
 void message_to_json::convert_enum_field( const Message* message , const FieldDescriptor& field ) {
   assert( field.cpp_type() == FieldDescriptor::CPPTYPE_ENUM );
   const Reflection* reflection = message->GetReflection();
+  write_key(field);
   if( field.is_repeated() ) {
     const int size = reflection->FieldSize(*message,&field);
-    m_output<<"\""<<field.name()<<"\":[";
+    m_output.begin_array(size);
     for( int i = 0 ; i < size ; ++i ) {
-      const EnumValueDescriptor* enum_value =
-        reflection->GetRepeatedEnum(*message,&field,i);
-      if( m_option.display_enum_index ) {
-        m_output<<"{\"value\":\""<<
-          enum_value->name()<<"\",\"index\":"<<
-          enum_value->index()<<"}";
-      } else {
-        m_output<<"\""<<enum_value->name()<<"\"";
-      }
-      if( i != size - 1 ) {
-        m_output<<",";
-      }
+      convert_enum_value(reflection->GetRepeatedEnum(*message,&field,i));
     }
-    m_output<<"]";
+    m_output.end_array();
   } else {
     if( reflection->HasField(*message,&field) ) {
-      m_output<<"\""<<field.name()<<"\":";
-      const EnumValueDescriptor* enum_value = reflection->GetEnum(*message,&field);
-      if( m_option.display_enum_index ) {
-        m_output<<"{\"value\":\""<<enum_value->name()<<"\",";
-        m_output<<"\"index\":"<<enum_value->index()<<"}";
-      } else {
-        m_output<<"\""<<enum_value->name()<<"\"";
-      }
+      convert_enum_value(reflection->GetEnum(*message,&field));
     } else {
-      m_output<<"\""<<field.name()<<"\":null";
+      m_output.null_value();
     }
   }
 }
 
 void message_to_json::convert_nested_field( const Message* message , const Descriptor& message_descriptor ) {
-  // Iterate through each field descriptors and then dispatch it
-  const int size = message_descriptor.field_count();
-  m_output<<"{";
-  for( int i = 0 ; i < size ; ++i ) {
-    const FieldDescriptor* field = message_descriptor.field(i);
-    switch(field->cpp_type()) {
-      case FieldDescriptor::CPPTYPE_ENUM:
-        convert_enum_field(message,*field);
-        break;
-      case FieldDescriptor::CPPTYPE_MESSAGE:
-        {
-          m_output<<"\""<<field->name()<<"\":";
-          const Reflection* reflection = message->GetReflection();
-
-          // Checking if this message is repeated or just a singular one
-          if( field->is_repeated() ) {
-            // Dump message one by one here
-            const int size = reflection->FieldSize(*message,field);
-            m_output<<"[";
-            for( int i = 0 ; i < size ; ++i ) {
-              convert_nested_field( &(reflection->GetRepeatedMessage(
-                      *message,field,i)),*(field->message_type()));
-              if( i != size - 1 ) {
-                m_output<<",";
-              }
-            }
-            m_output<<"]";
-          } else {
-            convert_nested_field( &(reflection->GetMessage(
-                    *message,field)),*(field->message_type()));
-          }
-          break;
-        }
-      default:
-        convert_atomic_field(message,*field);
-        break;
+  if( m_types != NULL ) {
+    const type_resolver::well_known_type type = m_types->well_known(message_descriptor);
+    if( type == type_resolver::WKT_ANY ) {
+      convert_any(message,message_descriptor);
+      return;
     }
-    if( i != size - 1 ) {
-      m_output<<",";
+    // Value out of the range of the json mapping falls back to the fields
+    if( type != type_resolver::WKT_NONE &&
+        convert_well_known(message,message_descriptor,type) ) {
+      return;
     }
   }
-  m_output<<"}";
+  ++m_depth;
+  convert_field_list(message,message_descriptor,NULL,true,NULL);
+  --m_depth;
 }
 
-void message_to_json::convert() {
-  return convert_nested_field(m_message,*m_message->GetDescriptor());
-}
+void message_to_json::convert_any( const Message* message , const Descriptor& message_descriptor ) {
+  // Proto3 json mapping : the payload fields are written inline next to an
+  // "@type" member. Payload of an unknown type , or which does not decode ,
+  // is written as its type url and raw bytes.
+  const Reflection* reflection = message->GetReflection();
+  std::string url_scratch;
+  std::string value_scratch;
+  const std::string& url = reflection->GetStringReference(
+      *message,message_descriptor.FindFieldByNumber(1),&url_scratch);
+  const std::string& value = reflection->GetStringReference(
+      *message,message_descriptor.FindFieldByNumber(2),&value_scratch);
 
-std::string to_string( float value ) {
-  char buf[1024];
-  sprintf(buf,"%f",value);
-  return std::string(buf);
-}
+  const type_resolver::entry* payload = url.empty() ? NULL : m_types->resolve(url);
+  if( payload != NULL && payload->descriptor != NULL ) {
+    Message* decoded = payload->prototype->New();
+    const bool ok = decoded->ParsePartialFromString(value);
+    if( ok && m_types->well_known(*payload->descriptor) != type_resolver::WKT_NONE ) {
+      // Payload which is not written as an object goes into "value"
+      m_output.begin_object(2);
+      m_output.key("@type");
+      m_output.string_value(url);
+      m_output.key("value");
+      convert_nested_field(decoded,*payload->descriptor);
+      m_output.end_object();
+    } else if( ok ) {
+      ++m_depth;
+      convert_field_list(decoded,*payload->descriptor,NULL,true,&url);
+      --m_depth;
+    }
+    delete decoded;
+    if( ok ) {
+      return;
+    }
+  }
 
-std::string to_string( double value ) {
-  char buf[1024];
-  sprintf(buf,"%f",value);
-  return std::string(buf);
+  m_output.begin_object((url.empty() ? 0 : 1) + (value.empty() ? 0 : 1));
+  if( !url.empty() ) {
+    m_output.key("@type");
+    m_output.string_value(url);
+  }
+  if( !value.empty() ) {
+    m_output.key("value");
+    m_output.bytes_value(value);
+  }
+  m_output.end_object();
 }
 
-struct option kOptions[] = {
-  {"proto",required_argument,0,'p'},
-  {"message",required_argument,0,'m'},
-  {"double_to_string",optional_argument,0,'d'},
-  {"float_to_string",optional_argument,0,'f'},
-  {"display_enum_index",optional_argument,0,'e'}
-};
+void message_to_json::convert_payload_field( const Message* message , const FieldDescriptor& field ) {
+  const Reflection* reflection = message->GetReflection();
+  write_key(field);
+  if( !reflection->HasField(*message,&field) ) {
+    m_output.null_value();
+    return;
+  }
+  std::string name_scratch;
+  std::string value_scratch;
+  const std::string& name = reflection->GetStringReference(
+      *message,m_envelope->type,&name_scratch);
+  const std::string& value = reflection->GetStringReference(
+      *message,&field,&value_scratch);
 
-struct command_option {
-  std::string proto_path;
-  std::string message;
-  message_to_json::option option;
-};
+  const type_resolver::entry* payload = m_types->resolve(name);
+  if( payload->descriptor != NULL ) {
+    Message* decoded = payload->prototype->New();
+    const bool ok = decoded->ParsePartialFromString(value);
+    if( ok ) {
+      convert_nested_field(decoded,*payload->descriptor);
+    }
+    delete decoded;
+    if( ok ) {
+      return;
+    }
+  }
+  m_output.bytes_value(value);
+}
 
-void show_error() {
-  std::cerr<<"Usage:\n";
-  std::cerr<<"Convert a protocol buffer record to json format!\n";
-  std::cerr<<" --proto,-p                           Protocol buffer schema file path\n";
-  std::cerr<<" --message,-m                         Message name\n";
-  std::cerr<<" --double_to_string,-d                Output double as string instead of numeric number\n";
-  std::cerr<<" --float_to_string,-f                 Output float as string instead of numeric number\n";
-  std::cerr<<" --display_enum_index,-e              Display enum value's index\n";
-}
-
-bool parse_command( int argc, char* argv[] , command_option* opt ) {
-  int opt_index = 0;
-  int c;
-  while((c = getopt_long(argc,argv,"p:m:dfpre",kOptions,&opt_index))!=-1) {
-    switch(c) {
-      case 'p':
-        opt->proto_path = optarg;
-        break;
-      case 'm':
-        opt->message = optarg;
-        break;
-      case 'd':
-        opt->option.double_to_string = true;
-        break;
-      case 'f':
-        opt->option.float_to_string = true;
-        break;
-      case 'e':
-        opt->option.display_enum_index = true;
-        break;
-      default:
-        show_error();
-        return false;
+void message_to_json::convert_lazy_field( const Message* message ,
+                                          const FieldDescriptor& field ,
+                                          const Descriptor& message_type ) {
+  const Reflection* reflection = message->GetReflection();
+  std::string scratch;
+  write_key(field);
+  if( field.is_repeated() ) {
+    const int size = reflection->FieldSize(*message,&field);
+    m_output.begin_array(size);
+    for( int i = 0 ; i < size ; ++i ) {
+      convert_lazy_message(
+          reflection->GetRepeatedStringReference(*message,&field,i,&scratch),
+          message_type);
     }
+    m_output.end_array();
+  } else {
+    // Unset submessage is written as the default instance , which is what
+    // decoding an empty string gives , same as the eager path.
+    convert_lazy_message(
+        reflection->GetStringReference(*message,&field,&scratch),message_type);
   }
-  if( opt->proto_path.empty() || opt->message.empty() ) {
-    show_error();
-    return false;
+}
+
+void message_to_json::convert_lazy_message( const std::string& data ,
+                                            const Descriptor& message_type ) {
+  bool raw = m_option.max_depth >= 0 && m_depth > m_option.max_depth;
+  if( !raw && m_memo != NULL && data.size() >= kMinMemoSize && m_memo->wanted() ) {
+    // Output only depends on the depth through max_depth
+    const int depth = m_option.max_depth >= 0 ? m_depth : 0;
+    uint64_t hash;
+    const std::string* cached = m_memo->find(&message_type,depth,data,&hash);
+    if( cached == NULL ) {
+      std::string output;
+      render_lazy_message(data,message_type,&output);
+      m_memo->insert(hash,&message_type,depth,data,output);
+      m_output.raw_value(output);
+    } else {
+      m_output.raw_value(*cached);
+    }
+    return;
+  }
+  if( !raw ) {
+    Message* message = m_lazy->prototype(&message_type)->New();
+    // The submessage is only validated here , bytes which does not decode
+    // fall back to the raw form instead of failing the whole record.
+    if( message->ParsePartialFromString(data) ) {
+      convert_nested_field(message,message_type);
+    } else {
+      raw = true;
+    }
+    delete message;
+  }
+  if( raw ) {
+    if( m_option.truncate_marker ) {
+      m_output.string_value("<truncated>");
+    } else {
+      m_output.bytes_value(data);
+    }
   }
-  return true;
 }
 
-std::string read_from_stdin() {
-  cin>>std::noskipws;
-  return std::string( std::istream_iterator<char>(cin),
-      std::istream_iterator<char>());
+// Write the submessage as a single value into output instead of the writer ,
+// for the memo cache
+void message_to_json::render_lazy_message( const std::string& data ,
+                                           const Descriptor& message_type ,
+                                           std::string* output ) {
+  if( m_memo_conv == NULL ) {
+    m_memo_stream = new std::ostringstream();
+    m_memo_writer = m_output.clone(*m_memo_stream);
+    m_memo_conv = new message_to_json(NULL,*m_memo_writer,m_option);
+    m_memo_conv->m_lazy = m_lazy;
+    m_memo_conv->m_keys = m_keys;
+    m_memo_conv->m_types = m_types;
+    m_memo_conv->m_envelope = m_envelope;
+  }
+  m_memo_stream->str(std::string());
+  m_memo_writer->begin_record();
+  m_memo_conv->m_depth = m_depth;
+  m_memo_conv->convert_lazy_message(data,message_type);
+  output->assign(m_memo_stream->str());
 }
 
-class single_file_error_collector : public compiler::MultiFileErrorCollector {
-public:
+void message_to_json::convert_packed_field( const Message* message ,
+                                            const FieldDescriptor& field ,
+                                            const FieldDescriptor& real ) {
+  const Reflection* reflection = message->GetReflection();
+  std::string scratch;
+  write_key(field);
+
+  // Values of all the packed runs first , then the ones which came unpacked.
+  // Serializer writes a field either way , only merged input could mix both.
+  m_packed.clear();
+  const int size = reflection->FieldSize(*message,&field);
+  for( int i = 0 ; i < size ; ++i ) {
+    const std::string& data = reflection->GetRepeatedStringReference(*message,&field,i,&scratch);
+    if( !::util::DecodePackedVarint(data.data(),data.size(),&m_packed) ) {
+      // Same as a lazy submessage which does not decode , the raw payloads
+      // are written instead of failing the whole record.
+      m_output.begin_array(size);
+      for( int j = 0 ; j < size ; ++j ) {
+        m_output.bytes_value(reflection->GetRepeatedStringReference(*message,&field,j,&scratch));
+      }
+      m_output.end_array();
+      return;
+    }
+  }
+  const UnknownFieldSet& unknown = reflection->GetUnknownFields(*message);
+  for( int i = 0 ; i < unknown.field_count() ; ++i ) {
+    if( unknown.field(i).number() == field.number() &&
+        unknown.field(i).type() == UnknownField::TYPE_VARINT ) {
+      m_packed.push_back(unknown.field(i).varint());
+    }
+  }
+
+  const std::size_t count = m_packed.size();
+  const uint64_t* value = m_packed.data();
+  m_output.begin_array(count);
+  switch( real.type() ) {
+    case FieldDescriptor::TYPE_INT32:
+      for( std::size_t i = 0 ; i < count ; ++i ) {
+        m_output.int_value(static_cast<int32_t>(value[i]),m_option.int32_to_string);
+      }
+      break;
+    case FieldDescriptor::TYPE_SINT32:
+      for( std::size_t i = 0 ; i < count ; ++i ) {
+        m_output.int_value(internal::WireFormatLite::ZigZagDecode32(
+              static_cast<uint32_t>(value[i])),m_option.int32_to_string);
+      }
+      break;
+    case FieldDescriptor::TYPE_UINT32:
+      for( std::size_t i = 0 ; i < count ; ++i ) {
+        m_output.uint_value(static_cast<uint32_t>(value[i]),m_option.int32_to_string);
+      }
+      break;
+    case FieldDescriptor::TYPE_INT64:
+      for( std::size_t i = 0 ; i < count ; ++i ) {
+        m_output.int_value(static_cast<int64_t>(value[i]),m_option.int64_to_string);
+      }
+      break;
+    case FieldDescriptor::TYPE_SINT64:
+      for( std::size_t i = 0 ; i < count ; ++i ) {
+        m_output.int_value(internal::WireFormatLite::ZigZagDecode64(value[i]),
+                           m_option.int64_to_string);
+      }
+      break;
+    case FieldDescriptor::TYPE_UINT64:
+      for( std::size_t i = 0 ; i < count ; ++i ) {
+        m_output.uint_value(value[i],m_option.int64_to_string);
+      }
+      break;
+    default:
+      UNREACHABLE();
+      break;
+  }
+  m_output.end_array();
+}
+
+// A packed field whose elements all came unpacked is only in the unknown
+// fields of the shadow message. It is added to the present list here , so it
+// is written as a field and not as unknown.
+void message_to_json::add_unpacked_field( const Descriptor& message_descriptor ,
+                                          const UnknownFieldSet& unknown ,
+                                          std::vector<const FieldDescriptor*>* present ) {
+  for( int i = 0 ; i < unknown.field_count() ; ++i ) {
+    if( unknown.field(i).type() != UnknownField::TYPE_VARINT ) {
+      continue;
+    }
+    const FieldDescriptor* field =
+      m_lazy->unpacked_field(&message_descriptor,unknown.field(i).number());
+    if( field != NULL && std::find(present->begin(),present->end(),field) == present->end() ) {
+      present->push_back(field);
+    }
+  }
+}
+
+void message_to_json::map_key( const Message& entry , const FieldDescriptor& key_field ,
+                               map_slot* slot ) {
+  const Reflection* reflection = entry.GetReflection();
+  const uint64_t kSignBit = static_cast<uint64_t>(1) << 63;
+  char buf[::util::kIntegerBufferSize];
+  switch( key_field.cpp_type() ) {
+    case FieldDescriptor::CPPTYPE_INT32:
+      {
+        const int32_t value = reflection->GetInt32(entry,&key_field);
+        slot->order = static_cast<uint64_t>(static_cast<int64_t>(value)) ^ kSignBit;
+        slot->key.assign(buf,::util::FormatInt32(value,buf));
+        break;
+      }
+    case FieldDescriptor::CPPTYPE_INT64:
+      {
+        const int64_t value = reflection->GetInt64(entry,&key_field);
+        slot->order = static_cast<uint64_t>(value) ^ kSignBit;
+        slot->key.assign(buf,::util::FormatInt64(value,buf));
+        break;
+      }
+    case FieldDescriptor::CPPTYPE_UINT32:
+      {
+        const uint32_t value = reflection->GetUInt32(entry,&key_field);
+        slot->order = value;
+        slot->key.assign(buf,::util::FormatUInt32(value,buf));
+        break;
+      }
+    case FieldDescriptor::CPPTYPE_UINT64:
+      {
+        const uint64_t value = reflection->GetUInt64(entry,&key_field);
+        slot->order = value;
+        slot->key.assign(buf,::util::FormatUInt64(value,buf));
+        break;
+      }
+    case FieldDescriptor::CPPTYPE_BOOL:
+      {
+        const bool value = reflection->GetBool(entry,&key_field);
+        slot->order = value ? 1 : 0;
+        slot->key.assign(value ? "true" : "false");
+        break;
+      }
+    case FieldDescriptor::CPPTYPE_STRING:
+      {
+        std::string scratch;
+        slot->order = 0;
+        slot->key.assign(reflection->GetStringReference(entry,&key_field,&scratch));
+        break;
+      }
+    default:
+      UNREACHABLE();
+      break;
+  }
+}
+
+void message_to_json::convert_map_entry( const Message& entry , const std::string& key ) {
+  const FieldDescriptor& value = *entry.GetDescriptor()->map_value();
+  m_map_key.clear();
+  m_output.encode_key(key,&m_map_key);
+  m_output.encoded_key(m_map_key);
+
+  // Entry without a value holds the default one , as the map itself does
+  convert_value(entry,value,-1);
+}
+
+// Write the value of a singular field , or of the element index of a repeated
+// one , without its key.
+void message_to_json::convert_value( const Message& message ,
+                                     const FieldDescriptor& field , int index ) {
+  const Reflection* reflection = message.GetReflection();
+
+#define GET_(Type) \
+    (index < 0 ? reflection->Get##Type(message,&field) : \
+                 reflection->GetRepeated##Type(message,&field,index))
+
+  switch( field.cpp_type() ) {
+    case FieldDescriptor::CPPTYPE_BOOL:
+      m_output.bool_value(GET_(Bool));
+      break;
+    case FieldDescriptor::CPPTYPE_FLOAT:
+      m_output.float_value(GET_(Float),m_option.float_to_string);
+      break;
+    case FieldDescriptor::CPPTYPE_DOUBLE:
+      m_output.double_value(GET_(Double),m_option.double_to_string);
+      break;
+    case FieldDescriptor::CPPTYPE_INT32:
+      m_output.int_value(GET_(Int32),m_option.int32_to_string);
+      break;
+    case FieldDescriptor::CPPTYPE_INT64:
+      m_output.int_value(GET_(Int64),m_option.int64_to_string);
+      break;
+    case FieldDescriptor::CPPTYPE_UINT32:
+      m_output.uint_value(GET_(UInt32),m_option.int32_to_string);
+      break;
+    case FieldDescriptor::CPPTYPE_UINT64:
+      m_output.uint_value(GET_(UInt64),m_option.int64_to_string);
+      break;
+    case FieldDescriptor::CPPTYPE_ENUM:
+      convert_enum_value(GET_(Enum));
+      break;
+    case FieldDescriptor::CPPTYPE_STRING:
+      {
+        std::string scratch;
+        const std::string& data = index < 0 ?
+          reflection->GetStringReference(message,&field,&scratch) :
+          reflection->GetRepeatedStringReference(message,&field,index,&scratch);
+        const Descriptor* message_type = m_lazy != NULL ? m_lazy->message_type(&field) : NULL;
+        if( message_type != NULL ) {
+          convert_lazy_message(data,*message_type);
+        } else if( field.type() == FieldDescriptor::TYPE_STRING ) {
+          m_output.string_value(data);
+        } else {
+          m_output.bytes_value(data);
+        }
+        break;
+      }
+    case FieldDescriptor::CPPTYPE_MESSAGE:
+      convert_nested_field(&GET_(Message),*(field.message_type()));
+      break;
+    default:
+      UNREACHABLE();
+      break;
+  }
+#undef GET_
+}
+
+bool message_to_json::convert_well_known( const Message* message ,
+                                          const Descriptor& message_descriptor ,
+                                          type_resolver::well_known_type type ) {
+  // Fields are taken by position , which is fixed for the well known types
+  const Reflection* reflection = message->GetReflection();
+  switch( type ) {
+    case type_resolver::WKT_TIMESTAMP:
+    case type_resolver::WKT_DURATION:
+      {
+        const int64_t seconds = reflection->GetInt64(*message,message_descriptor.field(0));
+        const int32_t nanos = reflection->GetInt32(*message,message_descriptor.field(1));
+        char buf[::util::kTimeBufferSize];
+        char* end = type == type_resolver::WKT_TIMESTAMP ?
+          ::util::FormatTimestamp(seconds,nanos,&m_date,buf) :
+          ::util::FormatDuration(seconds,nanos,buf);
+        if( end == NULL ) {
+          return false;
+        }
+        m_text.assign(buf,end);
+        m_output.string_value(m_text);
+        return true;
+      }
+    case type_resolver::WKT_WRAPPER:
+      convert_value(*message,*message_descriptor.field(0),-1);
+      return true;
+    case type_resolver::WKT_STRUCT:
+      ++m_depth;
+      convert_map_field(message,*message_descriptor.field(0));
+      --m_depth;
+      return true;
+    case type_resolver::WKT_VALUE:
+      {
+        // Kind not set is written as null , same as the null_value kind
+        const FieldDescriptor* kind = reflection->GetOneofFieldDescriptor(
+            *message,message_descriptor.oneof_decl(0));
+        if( kind == NULL || kind->cpp_type() == FieldDescriptor::CPPTYPE_ENUM ) {
+          m_output.null_value();
+        } else {
+          ++m_depth;
+          convert_value(*message,*kind,-1);
+          --m_depth;
+        }
+        return true;
+      }
+    case type_resolver::WKT_LIST_VALUE:
+      {
+        const FieldDescriptor& values = *message_descriptor.field(0);
+        const int size = reflection->FieldSize(*message,&values);
+        ++m_depth;
+        m_output.begin_array(size);
+        for( int i = 0 ; i < size ; ++i ) {
+          convert_value(*message,values,i);
+        }
+        m_output.end_array();
+        --m_depth;
+        return true;
+      }
+    default:
+      return false;
+  }
+}
+
+void message_to_json::convert_map_field( const Message* message , const FieldDescriptor& field ) {
+  // Entries are read through the key and value descriptors instead of being
+  // converted as messages , which saves listing and ordering the fields of
+  // every entry. Parsed map keeps the entries as they came on the wire , so
+  // a key repeated in merged input is there each time. Entries are sorted by
+  // key through the per depth scratch , whose key strings keep their memory
+  // from one map to the next , and a repeated key keeps the value of its
+  // last entry , as a parser into a map does. Without sort_map_keys it is
+  // written at the place of its first entry ; a map without repeats is then
+  // written straight from the repeated view.
+  const Reflection* reflection = message->GetReflection();
+  const FieldDescriptor& key_field = *(field.message_type()->map_key());
+  int size = reflection->FieldSize(*message,&field);
+
+  if( m_map_slot.size() <= static_cast<std::size_t>(m_depth) ) {
+    m_map_slot.resize(m_depth+1);
+  }
+  std::vector<map_slot>* slot = &m_map_slot[m_depth];
+  slot->resize(size);
+  for( int i = 0 ; i < size ; ++i ) {
+    map_key(reflection->GetRepeatedMessage(*message,&field,i),key_field,&(*slot)[i]);
+    (*slot)[i].index = i;
+    (*slot)[i].position = i;
+  }
+  std::sort(slot->begin(),slot->end(),map_slot_less);
+  int kept = 0;
+  for( int i = 0 ; i < size ; ++i ) {
+    if( i + 1 < size && (*slot)[i].order == (*slot)[i+1].order &&
+        (*slot)[i].key == (*slot)[i+1].key ) {
+      (*slot)[i+1].position = (*slot)[i].position;
+      continue;
+    }
+    if( kept != i ) {
+      std::swap((*slot)[kept],(*slot)[i]);
+    }
+    ++kept;
+  }
+  slot->resize(kept);
+  if( !m_option.sort_map_keys ) {
+    if( kept == size ) {
+      slot = NULL;
+    } else {
+      std::sort(slot->begin(),slot->end(),map_slot_position_less);
+    }
+  }
+  size = kept;
+
+  if( m_pool != NULL && m_pool->thread_count() > 1 && size >= kParallelThreshold ) {
+    convert_repeated_parallel(message,field,slot);
+    return;
+  }
+  m_output.begin_object(size);
+  map_slot unsorted;
+  for( int i = 0 ; i < size ; ++i ) {
+    if( slot != NULL ) {
+      const map_slot& s = (*slot)[i];
+      convert_map_entry(reflection->GetRepeatedMessage(*message,&field,s.index),s.key);
+    } else {
+      const Message& entry = reflection->GetRepeatedMessage(*message,&field,i);
+      map_key(entry,key_field,&unsorted);
+      convert_map_entry(entry,unsorted.key);
+    }
+  }
+  m_output.end_object();
+}
+
+void message_to_json::convert_field( const Message* message , const FieldDescriptor& field ) {
+  switch(field.cpp_type()) {
+    case FieldDescriptor::CPPTYPE_ENUM:
+      convert_enum_field(message,field);
+      break;
+    case FieldDescriptor::CPPTYPE_MESSAGE:
+      {
+        if( field.is_map() ) {
+          write_key(field);
+          convert_map_field(message,field);
+          break;
+        }
+        write_key(field);
+        const Reflection* reflection = message->GetReflection();
+
+        // Checking if this message is repeated or just a singular one
+        if( field.is_repeated() ) {
+          // Dump message one by one here
+          const int size = reflection->FieldSize(*message,&field);
+          if( m_pool != NULL && m_pool->thread_count() > 1 &&
+              size >= kParallelThreshold ) {
+            convert_repeated_parallel(message,field,NULL);
+            break;
+          }
+          m_output.begin_array(size);
+          for( int i = 0 ; i < size ; ++i ) {
+            convert_nested_field( &(reflection->GetRepeatedMessage(
+                    *message,&field,i)),*(field.message_type()));
+          }
+          m_output.end_array();
+        } else {
+          convert_nested_field( &(reflection->GetMessage(
+                  *message,&field)),*(field.message_type()));
+        }
+        break;
+      }
+    default:
+      convert_atomic_field(message,field);
+      break;
+  }
+}
+
+void message_to_json::convert_absent_field( const Message* message , const FieldDescriptor& field ) {
+  // Field is known to be absent , so the value is written without asking
+  // reflection. Singular submessage still dumps its default instance.
+  if( field.is_map() ) {
+    write_key(field);
+    m_output.begin_object(0);
+    m_output.end_object();
+  } else if( field.is_repeated() ) {
+    write_key(field);
+    m_output.begin_array(0);
+    m_output.end_array();
+  } else if( field.cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE ||
+             (m_lazy != NULL && m_lazy->message_type(&field) != NULL) ) {
+    convert_field(message,field);
+  } else {
+    write_key(field);
+    m_output.null_value();
+  }
+}
+
+inline bool field_index_less( const FieldDescriptor* l , const FieldDescriptor* r ) {
+  return l->index() < r->index();
+}
+
+inline bool is_declared_field( const FieldDescriptor* field ) {
+  return !field->is_extension();
+}
+
+// Unknown fields are keyed by their number , occurrences of the same number
+// are grouped into an array keeping the order they come on the wire. Return
+// the occurrences ordered that way and the number of distinct numbers. With
+// a lazy schema , the unpacked elements of packed fields of the owner type
+// are written with their field and left out here.
+std::size_t order_unknown_field( const UnknownFieldSet& unknown ,
+                                 const lazy_schema* lazy ,
+                                 const Descriptor* owner ,
+                                 std::vector< std::pair<int,int> >* order ) {
+  const int size = unknown.field_count();
+  order->clear();
+  order->reserve(size);
+  for( int i = 0 ; i < size ; ++i ) {
+    const UnknownField& field = unknown.field(i);
+    if( lazy != NULL && owner != NULL && field.type() == UnknownField::TYPE_VARINT &&
+        lazy->unpacked_field(owner,field.number()) != NULL ) {
+      continue;
+    }
+    order->push_back( std::make_pair(field.number(),i) );
+  }
+  std::sort(order->begin(),order->end());
+  std::size_t distinct = 0;
+  for( std::size_t i = 0 ; i < order->size() ; ++i ) {
+    if( i == 0 || (*order)[i].first != (*order)[i-1].first ) {
+      ++distinct;
+    }
+  }
+  return distinct;
+}
+
+void message_to_json::convert_field_list( const Message* message ,
+                                          const Descriptor& message_descriptor ,
+                                          const field_set* skip ,
+                                          bool object ,
+                                          const std::string* type_url ) {
+  // Only the present fields are visited through reflection. ListFields gives
+  // them ordered by number with extensions mixed in , here they are split and
+  // the declared ones ordered by declaration so the declared fields could be
+  // walked in one pass. The scratch vector is reused per depth.
+  if( m_present.size() <= static_cast<std::size_t>(m_depth) ) {
+    m_present.resize(m_depth+1);
+  }
+  std::vector<const FieldDescriptor*>& present = m_present[m_depth];
+  present.clear();
+  const Reflection* reflection = message->GetReflection();
+  reflection->ListFields(*message,&present);
+  if( m_lazy != NULL ) {
+    const UnknownFieldSet& unknown = reflection->GetUnknownFields(*message);
+    if( !unknown.empty() ) {
+      add_unpacked_field(message_descriptor,unknown,&present);
+    }
+  }
+
+  std::size_t declared_size = present.size();
+  for( std::size_t i = 0 ; i < present.size() ; ++i ) {
+    if( present[i]->is_extension() ) {
+      declared_size = std::stable_partition(present.begin(),present.end(),
+          is_declared_field) - present.begin();
+      break;
+    }
+  }
+  for( std::size_t i = 1 ; i < declared_size ; ++i ) {
+    if( present[i-1]->index() > present[i]->index() ) {
+      std::sort(present.begin(),present.begin()+declared_size,field_index_less);
+      break;
+    }
+  }
+
+  const UnknownFieldSet* unknown = NULL;
+  if( m_option.unknown_fields ) {
+    unknown = &(reflection->GetUnknownFields(*message));
+    if( unknown->empty() ) {
+      unknown = NULL;
+    }
+  }
+
+  if( object ) {
+    // Member count is only known here , the skip set is never used together
+    // with a new object.
+    std::size_t count = present.size();
+    if( m_option.emit_defaults ) {
+      count += message_descriptor.field_count() - declared_size;
+    }
+    if( unknown != NULL ) {
+      std::vector< std::pair<int,int> > order;
+      count += order_unknown_field(*unknown,m_lazy,&message_descriptor,&order);
+    }
+    if( type_url != NULL ) {
+      ++count;
+    }
+    m_output.begin_object(count);
+    if( type_url != NULL ) {
+      m_output.key("@type");
+      m_output.string_value(*type_url);
+    }
+  }
+
+  if( !m_option.emit_defaults ) {
+    // Compact output , the absent fields are not even visited
+    for( std::size_t i = 0 ; i < declared_size ; ++i ) {
+      if( skip != NULL && skip->count(present[i]) ) {
+        continue;
+      }
+      convert_field(message,*present[i]);
+    }
+  } else {
+    // Every declared field is written , absent ones without reflection call
+    const int size = message_descriptor.field_count();
+    std::size_t next = 0;
+    for( int i = 0 ; i < size ; ++i ) {
+      const FieldDescriptor* field = message_descriptor.field(i);
+      const bool is_present = next < declared_size && present[next] == field;
+      if( is_present ) {
+        ++next;
+      }
+      if( skip != NULL && skip->count(field) ) {
+        continue;
+      }
+      if( is_present ) {
+        convert_field(message,*field);
+      } else {
+        convert_absent_field(message,*field);
+      }
+    }
+  }
+
+  // Registered extensions found while parsing
+  for( std::size_t i = declared_size ; i < present.size() ; ++i ) {
+    if( skip != NULL && skip->count(present[i]) ) {
+      continue;
+    }
+    convert_field(message,*present[i]);
+  }
+
+  if( unknown != NULL ) {
+    convert_unknown_field_list(*unknown,&message_descriptor);
+  }
+
+  if( object ) {
+    m_output.end_object();
+  }
+}
+
+void message_to_json::convert_unknown_field( const UnknownField& field ) {
+  switch( field.type() ) {
+    case UnknownField::TYPE_VARINT:
+      m_output.uint_value(field.varint(),m_option.int64_to_string);
+      break;
+    case UnknownField::TYPE_FIXED32:
+      m_output.uint_value(field.fixed32(),m_option.int32_to_string);
+      break;
+    case UnknownField::TYPE_FIXED64:
+      m_output.uint_value(field.fixed64(),m_option.int64_to_string);
+      break;
+    case UnknownField::TYPE_LENGTH_DELIMITED:
+      m_output.bytes_value(field.length_delimited());
+      break;
+    case UnknownField::TYPE_GROUP:
+      {
+        std::vector< std::pair<int,int> > order;
+        m_output.begin_object(order_unknown_field(field.group(),NULL,NULL,&order));
+        convert_unknown_field_list(field.group(),NULL);
+        m_output.end_object();
+        break;
+      }
+    default:
+      UNREACHABLE();
+      break;
+  }
+}
+
+void message_to_json::convert_unknown_field_list( const UnknownFieldSet& unknown ,
+                                                  const Descriptor* owner ) {
+  std::vector< std::pair<int,int> > order;
+  order_unknown_field(unknown,m_lazy,owner,&order);
+
+  const int size = static_cast<int>(order.size());
+  char buf[::util::kIntegerBufferSize];
+  for( int i = 0 ; i < size ; ) {
+    int end = i + 1;
+    while( end < size && order[end].first == order[i].first ) {
+      ++end;
+    }
+    m_output.key(std::string(buf,::util::FormatInt32(order[i].first,buf)));
+    if( end - i == 1 ) {
+      convert_unknown_field(unknown.field(order[i].second));
+    } else {
+      m_output.begin_array(end - i);
+      for( int j = i ; j < end ; ++j ) {
+        convert_unknown_field(unknown.field(order[j].second));
+      }
+      m_output.end_array();
+    }
+    i = end;
+  }
+}
+
+// Map field is split the same way , each shard writes its run of key and
+// value pairs and slot , if not NULL , gives the sorted entry order.
+void message_to_json::convert_repeated_parallel( const Message* message ,
+                                                 const FieldDescriptor& field ,
+                                                 const std::vector<map_slot>* slot ) {
+  const Reflection* reflection = message->GetReflection();
+  const int size = slot != NULL ? static_cast<int>(slot->size()) :
+                                  reflection->FieldSize(*message,&field);
+
+  // Several shards per thread so stealing has something to balance with
+  // when elements are not of the same size.
+  const int shard_count_hint = static_cast<int>(m_pool->thread_count()) * 4;
+  int shard_size = (size + shard_count_hint - 1) / shard_count_hint;
+  if( shard_size < kMinShardSize ) {
+    shard_size = kMinShardSize;
+  }
+  const int shard_count = (size + shard_size - 1) / shard_size;
+
+  std::vector<std::ostringstream> buffer(shard_count);
+  std::vector< ::util::thread_pool::task > tasks;
+  tasks.reserve(shard_count);
+  for( int s = 0 ; s < shard_count ; ++s ) {
+    const int start = s * shard_size;
+    const int end = std::min(start + shard_size,size);
+    std::ostringstream* output = &buffer[s];
+    const FieldDescriptor* element = &field;
+    const option* opt = &m_option;
+    tasks.push_back( [=]() {
+      // Shard converter has no pool , nested fields stay sequential
+      proto2json::writer* w = m_output.clone(*output);
+      message_to_json conv(NULL,*w,*opt);
+      conv.m_lazy = m_lazy;
+      conv.m_keys = m_keys;
+      conv.m_types = m_types;
+      conv.m_envelope = m_envelope;
+      conv.m_depth = m_depth;
+      if( element->is_map() ) {
+        const FieldDescriptor& key_field = *(element->message_type()->map_key());
+        map_slot unsorted;
+        for( int i = start ; i < end ; ++i ) {
+          if( slot != NULL ) {
+            const map_slot& s = (*slot)[i];
+            conv.convert_map_entry(reflection->GetRepeatedMessage(*message,element,s.index),s.key);
+          } else {
+            const Message& entry = reflection->GetRepeatedMessage(*message,element,i);
+            map_key(entry,key_field,&unsorted);
+            conv.convert_map_entry(entry,unsorted.key);
+          }
+        }
+      } else {
+        for( int i = start ; i < end ; ++i ) {
+          conv.convert_nested_field( &(reflection->GetRepeatedMessage(
+                  *message,element,i)),*(element->message_type()));
+        }
+      }
+      delete w;
+    });
+  }
+  m_pool->run(&tasks);
+
+  if( field.is_map() ) {
+    m_output.begin_object(size);
+  } else {
+    m_output.begin_array(size);
+  }
+  for( int s = 0 ; s < shard_count ; ++s ) {
+    m_output.raw_value(buffer[s].str());
+  }
+  if( field.is_map() ) {
+    m_output.end_object();
+  } else {
+    m_output.end_array();
+  }
+}
+
+void message_to_json::convert() {
+  convert_nested_field(m_message,*m_message->GetDescriptor());
+}
+
+void message_to_json::convert_fields( const field_set& skip ) {
+  convert_field_list(m_message,*m_message->GetDescriptor(),&skip,false,NULL);
+}
+
+// Convert a single top level message incrementally from the wire. Elements of
+// top level repeated message fields are decoded one at a time , written out and
+// then dropped , so the memory is bounded by the largest element instead of the
+// whole message. All the other fields are merged into a residual message which
+// is written once the input is exhausted. Serializer writes elements of a
+// repeated field contiguously , so each streamed field normally forms a single
+// json array ; if the elements of a field are interleaved with other fields on
+// the wire , the field will show up more than once as a key. Top level map
+// field is streamed the same way into an object , a key repeated on the wire
+// is then written each time instead of only the last. Counts are not known
+// ahead here , so only json writer could be used.
+class stream_to_json {
+public:
+  stream_to_json( const Message* prototype ,
+                  io::ZeroCopyInputStream* input ,
+                  proto2json::writer& output ,
+                  const proto2json::option& opt ):
+    m_prototype( prototype ),
+    m_input( input ),
+    m_output( output ),
+    m_option( opt ),
+    m_open_field( NULL ),
+    m_element_cache(),
+    m_lazy( NULL ),
+    m_keys( NULL ),
+    m_types( NULL ),
+    m_envelope( NULL )
+  {}
+
+  // The prototype should be the shadow one when a lazy schema is used
+  void set_lazy_schema( const lazy_schema* lazy ) {
+    m_lazy = lazy;
+  }
+
+  void set_key_table( const key_table* keys ) {
+    m_keys = keys;
+  }
+
+  void set_type_resolver( type_resolver* types ) {
+    m_types = types;
+  }
+
+  void set_envelope( const envelope* fields ) {
+    m_envelope = fields;
+  }
+
+  ~stream_to_json() {
+    std::map<const FieldDescriptor*,Message*>::iterator itr = m_element_cache.begin();
+    for( ; itr != m_element_cache.end() ; ++itr ) {
+      delete itr->second;
+    }
+  }
+
+  bool convert();
+
+private:
+  bool is_streamed( const FieldDescriptor* field , uint32_t tag ) const {
+    if( field == NULL || !field->is_repeated() ||
+        internal::WireFormatLite::GetTagWireType(tag) !=
+          internal::WireFormatLite::WIRETYPE_LENGTH_DELIMITED ) {
+      return false;
+    }
+    if( field->is_map() ) {
+      // Map needs all of its entries to keep one per key , let the residual
+      // message write it
+      return false;
+    }
+    if( field->type() == FieldDescriptor::TYPE_MESSAGE ) {
+      return true;
+    }
+    // With max_depth 0 lazy elements are not decoded at all , let the residual
+    // message write them in raw form.
+    return m_lazy != NULL && m_lazy->message_type(field) != NULL &&
+           m_option.max_depth != 0;
+  }
+
+  bool convert_element( io::CodedInputStream* input , const FieldDescriptor* field );
+  void close_array();
+  Message* element( const FieldDescriptor* field );
+  void setup( message_to_json* conv ) const {
+    conv->set_lazy_schema(m_lazy);
+    conv->set_key_table(m_keys);
+    conv->set_type_resolver(m_types);
+    conv->set_envelope(m_envelope);
+    conv->set_base_depth(1);
+  }
+
+  const Message* m_prototype;
+  io::ZeroCopyInputStream* m_input;
+  proto2json::writer& m_output;
+  proto2json::option m_option;
+  const FieldDescriptor* m_open_field; // Field whose json array is still open
+  message_to_json::field_set m_streamed_field;
+  std::map<const FieldDescriptor*,Message*> m_element_cache;
+  const lazy_schema* m_lazy;
+  const key_table* m_keys;
+  type_resolver* m_types;
+  const envelope* m_envelope;
+
+  DISALLOW_COPY_AND_ASSIGN(stream_to_json);
+};
+
+Message* stream_to_json::element( const FieldDescriptor* field ) {
+  std::map<const FieldDescriptor*,Message*>::iterator itr = m_element_cache.find(field);
+  if( itr != m_element_cache.end() ) {
+    // Reuse the element object , clear keeps the memory it already has
+    itr->second->Clear();
+    return itr->second;
+  }
+  const Descriptor* lazy_type = m_lazy != NULL ? m_lazy->message_type(field) : NULL;
+  const Message* prototype;
+  if( lazy_type != NULL ) {
+    prototype = m_lazy->prototype(lazy_type);
+  } else {
+    prototype = m_prototype->GetReflection()->
+      GetMessageFactory()->GetPrototype(field->message_type());
+  }
+  Message* ret = prototype->New();
+  m_element_cache[field] = ret;
+  return ret;
+}
+
+void stream_to_json::close_array() {
+  if( m_open_field != NULL ) {
+    m_output.end_array();
+    m_open_field = NULL;
+  }
+}
+
+bool stream_to_json::convert_element( io::CodedInputStream* input ,
+                                      const FieldDescriptor* field ) {
+  if( m_open_field != field ) {
+    close_array();
+    const std::string* key = m_keys != NULL ? m_keys->find(field) : NULL;
+    if( key != NULL ) {
+      m_output.encoded_key(*key);
+    } else {
+      m_output.key(field->name());
+    }
+    m_output.begin_array(0);
+    m_open_field = field;
+    m_streamed_field.insert(field);
+  }
+
+  uint32_t length;
+  if( !input->ReadVarint32(&length) ) {
+    return false;
+  }
+  io::CodedInputStream::Limit limit = input->PushLimit(static_cast<int>(length));
+  Message* message = element(field);
+  if( !message->MergeFromCodedStream(input) || !input->ConsumedEntireMessage() ) {
+    return false;
+  }
+  input->PopLimit(limit);
+
+  message_to_json conv(message,m_output,m_option);
+  setup(&conv);
+  conv.convert();
+  return true;
+}
+
+bool stream_to_json::convert() {
+  const Descriptor* descriptor = m_prototype->GetDescriptor();
+  const DescriptorPool* pool = descriptor->file()->pool();
+  Message* residual = m_prototype->New();
+  bool ret = false;
+
+  m_output.begin_record();
+  m_output.begin_object(0);
+  while(true) {
+    // CodedInputStream tracks its position with an int , so a fresh one is
+    // used per top level field to not hit the 2GB limit on huge inputs. The
+    // destructor backs the unread buffer up into the underlying stream.
+    io::CodedInputStream input(m_input);
+    const uint32_t tag = input.ReadTag();
+    if( tag == 0 ) {
+      // Tag 0 is either end of stream or a corrupted input
+      ret = input.ConsumedEntireMessage();
+      break;
+    }
+    const int number = internal::WireFormatLite::GetTagFieldNumber(tag);
+    const FieldDescriptor* field = descriptor->FindFieldByNumber(number);
+    if( field == NULL ) {
+      field = pool->FindExtensionByNumber(descriptor,number);
+    }
+    if( is_streamed(field,tag) ) {
+      if( !convert_element(&input,field) ) {
+        break;
+      }
+    } else {
+      close_array();
+      if( !internal::WireFormat::ParseAndMergeField(tag,field,residual,&input) ) {
+        break;
+      }
+    }
+  }
+
+  if( ret && residual->IsInitialized() ) {
+    close_array();
+    message_to_json conv(residual,m_output,m_option);
+    setup(&conv);
+    conv.convert_fields(m_streamed_field);
+    m_output.end_object();
+  } else {
+    ret = false;
+  }
+  delete residual;
+  return ret;
+}
+
+// Collect schema errors into a string , library never prints
+class single_file_error_collector : public compiler::MultiFileErrorCollector {
+public:
+  explicit single_file_error_collector( std::string* output ):
+    m_output( output )
+  {}
+
   virtual void AddError( const std::string& filename,
       int line, int column, const std::string& error ) {
-    std::cerr<<"Schema file failed:"<<filename
+    std::ostringstream message;
+    message<<"Schema file failed:"<<filename
       <<" at("
       <<line<<","
       <<column<<") with message:"
-      <<error<<std::endl;
+      <<error<<"\n";
+    m_output->append(message.str());
   }
+
+private:
+  std::string* m_output;
 };
 
-class single_file_source_tree : public compiler::SourceTree {
+// Imported file is looked up in each directory in turn , then among the files
+// compiled into libprotobuf. A file is only opened when an import statement
+// asks for it , and its stream owns the descriptor , which is closed as soon
+// as the importer is done with the file.
+class import_source_tree : public compiler::SourceTree {
 public:
-  single_file_source_tree( const std::string& root_file ):
+  explicit import_source_tree( const std::vector<std::string>& directory ):
     compiler::SourceTree(),
-    m_path_prefix(),
-    m_stream_list() {
-      build_path_prefix(root_file);
-    }
+    m_directory( directory ),
+    m_generated()
+  {}
 
-  io::ZeroCopyInputStream* Open( const string& filename ) {
-    std::ifstream* file = new std::ifstream();
-    std::string p;
-    if( m_path_prefix.empty() ) {
-      p = filename;
-    } else {
-      p = m_path_prefix + "/" + filename;
+  io::ZeroCopyInputStream* Open( const std::string& filename ) {
+    for( std::size_t i = 0 ; i < m_directory.size() ; ++i ) {
+      const std::string path = m_directory[i].empty() ?
+        filename : m_directory[i] + "/" + filename;
+      const int fd = open(path.c_str(),O_RDONLY);
+      if( fd >= 0 ) {
+        io::FileInputStream* file = new io::FileInputStream(fd);
+        file->SetCloseOnDelete(true);
+        return file;
+      }
     }
-    file->open( p.c_str() , std::ios_base::in );
-    if( !file ) {
-      delete file;
+    return open_generated(filename);
+  }
+
+private:
+  // Files compiled into libprotobuf , like google/protobuf/any.proto , are
+  // served from the generated pool when they are not found on disk.
+  io::ZeroCopyInputStream* open_generated( const std::string& filename ) {
+    const FileDescriptor* file =
+      DescriptorPool::generated_pool()->FindFileByName(filename);
+    if( file == NULL ) {
       return NULL;
-    } else {
-      m_stream_list.push_back(file);
-      return new io::IstreamInputStream(file);
     }
+    m_generated.push_back(file->DebugString());
+    const std::string& content = m_generated.back();
+    return new io::ArrayInputStream(content.data(),static_cast<int>(content.size()));
   }
 
-  ~single_file_source_tree() {
-    for( std::size_t i = 0 ; i < m_stream_list.size() ; ++i ) {
-      delete m_stream_list[i];
+  std::vector<std::string> m_directory;
+  std::deque<std::string> m_generated;
+};
+
+// Split a schema file path into its directory , empty for the current one ,
+// and its name.
+void split_path( const std::string& path , std::string* directory , std::string* filename ) {
+  const std::size_t slash = path.find_last_of("/");
+  if( slash == std::string::npos ) {
+    directory->clear();
+    filename->assign(path);
+  } else {
+    directory->assign(path.substr(0,slash));
+    filename->assign(path.substr(slash+1));
+  }
+}
+
+// Stream buffer appending to a string owned by the caller. Output is staged
+// in a small array , so writers do not pay a virtual call per character ; the
+// array is moved into the string on sync.
+class string_buffer : public std::streambuf {
+public:
+  string_buffer():
+    m_target( NULL )
+  {
+    setp(m_buffer,m_buffer+kBufferSize);
+  }
+
+  // Pending output goes to the previous target first
+  void reset( std::string* target ) {
+    sync();
+    m_target = target;
+  }
+
+protected:
+  virtual int sync() {
+    if( m_target != NULL ) {
+      m_target->append(pbase(),pptr()-pbase());
+    }
+    setp(m_buffer,m_buffer+kBufferSize);
+    return 0;
+  }
+
+  virtual int_type overflow( int_type c ) {
+    sync();
+    if( !traits_type::eq_int_type(c,traits_type::eof()) ) {
+      *pptr() = traits_type::to_char_type(c);
+      pbump(1);
+    }
+    return traits_type::not_eof(c);
+  }
+
+  virtual std::streamsize xsputn( const char* data , std::streamsize size ) {
+    if( size > epptr() - pptr() ) {
+      sync();
+      if( size >= kBufferSize ) {
+        if( m_target != NULL ) {
+          m_target->append(data,size);
+        }
+        return size;
+      }
     }
+    memcpy(pptr(),data,size);
+    pbump(static_cast<int>(size));
+    return size;
   }
 
 private:
-  void build_path_prefix( const std::string& root_file );
-  std::string m_path_prefix;
-  std::vector<std::ifstream*> m_stream_list;
+  static const int kBufferSize = 4096;
+  char m_buffer[kBufferSize];
+  std::string* m_target;
+
+  DISALLOW_COPY_AND_ASSIGN(string_buffer);
+};
+
+// Well known types are imported along with every schema , they could be the
+// record type or the payload of an Any without the schema importing them.
+const char* kWellKnownFile[] = {
+  "google/protobuf/any.proto",
+  "google/protobuf/duration.proto",
+  "google/protobuf/empty.proto",
+  "google/protobuf/field_mask.proto",
+  "google/protobuf/struct.proto",
+  "google/protobuf/timestamp.proto",
+  "google/protobuf/wrappers.proto",
+  NULL
 };
 
+} // namespace
+
+namespace proto2json {
 
-void single_file_source_tree::build_path_prefix( const std::string& root_file ) {
-  std::size_t npos = root_file.find_last_of("/");
-  if( npos != std::string::npos ) {
-    m_path_prefix = root_file.substr(0,npos);
+struct schema::impl {
+  explicit impl( const std::vector<std::string>& directory ):
+    source_tree( directory ),
+    errors(),
+    error_collector( &errors ),
+    importer( &source_tree , &error_collector ),
+    factory( NULL ),
+    lazy( NULL ),
+    types( NULL ),
+    files()
+  {}
+
+  ~impl() {
+    delete types;
+    delete lazy;
+    delete factory;
+  }
+
+  bool import( const std::string& filename , bool lazy_load , std::string* error );
+
+  import_source_tree source_tree;
+  std::string errors;
+  single_file_error_collector error_collector;
+  compiler::Importer importer;
+  DynamicMessageFactory* factory;
+  lazy_schema* lazy; // NULL unless loaded lazy
+  type_resolver* types;
+  std::vector<const FileDescriptor*> files; // Imported files , real ones
+};
+
+// Import the schema file with what it imports , and the well known types
+bool schema::impl::import( const std::string& filename , bool lazy_load , std::string* error ) {
+  const FileDescriptor* file = importer.Import(filename);
+  if( file == NULL ) {
+    error->assign(errors.empty() ? "Cannot import schema file:" + filename : errors);
+    return false;
+  }
+  files.push_back(file);
+  for( const char** name = kWellKnownFile ; *name != NULL ; ++name ) {
+    if( DescriptorPool::generated_pool()->FindFileByName(*name) == NULL ) {
+      continue;
+    }
+    file = importer.Import(*name);
+    if( file != NULL ) {
+      files.push_back(file);
+    }
   }
+
+  const DescriptorPool* pool = importer.pool();
+  factory = new DynamicMessageFactory(pool);
+  if( lazy_load ) {
+    lazy = new lazy_schema();
+    for( std::size_t i = 0 ; i < files.size() ; ++i ) {
+      if( !lazy->init(files[i]) ) {
+        error->assign("Cannot build lazy schema for schema file:" + filename);
+        return false;
+      }
+    }
+  }
+  types = new type_resolver(pool,factory,lazy);
+  return true;
 }
 
+schema::schema():
+  m_impl( NULL ),
+  m_import_path()
+{}
 
-void get_filename( const std::string& fn_with_path , std::string* filename ) {
-  std::size_t ipos = fn_with_path.find_last_of("/");
-  if( ipos == std::string::npos ) {
-    filename->assign(fn_with_path);
-  } else {
-    filename->assign(fn_with_path.substr(ipos+1,fn_with_path.size()-ipos-1));
+schema::~schema() {
+  delete m_impl;
+}
+
+void schema::add_import_path( const std::string& directory ) {
+  std::string path(directory);
+  while( path.size() > 1 && path[path.size()-1] == '/' ) {
+    path.erase(path.size()-1);
   }
+  m_import_path.push_back(path);
 }
-} // namespace
 
+bool schema::load( const std::string& proto_path , bool lazy , std::string* error ) {
+  // Imports are resolved against the directory of the schema file first. A
+  // schema file under an import path is named relative to it , as the files
+  // importing it name it , so it is not loaded twice under two names.
+  std::string directory;
+  std::string filename;
+  split_path(proto_path,&directory,&filename);
+  std::vector<std::string> search(1,directory);
+  bool relative = false;
+  for( std::size_t i = 0 ; i < m_import_path.size() ; ++i ) {
+    const std::string prefix = m_import_path[i] + "/";
+    if( !relative && proto_path.compare(0,prefix.size(),prefix) == 0 ) {
+      filename = proto_path.substr(prefix.size());
+      relative = true;
+    }
+    search.push_back(m_import_path[i]);
+  }
 
-int main( int argc, char* argv[] ) {
-  command_option opt;
-  if( !parse_command(argc,argv,&opt) )
-    return -1;
+  delete m_impl;
+  m_impl = new impl(search);
+  return m_impl->import(filename,lazy,error);
+}
 
-  single_file_source_tree source_tree( opt.proto_path );
-  single_file_error_collector err_coll;
+bool schema::load_message( const std::string& message , bool lazy , std::string* error ) {
+  schema_registry registry;
+  for( std::size_t i = 0 ; i < m_import_path.size() ; ++i ) {
+    if( !registry.add_root(m_import_path[i],error) ) {
+      return false;
+    }
+  }
   std::string filename;
-  get_filename(opt.proto_path,&filename);
+  std::string root;
+  if( !registry.find(message,&filename,&root) ) {
+    char buf[::util::kIntegerBufferSize];
+    error->assign("Cannot find message type in the import paths:" + message + " , " +
+        std::string(buf,::util::FormatUInt64(registry.file_count(),buf)) +
+        " schema files scanned");
+    return false;
+  }
+  delete m_impl;
+  m_impl = new impl(m_import_path);
+  return m_impl->import(filename,lazy,error);
+}
+
+const Descriptor* schema::find( const std::string& message ) const {
+  return m_impl == NULL ? NULL : m_impl->importer.pool()->FindMessageTypeByName(message);
+}
 
-  // Now read in the proto schema file
-  compiler::Importer importer( &source_tree , &err_coll );
+const Message* schema::prototype( const Descriptor* descriptor ) const {
+  return m_impl == NULL ? NULL : m_impl->factory->GetPrototype(descriptor);
+}
 
-  if( importer.Import(filename) == NULL ) {
-    return -1;
+struct converter::impl {
+  impl( const schema::impl& s , writer::format f , const option& opt ):
+    loaded( s ),
+    config( opt ),
+    buffer(),
+    stream( &buffer ),
+    output( writer::create(f,stream) ),
+    keys( *output ),
+    message( NULL ),
+    fields(),
+    memo( NULL ),
+    conv( NULL , *output , config )
+  {
+    fields.type = NULL;
+    fields.payload = NULL;
   }
-  const DescriptorPool* pool = importer.pool();
 
-  // Get the descriptor we need
-  const Descriptor* desp = pool->FindMessageTypeByName(opt.message);
-  if( desp == NULL ) {
-    std::cerr<<"Cannot find message type in schema file:"
-      <<opt.message<<std::endl;
-    return -1;
+  ~impl() {
+    delete message;
+    delete memo;
+    delete output;
   }
 
-  DynamicMessageFactory factory(pool);
-  const Message* message = factory.GetPrototype(desp);
-  if( message == NULL ) {
-    std::cerr<<"Cannot get default message for message name:"
-      <<opt.message<<std::endl;
-    return -1;
+  const schema::impl& loaded;
+  option config;
+  string_buffer buffer;
+  std::ostream stream;
+  writer* output;
+  key_table keys;
+  Message* message; // Reused for every record
+  envelope fields;
+  memo_cache* memo; // Created by init when asked for and lazy
+  message_to_json conv;
+};
+
+converter::converter( const schema& s , writer::format f , const option& opt ):
+  m_impl( new impl(*s.m_impl,f,opt) )
+{}
+
+converter::~converter() {
+  delete m_impl;
+}
+
+bool converter::init( const std::string& message , std::string* error ) {
+  const schema::impl& loaded = m_impl->loaded;
+  const Descriptor* descriptor = loaded.importer.pool()->FindMessageTypeByName(message);
+  if( descriptor == NULL ) {
+    error->assign("Cannot find message type in schema file:" + message);
+    return false;
   }
+  const Message* prototype;
+  if( loaded.lazy != NULL ) {
+    prototype = loaded.lazy->prototype(loaded.lazy->shadow(descriptor));
+  } else {
+    prototype = loaded.factory->GetPrototype(descriptor);
+  }
+  if( prototype == NULL ) {
+    error->assign("Cannot get default message for message name:" + message);
+    return false;
+  }
+  delete m_impl->message;
+  m_impl->message = prototype->New();
 
-  // Now readin the data stream
-  std::string data = read_from_stdin();
-  Message* mutable_message = message->New();
+  for( std::size_t i = 0 ; i < loaded.files.size() ; ++i ) {
+    if( loaded.lazy != NULL ) {
+      m_impl->keys.add(loaded.lazy->shadow(loaded.files[i]),loaded.lazy);
+    } else {
+      m_impl->keys.add(loaded.files[i],NULL);
+    }
+  }
 
-  if( !mutable_message->ParseFromString(data) ) {
-    std::cerr<<"Cannot parse the input stream!";
-    return -1;
+  const option& config = m_impl->config;
+  if( !config.type_field.empty() || !config.payload_field.empty() ) {
+    const Descriptor* record = prototype->GetDescriptor();
+    const FieldDescriptor* type_field = record->FindFieldByName(config.type_field);
+    const FieldDescriptor* payload_field = record->FindFieldByName(config.payload_field);
+    if( type_field == NULL || type_field->is_repeated() ||
+        type_field->type() != FieldDescriptor::TYPE_STRING ||
+        payload_field == NULL || payload_field->is_repeated() ||
+        payload_field->type() != FieldDescriptor::TYPE_BYTES ) {
+      error->assign("Envelope needs a singular string type field and a singular bytes payload field:" + message);
+      return false;
+    }
+    m_impl->fields.type = type_field;
+    m_impl->fields.payload = payload_field;
+    m_impl->conv.set_envelope(&m_impl->fields);
   }
 
-  message_to_json conv(mutable_message,std::cout,opt.option);
-  conv.convert();
+  m_impl->conv.set_lazy_schema(loaded.lazy);
+  m_impl->conv.set_key_table(&m_impl->keys);
+  m_impl->conv.set_type_resolver(loaded.types);
+  if( loaded.lazy != NULL && m_impl->config.memo_size > 0 && m_impl->memo == NULL ) {
+    m_impl->memo = new memo_cache(m_impl->config.memo_size);
+    m_impl->conv.set_memo_cache(m_impl->memo);
+  }
+  return true;
+}
 
-  std::cout.flush();
-  return 0;
+void converter::set_thread_pool( ::util::thread_pool* pool ) {
+  m_impl->conv.set_thread_pool(pool);
 }
+
+#ifdef PROTO2JSON_INSTRUMENT
+namespace {
+// Type a record is reported under , the payload type named by an envelope.
+// The reference is read in place , so looking it up does not allocate.
+const std::string& record_type( const Message& message , const envelope& fields ,
+                                std::string* scratch ) {
+  if( fields.type != NULL ) {
+    const std::string& type =
+      message.GetReflection()->GetStringReference(message,fields.type,scratch);
+    if( !type.empty() ) {
+      return type;
+    }
+  }
+  return message.GetDescriptor()->full_name();
+}
+} // namespace
+#endif // PROTO2JSON_INSTRUMENT
+
+bool converter::convert( const void* data , std::size_t size , std::string* output ) {
+  INSTRUMENT_BEGIN(parse);
+  if( size > static_cast<std::size_t>(INT_MAX) ||
+      !m_impl->message->ParseFromArray(data,static_cast<int>(size)) ) {
+    return false;
+  }
+#ifdef PROTO2JSON_INSTRUMENT
+  std::string scratch;
+  const std::string& type = record_type(*m_impl->message,m_impl->fields,&scratch);
+#endif // PROTO2JSON_INSTRUMENT
+  INSTRUMENT_END(type,STAGE_PARSE,parse);
+  INSTRUMENT_BEGIN(conversion);
+  m_impl->buffer.reset(output);
+  m_impl->output->begin_record();
+  m_impl->conv.set_message(m_impl->message);
+  m_impl->conv.convert();
+  m_impl->buffer.reset(NULL);
+  INSTRUMENT_END(type,STAGE_CONVERT,conversion);
+  return true;
+}
+
+bool converter::convert_stream( io::ZeroCopyInputStream* input , std::ostream& output ) {
+  if( m_impl->output->type() != writer::FORMAT_JSON ) {
+    return false;
+  }
+  writer* json = m_impl->output->clone(output);
+  stream_to_json conv(m_impl->message,input,*json,m_impl->config);
+  conv.set_lazy_schema(m_impl->loaded.lazy);
+  conv.set_key_table(&m_impl->keys);
+  conv.set_type_resolver(m_impl->loaded.types);
+  if( m_impl->fields.payload != NULL ) {
+    conv.set_envelope(&m_impl->fields);
+  }
+  const bool ret = conv.convert();
+  delete json;
+  return ret;
+}
+
+} // namespace proto2json
@@ -0,0 +1,183 @@
+#ifndef _PROTO2JSON_H_
+#define _PROTO2JSON_H_
+#include <cstddef>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+#include <google/protobuf/io/zero_copy_stream.h>
+
+#include "writer.h"
+
+namespace util {
+class thread_pool;
+} // namespace util
+
+// =====================================================================
+// Library interface
+// A schema is loaded once and then only read , so a single instance is
+// shared by every thread. Each thread keeps its own converter and reuses
+// it for all the records it converts : the converter holds the parsed
+// message , the encoded field keys and the output scratch between calls
+// and appends the output to a buffer owned by the caller.
+// The proto2json command line tool is a thin client of this interface.
+// =====================================================================
+
+namespace proto2json {
+
+// Option for the conversion
+struct option {
+    bool double_to_string;
+    bool float_to_string;
+
+    // Not allow real number to be output as number digits
+    // but force them as string literal there.
+    void set_real_to_string() {
+        double_to_string = true;
+        float_to_string = true;
+    }
+
+    // For enum type, not only display the name of enum value but
+    // also display the index of this enum value
+    bool display_enum_index;
+
+    // Submessage nested deeper than max_depth is not decoded but written as
+    // its raw bytes in base64 , or as "<truncated>" if truncate_marker is set.
+    // Negative value means no limit. Only honored with a lazy schema.
+    int max_depth;
+    bool truncate_marker;
+
+    // Write fields which are not in the schema , keyed by their number. The
+    // value is rendered based on wire type : varint and fixed as integer ,
+    // length delimited as base64 and group as object.
+    bool unknown_fields;
+
+    // By default only the fields present in the message are written. With
+    // emit_defaults every declared field is written , an absent one as null ,
+    // an empty array or the default instance of its message type.
+    bool emit_defaults;
+
+    // Map field is written as an object keyed by the map key , as proto3
+    // json mapping does. Its entries come in wire order unless sort_map_keys
+    // is set , then integer keys are ordered by value , string keys by their
+    // bytes , and a key repeated on the wire is written once with its last
+    // value.
+    bool sort_map_keys;
+
+    // Whether integer values are written as quoted string literal. By default
+    // every integer is quoted.
+    bool int32_to_string;
+    bool int64_to_string;
+
+    // Protocol buffer version3 json mapping : 64 bits integer are quoted since
+    // they may not fit into a javascript number , 32 bits ones are not.
+    void set_proto3_integer() {
+        int32_to_string = false;
+        int64_to_string = true;
+    }
+
+    // Record is an envelope : the string field type_field names the message
+    // type of the bytes field payload_field , which is written decoded. Both
+    // empty means no envelope.
+    std::string type_field;
+    std::string payload_field;
+
+    // Bytes of rendered submessages each converter keeps , least recently
+    // used first out , to write a submessage whose bytes were already seen
+    // without decoding it again. Pays off when records carry the same large
+    // submessage , a device descriptor or a config blob , over and over.
+    // 0 means no cache. Only honored with a lazy schema.
+    std::size_t memo_size;
+
+    option():
+        double_to_string( false ),
+        float_to_string( false ),
+        display_enum_index( false ),
+        max_depth( -1 ),
+        truncate_marker( false ),
+        unknown_fields( false ),
+        emit_defaults( false ),
+        sort_map_keys( false ),
+        int32_to_string( true ),
+        int64_to_string( true ),
+        type_field(),
+        payload_field(),
+        memo_size( 0 )
+    {}
+};
+
+class schema {
+public:
+    schema();
+    ~schema();
+
+    // Directory searched for imported files , after the one of the schema
+    // file. Call it before loading , once per directory , in search order.
+    void add_import_path( const std::string& directory );
+
+    // Import the schema file , the files it imports and the well known types
+    // compiled into libprotobuf. With lazy , records are parsed against a
+    // shadow schema : submessages are only decoded when they are written and
+    // packed integer fields are decoded in bulk from their raw payload.
+    // Return false and describe the problem in error on failure.
+    bool load( const std::string& proto_path , bool lazy , std::string* error );
+
+    // Find the file declaring the message type among the .proto files under
+    // the import paths , then load it as load() does. Files are only token
+    // scanned to find it , just that file and what it imports are parsed.
+    bool load_message( const std::string& message , bool lazy , std::string* error );
+
+    // Message type by its full name , NULL if unknown
+    const google::protobuf::Descriptor* find( const std::string& message ) const;
+
+    // Default instance of a message type , never the lazy shadow one
+    const google::protobuf::Message* prototype(
+            const google::protobuf::Descriptor* descriptor ) const;
+
+private:
+    friend class converter;
+    struct impl;
+    impl* m_impl;
+    std::vector<std::string> m_import_path;
+
+    void operator=( const schema& );
+    schema( const schema& );
+};
+
+class converter {
+public:
+    // The schema must be loaded and outlive the converter
+    converter( const schema& s , writer::format f , const option& opt );
+    ~converter();
+
+    // Prepare for records of the message type , return false and describe
+    // the problem in error if the type or the envelope fields are unusable.
+    bool init( const std::string& message , std::string* error );
+
+    // Huge repeated message fields are converted in parallel shards by the
+    // pool , which is not owned and could be shared by converters.
+    void set_thread_pool( ::util::thread_pool* pool );
+
+    // Parse one serialized record and append its output to the buffer.
+    // Return false , leaving the buffer untouched , if it does not parse.
+    bool convert( const void* data , std::size_t size , std::string* output );
+
+    // Convert a single record read from input with the elements of its top
+    // level repeated message fields decoded one at a time , so the memory
+    // is bounded by the largest element. Json output only.
+    bool convert_stream( google::protobuf::io::ZeroCopyInputStream* input ,
+                         std::ostream& output );
+
+private:
+    struct impl;
+    impl* m_impl;
+
+    void operator=( const converter& );
+    converter( const converter& );
+};
+
+} // namespace proto2json
+
+#endif // _PROTO2JSON_H_
@@ -0,0 +1,974 @@
+#include "record_diff.h"
+#include <cstring>
+#include <algorithm>
+
+#include "itoa.h"
+
+namespace proto2json {
+using namespace google::protobuf;
+
+namespace {
+
+// Same bound on nesting as the protobuf parser
+static const int kMaxDepth = 100;
+
+// Decode a varint at p , never reading at or past end. Return NULL if it is
+// truncated or longer than 10 bytes.
+inline const char* get_varint( const char* p , const char* end , uint64_t* value ) {
+    uint64_t v = 0;
+    for( int shift = 0 ; shift < 64 && p < end ; shift += 7 ) {
+        const uint8_t b = static_cast<uint8_t>(*p++);
+        v |= static_cast<uint64_t>(b & 0x7f) << shift;
+        if( b < 0x80 ) {
+            *value = v;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+inline uint64_t get_fixed( const char* p , int size ) {
+    const unsigned char* b = reinterpret_cast<const unsigned char*>(p);
+    uint64_t v = 0;
+    for( int i = size - 1 ; i >= 0 ; --i ) {
+        v = (v << 8) | b[i];
+    }
+    return v;
+}
+
+inline std::size_t varint_size( uint64_t v ) {
+    std::size_t size = 1;
+    for( ; v >= 0x80 ; v >>= 7 ) {
+        ++size;
+    }
+    return size;
+}
+
+// Skip the value of a field with the wire type , return NULL if it runs past
+// end. Group is skipped up to its matching end tag.
+const char* skip_value( const char* p , const char* end , uint32_t wire_type ,
+                        uint64_t number , int depth ) {
+    uint64_t v;
+    switch( wire_type ) {
+        case 0:
+            return get_varint(p,end,&v);
+        case 1:
+            return end - p < 8 ? NULL : p + 8;
+        case 2:
+            p = get_varint(p,end,&v);
+            return p == NULL || static_cast<uint64_t>(end - p) < v ? NULL : p + v;
+        case 3:
+            if( depth > kMaxDepth ) {
+                return NULL;
+            }
+            while( p != NULL && p < end ) {
+                uint64_t tag;
+                p = get_varint(p,end,&tag);
+                if( p == NULL ) {
+                    return NULL;
+                }
+                if( (tag & 7) == 4 ) {
+                    return (tag >> 3) == number ? p : NULL;
+                }
+                p = skip_value(p,end,static_cast<uint32_t>(tag & 7),tag >> 3,depth + 1);
+            }
+            return NULL;
+        case 5:
+            return end - p < 4 ? NULL : p + 4;
+        default:
+            return NULL;
+    }
+}
+
+// Wire type a value of the field is written with , packed runs aside
+uint32_t wire_type( const FieldDescriptor* field ) {
+    switch( field->type() ) {
+        case FieldDescriptor::TYPE_DOUBLE:
+        case FieldDescriptor::TYPE_FIXED64:
+        case FieldDescriptor::TYPE_SFIXED64:
+            return 1;
+        case FieldDescriptor::TYPE_FLOAT:
+        case FieldDescriptor::TYPE_FIXED32:
+        case FieldDescriptor::TYPE_SFIXED32:
+            return 5;
+        case FieldDescriptor::TYPE_STRING:
+        case FieldDescriptor::TYPE_BYTES:
+        case FieldDescriptor::TYPE_MESSAGE:
+            return 2;
+        case FieldDescriptor::TYPE_GROUP:
+            return 3;
+        default:
+            return 0;
+    }
+}
+
+// Integer out of the raw varint or fixed bits , as the field type reads it
+int64_t signed_value( const FieldDescriptor* field , uint64_t raw ) {
+    switch( field->type() ) {
+        case FieldDescriptor::TYPE_INT32:
+        case FieldDescriptor::TYPE_SFIXED32:
+        case FieldDescriptor::TYPE_ENUM:
+            return static_cast<int32_t>(raw);
+        case FieldDescriptor::TYPE_SINT32:
+            return static_cast<int32_t>(static_cast<uint32_t>(raw) >> 1) ^
+                   -static_cast<int32_t>(raw & 1);
+        case FieldDescriptor::TYPE_SINT64:
+            return static_cast<int64_t>(raw >> 1) ^ -static_cast<int64_t>(raw & 1);
+        default:
+            return static_cast<int64_t>(raw);
+    }
+}
+
+// The converter writes a well known type in its own json form , which the
+// fields do not map onto , so it is compared as a whole
+inline bool is_atomic( const Descriptor* type ) {
+    return type->file()->name().compare(0,16,"google/protobuf/") == 0;
+}
+
+inline bool same( const char* a , std::size_t a_size , const char* b , std::size_t b_size ) {
+    return a_size == b_size && (a_size == 0 || std::memcmp(a,b,a_size) == 0);
+}
+
+}// namespace
+
+record_diff::record_diff( const schema& s , const option& opt ):
+    m_schema( s ),
+    m_option( opt ),
+    m_descriptor( NULL ),
+    m_converter(),
+    m_stream(),
+    m_writer( writer::create(writer::FORMAT_JSON,m_stream) ),
+    m_path(),
+    m_patch( NULL ),
+    m_patch_begin( 0 ),
+    m_depth( 0 )
+{}
+
+record_diff::~record_diff() {
+    for( std::map<const Descriptor*,converter*>::iterator itr = m_converter.begin() ;
+         itr != m_converter.end() ; ++itr ) {
+        delete itr->second;
+    }
+    delete m_writer;
+}
+
+bool record_diff::init( const std::string& message , std::string* error ) {
+    m_descriptor = m_schema.find(message);
+    if( m_descriptor == NULL ) {
+        error->assign("Cannot find message type in schema file:" + message);
+        return false;
+    }
+    return true;
+}
+
+bool record_diff::diff( const char* a , std::size_t a_size , const char* b , std::size_t b_size ,
+                        std::string* patch ) {
+    m_patch = patch;
+    m_patch_begin = patch->size();
+    m_path.clear();
+    m_depth = 0;
+    bool ok = true;
+    if( a == NULL && b != NULL ) {
+        std::string json;
+        ok = render_message(m_descriptor,b,b_size,&json);
+        if( ok ) {
+            write_op("add",&json);
+        }
+    } else if( a != NULL && b == NULL ) {
+        write_op("remove",NULL);
+    } else if( a != NULL ) {
+        ok = diff_message(m_descriptor,a,a_size,b,b_size);
+    }
+    if( !ok ) {
+        patch->resize(m_patch_begin);
+        return false;
+    }
+    if( patch->size() > m_patch_begin ) {
+        patch->push_back(']');
+    }
+    return true;
+}
+
+bool record_diff::parse( const char* data , std::size_t size , field_table* table ) const {
+    const char* p = data;
+    const char* end = data + size;
+    while( p < end ) {
+        uint64_t tag;
+        p = get_varint(p,end,&tag);
+        const uint64_t number = tag >> 3;
+        if( p == NULL || number == 0 || number > static_cast<uint64_t>(FieldDescriptor::kMaxNumber) ) {
+            return false;
+        }
+        const uint32_t type = static_cast<uint32_t>(tag & 7);
+        const char* next = skip_value(p,end,type,number,m_depth);
+        if( next == NULL ) {
+            return false;
+        }
+        value v;
+        v.wire_type = type;
+        if( type == 2 ) {
+            uint64_t length = 0;
+            v.data = get_varint(p,end,&length);
+            v.size = static_cast<std::size_t>(length);
+        } else if( type == 3 ) {
+            v.data = p;
+            v.size = (next - p) - varint_size((number << 3) | 4);
+        } else {
+            v.data = p;
+            v.size = next - p;
+        }
+        (*table)[static_cast<uint32_t>(number)].push_back(v);
+        p = next;
+    }
+    return true;
+}
+
+// Value of a singular field as a parser sees it : the last one wins , and
+// submessages merge , which on the wire is the concatenation of their bytes.
+// Values of another wire type are unknown fields to a parser. Return false
+// if the field is absent.
+bool record_diff::singular( const FieldDescriptor* field , const std::vector<value>* occurrence ,
+                            value* v , std::string* merged ) const {
+    if( occurrence == NULL ) {
+        return false;
+    }
+    const uint32_t expected = wire_type(field);
+    const bool message = field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE;
+    int count = 0;
+    for( std::size_t i = 0 ; i < occurrence->size() ; ++i ) {
+        const value& o = (*occurrence)[i];
+        if( o.wire_type != expected ) {
+            continue;
+        }
+        if( message && count == 1 ) {
+            merged->assign(v->data,v->size);
+        }
+        if( message && count >= 1 ) {
+            merged->append(o.data,o.size);
+        }
+        *v = o;
+        ++count;
+    }
+    if( message && count > 1 ) {
+        v->data = merged->data();
+        v->size = merged->size();
+    }
+    return count > 0;
+}
+
+// Elements of a repeated field , with packed runs split into their values
+bool record_diff::elements( const FieldDescriptor* field , const std::vector<value>* occurrence ,
+                            std::vector<value>* element ) const {
+    if( occurrence == NULL ) {
+        return true;
+    }
+    const uint32_t expected = wire_type(field);
+    for( std::size_t i = 0 ; i < occurrence->size() ; ++i ) {
+        const value& o = (*occurrence)[i];
+        if( o.wire_type == expected ) {
+            element->push_back(o);
+        } else if( o.wire_type == 2 && field->is_packable() ) {
+            const char* p = o.data;
+            const char* end = o.data + o.size;
+            value v;
+            v.wire_type = expected;
+            if( expected == 0 ) {
+                while( p < end ) {
+                    uint64_t raw;
+                    const char* next = get_varint(p,end,&raw);
+                    if( next == NULL ) {
+                        return false;
+                    }
+                    v.data = p;
+                    v.size = next - p;
+                    element->push_back(v);
+                    p = next;
+                }
+            } else {
+                v.size = expected == 1 ? 8 : 4;
+                if( o.size % v.size != 0 ) {
+                    return false;
+                }
+                for( ; p < end ; p += v.size ) {
+                    v.data = p;
+                    element->push_back(v);
+                }
+            }
+        }
+    }
+    return true;
+}
+
+// Entries of a map field by key , a key repeated on the wire keeps the place
+// of its first entry and the value of its last one
+bool record_diff::map_entries( const FieldDescriptor* field , const std::vector<value>* occurrence ,
+                               std::vector<map_entry>* entry ) const {
+    std::vector<value> element;
+    if( !elements(field,occurrence,&element) ) {
+        return false;
+    }
+    const FieldDescriptor* key_field = field->message_type()->map_key();
+    const FieldDescriptor* value_field = field->message_type()->map_value();
+    std::map<std::string,std::size_t> position;
+    field_table table;
+    std::string merged;
+    for( std::size_t i = 0 ; i < element.size() ; ++i ) {
+        table.clear();
+        if( !parse(element[i].data,element[i].size,&table) ) {
+            return false;
+        }
+        map_entry e;
+        e.v.data = NULL;
+        e.v.size = 0;
+        e.v.wire_type = 0;
+        value key;
+        field_table::const_iterator itr = table.find(1);
+        const bool has_key = singular(key_field,itr == table.end() ? NULL : &itr->second,
+                                      &key,&merged);
+        map_key(key_field,has_key ? &key : NULL,&e.key);
+        // A value repeated inside of one entry is not merged , only the last
+        // one is compared
+        itr = table.find(2);
+        e.has_value = false;
+        if( itr != table.end() ) {
+            const uint32_t expected = wire_type(value_field);
+            for( std::size_t j = 0 ; j < itr->second.size() ; ++j ) {
+                if( itr->second[j].wire_type == expected ) {
+                    e.v = itr->second[j];
+                    e.has_value = true;
+                }
+            }
+        }
+        std::map<std::string,std::size_t>::iterator slot = position.find(e.key);
+        if( slot == position.end() ) {
+            position[e.key] = entry->size();
+            entry->push_back(e);
+        } else {
+            (*entry)[slot->second] = e;
+        }
+    }
+    return true;
+}
+
+bool record_diff::diff_message( const Descriptor* type , const char* a , std::size_t a_size ,
+                                const char* b , std::size_t b_size ) {
+    if( same(a,a_size,b,b_size) ) {
+        return true;
+    }
+    if( is_atomic(type) ) {
+        std::string json;
+        if( !render_message(type,b,b_size,&json) ) {
+            return false;
+        }
+        write_op("replace",&json);
+        return true;
+    }
+    if( ++m_depth > kMaxDepth ) {
+        return false;
+    }
+    field_table ta;
+    field_table tb;
+    if( !parse(a,a_size,&ta) || !parse(b,b_size,&tb) ) {
+        return false;
+    }
+    // Both tables are walked in field number order at once
+    field_table::const_iterator ia = ta.begin();
+    field_table::const_iterator ib = tb.begin();
+    const DescriptorPool* pool = type->file()->pool();
+    while( ia != ta.end() || ib != tb.end() ) {
+        uint32_t number;
+        if( ib == tb.end() || (ia != ta.end() && ia->first < ib->first) ) {
+            number = ia->first;
+        } else {
+            number = ib->first;
+        }
+        const std::vector<value>* va = NULL;
+        const std::vector<value>* vb = NULL;
+        if( ia != ta.end() && ia->first == number ) {
+            va = &ia->second;
+            ++ia;
+        }
+        if( ib != tb.end() && ib->first == number ) {
+            vb = &ib->second;
+            ++ib;
+        }
+        const FieldDescriptor* field = type->FindFieldByNumber(static_cast<int>(number));
+        if( field == NULL ) {
+            field = pool->FindExtensionByNumber(type,static_cast<int>(number));
+        }
+        if( field != NULL ) {
+            const std::size_t mark = m_path.size();
+            push_path(field->is_extension() ? "[" + field->full_name() + "]" : field->name());
+            const bool ok = diff_field(field,va,vb);
+            m_path.resize(mark);
+            if( !ok ) {
+                return false;
+            }
+        }
+        if( m_option.unknown_fields ) {
+            std::vector<value> sa;
+            std::vector<value> sb;
+            strays(field,va,&sa);
+            strays(field,vb,&sb);
+            if( !diff_unknown(number,sa,sb) ) {
+                return false;
+            }
+        }
+    }
+    --m_depth;
+    return true;
+}
+
+bool record_diff::diff_field( const FieldDescriptor* field , const std::vector<value>* a ,
+                              const std::vector<value>* b ) {
+    if( field->is_map() ) {
+        return diff_map(field,a,b);
+    }
+    if( field->is_repeated() ) {
+        return diff_repeated(field,a,b);
+    }
+    value va;
+    value vb;
+    std::string merged_a;
+    std::string merged_b;
+    bool has_a = singular(field,a,&va,&merged_a);
+    bool has_b = singular(field,b,&vb,&merged_b);
+    if( !field->has_presence() ) {
+        // Parser keeps a default value found on the wire , but reflection
+        // does not list it , so the converter leaves it out
+        has_a = has_a && !is_zero(va);
+        has_b = has_b && !is_zero(vb);
+    }
+    if( has_a != has_b && emits_absent(field) ) {
+        // Converter writes the absent field too , a submessage as its
+        // default instance , which is what empty bytes decode to
+        if( field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE ) {
+            value empty;
+            empty.data = "";
+            empty.size = 0;
+            empty.wire_type = wire_type(field);
+            return diff_value(field,has_a ? &va : &empty,has_b ? &vb : &empty);
+        }
+        std::string json;
+        if( has_b ) {
+            render(field,&vb,&json);
+        } else {
+            json.assign("null");
+        }
+        write_op("replace",&json);
+        return true;
+    }
+    return diff_value(field,has_a ? &va : NULL,has_b ? &vb : NULL);
+}
+
+// Compare two values of the field at the current path , or two elements of
+// it , NULL when absent
+bool record_diff::diff_value( const FieldDescriptor* field , const value* a , const value* b ) {
+    std::string json;
+    if( a == NULL && b == NULL ) {
+        return true;
+    } else if( b == NULL ) {
+        write_op("remove",NULL);
+        return true;
+    } else if( a == NULL ) {
+        if( !render(field,b,&json) ) {
+            return false;
+        }
+        write_op("add",&json);
+        return true;
+    }
+    if( field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE ) {
+        return diff_message(field->message_type(),a->data,a->size,b->data,b->size);
+    }
+    if( same(a->data,a->size,b->data,b->size) ) {
+        return true;
+    }
+    render(field,b,&json);
+    write_op("replace",&json);
+    return true;
+}
+
+// Occurrences a parser keeps as unknown fields : all of them without a
+// field , else the ones of a wire type the field does not take
+void record_diff::strays( const FieldDescriptor* field , const std::vector<value>* occurrence ,
+                          std::vector<value>* stray ) const {
+    if( occurrence == NULL ) {
+        return;
+    }
+    if( field == NULL ) {
+        stray->assign(occurrence->begin(),occurrence->end());
+        return;
+    }
+    const uint32_t expected = wire_type(field);
+    for( std::size_t i = 0 ; i < occurrence->size() ; ++i ) {
+        const value& o = (*occurrence)[i];
+        if( o.wire_type != expected && !(o.wire_type == 2 && field->is_packable()) ) {
+            stray->push_back(o);
+        }
+    }
+}
+
+bool record_diff::diff_unknown( uint32_t number , const std::vector<value>& a ,
+                                const std::vector<value>& b ) {
+    if( a.size() == b.size() ) {
+        std::size_t i = 0;
+        while( i < a.size() && a[i].wire_type == b[i].wire_type &&
+               same(a[i].data,a[i].size,b[i].data,b[i].size) ) {
+            ++i;
+        }
+        if( i == a.size() ) {
+            return true;
+        }
+    }
+    const std::size_t mark = m_path.size();
+    char buf[::util::kIntegerBufferSize];
+    push_path(std::string(buf,::util::FormatUInt32(number,buf)));
+    bool ok = true;
+    if( b.empty() ) {
+        write_op("remove",NULL);
+    } else {
+        std::string json;
+        ok = render_unknown(b,&json);
+        if( ok ) {
+            write_op(a.empty() ? "add" : "replace",&json);
+        }
+    }
+    m_path.resize(mark);
+    return ok;
+}
+
+// Whether a scalar value holds the default of its type , all bits zero as
+// reflection tests it
+bool record_diff::is_zero( const value& v ) {
+    if( v.wire_type == 0 ) {
+        uint64_t raw = 1;
+        get_varint(v.data,v.data + v.size,&raw);
+        return raw == 0;
+    }
+    if( v.wire_type == 2 ) {
+        return v.size == 0;
+    }
+    for( std::size_t i = 0 ; i < v.size ; ++i ) {
+        if( v.data[i] != 0 ) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool record_diff::diff_repeated( const FieldDescriptor* field , const std::vector<value>* a ,
+                                 const std::vector<value>* b ) {
+    std::vector<value> ea;
+    std::vector<value> eb;
+    if( !elements(field,a,&ea) || !elements(field,b,&eb) ) {
+        return false;
+    }
+    std::string json;
+    if( ea.empty() != eb.empty() ) {
+        // Converter leaves an empty repeated field out , unless it writes
+        // absent fields , so the array comes or goes as a whole
+        json.push_back('[');
+        for( std::size_t i = 0 ; i < eb.size() ; ++i ) {
+            if( i > 0 ) {
+                json.push_back(',');
+            }
+            if( !render(field,&eb[i],&json) ) {
+                return false;
+            }
+        }
+        json.push_back(']');
+        write_whole(field,eb.empty(),json);
+        return true;
+    }
+    const std::size_t common = std::min(ea.size(),eb.size());
+    const std::size_t mark = m_path.size();
+    char index[::util::kIntegerBufferSize];
+    for( std::size_t i = 0 ; i < eb.size() ; ++i ) {
+        if( i < common && same(ea[i].data,ea[i].size,eb[i].data,eb[i].size) ) {
+            continue;
+        }
+        push_path(std::string(index,::util::FormatUInt64(i,index)));
+        const bool ok = diff_value(field,i < common ? &ea[i] : NULL,&eb[i]);
+        m_path.resize(mark);
+        if( !ok ) {
+            return false;
+        }
+    }
+    // From the last one down , so every index is still valid when applied
+    for( std::size_t i = ea.size() ; i > common ; --i ) {
+        push_path(std::string(index,::util::FormatUInt64(i - 1,index)));
+        write_op("remove",NULL);
+        m_path.resize(mark);
+    }
+    return true;
+}
+
+bool record_diff::diff_map( const FieldDescriptor* field , const std::vector<value>* a ,
+                            const std::vector<value>* b ) {
+    std::vector<map_entry> ea;
+    std::vector<map_entry> eb;
+    if( !map_entries(field,a,&ea) || !map_entries(field,b,&eb) ) {
+        return false;
+    }
+    const FieldDescriptor* value_field = field->message_type()->map_value();
+    const bool message = value_field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE;
+    std::string json;
+    if( ea.empty() != eb.empty() ) {
+        // Same as a repeated field , written in the entry order of the
+        // converter without sort_map_keys
+        json.push_back('{');
+        for( std::size_t i = 0 ; i < eb.size() ; ++i ) {
+            if( i > 0 ) {
+                json.push_back(',');
+            }
+            quote(eb[i].key,&json);
+            json.push_back(':');
+            if( !render(value_field,eb[i].has_value ? &eb[i].v : NULL,&json) ) {
+                return false;
+            }
+        }
+        json.push_back('}');
+        write_whole(field,eb.empty(),json);
+        return true;
+    }
+    std::map<std::string,const map_entry*> in_a;
+    std::map<std::string,const map_entry*> in_b;
+    for( std::size_t i = 0 ; i < ea.size() ; ++i ) {
+        in_a[ea[i].key] = &ea[i];
+    }
+    for( std::size_t i = 0 ; i < eb.size() ; ++i ) {
+        in_b[eb[i].key] = &eb[i];
+    }
+
+    const std::size_t mark = m_path.size();
+    bool ok = true;
+    for( std::size_t i = 0 ; i < ea.size() && ok ; ++i ) {
+        const map_entry& x = ea[i];
+        std::map<std::string,const map_entry*>::const_iterator itr = in_b.find(x.key);
+        if( itr == in_b.end() ) {
+            push_path(x.key);
+            write_op("remove",NULL);
+            m_path.resize(mark);
+            continue;
+        }
+        const map_entry& y = *itr->second;
+        // An absent value and an empty one both read as the default
+        const std::size_t x_size = x.has_value ? x.v.size : 0;
+        const std::size_t y_size = y.has_value ? y.v.size : 0;
+        if( x.has_value == y.has_value && same(x.v.data,x_size,y.v.data,y_size) ) {
+            continue;
+        }
+        push_path(x.key);
+        if( message ) {
+            ok = diff_message(value_field->message_type(),x.v.data,x_size,y.v.data,y_size);
+        } else {
+            json.clear();
+            ok = render(value_field,y.has_value ? &y.v : NULL,&json);
+            if( ok ) {
+                write_op("replace",&json);
+            }
+        }
+        m_path.resize(mark);
+    }
+    for( std::size_t i = 0 ; i < eb.size() && ok ; ++i ) {
+        const map_entry& y = eb[i];
+        if( in_a.find(y.key) != in_a.end() ) {
+            continue;
+        }
+        push_path(y.key);
+        json.clear();
+        ok = render(value_field,y.has_value ? &y.v : NULL,&json);
+        if( ok ) {
+            write_op("add",&json);
+        }
+        m_path.resize(mark);
+    }
+    return ok;
+}
+
+void record_diff::write_op( const char* op , const std::string* json ) {
+    m_patch->push_back(m_patch->size() == m_patch_begin ? '[' : ',');
+    m_patch->append("{\"op\":\"").append(op).append("\",\"path\":");
+    quote(m_path,m_patch);
+    if( json != NULL ) {
+        m_patch->append(",\"value\":").append(*json);
+    }
+    m_patch->push_back('}');
+}
+
+// Repeated or map field emptied , or filled from empty , json being its new
+// value. Emptied one is written as empty when absent fields are written.
+void record_diff::write_whole( const FieldDescriptor* field , bool emptied ,
+                               const std::string& json ) {
+    if( emits_absent(field) ) {
+        write_op("replace",&json);
+    } else if( emptied ) {
+        write_op("remove",NULL);
+    } else {
+        write_op("add",&json);
+    }
+}
+
+// Json string of the text
+void record_diff::quote( const std::string& text , std::string* output ) {
+    m_stream.str(std::string());
+    m_writer->begin_record();
+    m_writer->string_value(text);
+    output->append(m_stream.str());
+}
+
+// Json pointer token , with ~ and / escaped
+void record_diff::push_path( const std::string& token ) {
+    m_path.push_back('/');
+    for( std::size_t i = 0 ; i < token.size() ; ++i ) {
+        if( token[i] == '~' ) {
+            m_path.append("~0");
+        } else if( token[i] == '/' ) {
+            m_path.append("~1");
+        } else {
+            m_path.push_back(token[i]);
+        }
+    }
+}
+
+bool record_diff::render( const FieldDescriptor* field , const value* v , std::string* output ) {
+    if( field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE ) {
+        return render_message(field->message_type(),v == NULL ? "" : v->data,
+                              v == NULL ? 0 : v->size,output);
+    }
+    m_stream.str(std::string());
+    m_writer->begin_record();
+    if( v == NULL ) {
+        render_default(field);
+    } else {
+        render_scalar(field,*v);
+    }
+    output->append(m_stream.str());
+    return true;
+}
+
+// Submessage goes through a converter of its type , so it is written exactly
+// as in the converted records
+bool record_diff::render_message( const Descriptor* type , const char* data , std::size_t size ,
+                                  std::string* output ) {
+    converter*& conv = m_converter[type];
+    if( conv == NULL ) {
+        conv = new converter(m_schema,writer::FORMAT_JSON,m_option);
+        std::string error;
+        if( !conv->init(type->full_name(),&error) ) {
+            delete conv;
+            conv = NULL;
+            return false;
+        }
+    }
+    return conv->convert(data,size,output);
+}
+
+void record_diff::render_scalar( const FieldDescriptor* field , const value& v ) {
+    uint64_t raw = 0;
+    if( v.wire_type == 0 ) {
+        get_varint(v.data,v.data + v.size,&raw);
+    } else if( v.wire_type == 1 || v.wire_type == 5 ) {
+        raw = get_fixed(v.data,static_cast<int>(v.size));
+    }
+    switch( field->type() ) {
+        case FieldDescriptor::TYPE_DOUBLE:
+            {
+                double d;
+                std::memcpy(&d,&raw,sizeof(d));
+                m_writer->double_value(d,m_option.double_to_string);
+                break;
+            }
+        case FieldDescriptor::TYPE_FLOAT:
+            {
+                const uint32_t bits = static_cast<uint32_t>(raw);
+                float f;
+                std::memcpy(&f,&bits,sizeof(f));
+                m_writer->float_value(f,m_option.float_to_string);
+                break;
+            }
+        case FieldDescriptor::TYPE_INT32:
+        case FieldDescriptor::TYPE_SINT32:
+        case FieldDescriptor::TYPE_SFIXED32:
+            m_writer->int_value(signed_value(field,raw),m_option.int32_to_string);
+            break;
+        case FieldDescriptor::TYPE_INT64:
+        case FieldDescriptor::TYPE_SINT64:
+        case FieldDescriptor::TYPE_SFIXED64:
+            m_writer->int_value(signed_value(field,raw),m_option.int64_to_string);
+            break;
+        case FieldDescriptor::TYPE_UINT32:
+        case FieldDescriptor::TYPE_FIXED32:
+            m_writer->uint_value(static_cast<uint32_t>(raw),m_option.int32_to_string);
+            break;
+        case FieldDescriptor::TYPE_UINT64:
+        case FieldDescriptor::TYPE_FIXED64:
+            m_writer->uint_value(raw,m_option.int64_to_string);
+            break;
+        case FieldDescriptor::TYPE_BOOL:
+            m_writer->bool_value(raw != 0);
+            break;
+        case FieldDescriptor::TYPE_ENUM:
+            render_enum(field->enum_type(),static_cast<int>(signed_value(field,raw)));
+            break;
+        case FieldDescriptor::TYPE_STRING:
+            m_writer->string_value(std::string(v.data,v.size));
+            break;
+        case FieldDescriptor::TYPE_BYTES:
+            m_writer->bytes_value(std::string(v.data,v.size));
+            break;
+        default:
+            m_writer->null_value();
+            break;
+    }
+}
+
+bool record_diff::render_unknown( const std::vector<value>& occurrence , std::string* output ) {
+    m_stream.str(std::string());
+    m_writer->begin_record();
+    if( !write_unknown(occurrence) ) {
+        return false;
+    }
+    output->append(m_stream.str());
+    return true;
+}
+
+bool record_diff::write_unknown( const std::vector<value>& occurrence ) {
+    if( occurrence.size() > 1 ) {
+        m_writer->begin_array(occurrence.size());
+    }
+    for( std::size_t i = 0 ; i < occurrence.size() ; ++i ) {
+        const value& v = occurrence[i];
+        uint64_t raw = 0;
+        switch( v.wire_type ) {
+            case 0:
+                get_varint(v.data,v.data + v.size,&raw);
+                m_writer->uint_value(raw,m_option.int64_to_string);
+                break;
+            case 1:
+                m_writer->uint_value(get_fixed(v.data,8),m_option.int64_to_string);
+                break;
+            case 5:
+                m_writer->uint_value(get_fixed(v.data,4),m_option.int32_to_string);
+                break;
+            case 2:
+                m_writer->bytes_value(std::string(v.data,v.size));
+                break;
+            default:
+                {
+                    // Group body , every field of it is unknown
+                    field_table table;
+                    if( !parse(v.data,v.size,&table) ) {
+                        return false;
+                    }
+                    char buf[::util::kIntegerBufferSize];
+                    m_writer->begin_object(table.size());
+                    for( field_table::const_iterator itr = table.begin() ; itr != table.end() ; ++itr ) {
+                        m_writer->key(std::string(buf,::util::FormatUInt32(itr->first,buf)));
+                        if( !write_unknown(itr->second) ) {
+                            return false;
+                        }
+                    }
+                    m_writer->end_object();
+                    break;
+                }
+        }
+    }
+    if( occurrence.size() > 1 ) {
+        m_writer->end_array();
+    }
+    return true;
+}
+
+void record_diff::render_default( const FieldDescriptor* field ) {
+    switch( field->cpp_type() ) {
+        case FieldDescriptor::CPPTYPE_DOUBLE:
+            m_writer->double_value(field->default_value_double(),m_option.double_to_string);
+            break;
+        case FieldDescriptor::CPPTYPE_FLOAT:
+            m_writer->float_value(field->default_value_float(),m_option.float_to_string);
+            break;
+        case FieldDescriptor::CPPTYPE_INT32:
+            m_writer->int_value(field->default_value_int32(),m_option.int32_to_string);
+            break;
+        case FieldDescriptor::CPPTYPE_INT64:
+            m_writer->int_value(field->default_value_int64(),m_option.int64_to_string);
+            break;
+        case FieldDescriptor::CPPTYPE_UINT32:
+            m_writer->uint_value(field->default_value_uint32(),m_option.int32_to_string);
+            break;
+        case FieldDescriptor::CPPTYPE_UINT64:
+            m_writer->uint_value(field->default_value_uint64(),m_option.int64_to_string);
+            break;
+        case FieldDescriptor::CPPTYPE_BOOL:
+            m_writer->bool_value(field->default_value_bool());
+            break;
+        case FieldDescriptor::CPPTYPE_ENUM:
+            render_enum(field->enum_type(),field->default_value_enum()->number());
+            break;
+        case FieldDescriptor::CPPTYPE_STRING:
+            if( field->type() == FieldDescriptor::TYPE_BYTES ) {
+                m_writer->bytes_value(field->default_value_string());
+            } else {
+                m_writer->string_value(field->default_value_string());
+            }
+            break;
+        default:
+            m_writer->null_value();
+            break;
+    }
+}
+
+// Same as the converter writes an enum , a number not in the schema as is
+void record_diff::render_enum( const EnumDescriptor* type , int number ) {
+    const EnumValueDescriptor* v = type->FindValueByNumber(number);
+    if( v == NULL ) {
+        m_writer->int_value(number,false);
+    } else if( m_option.display_enum_index ) {
+        m_writer->begin_object(2);
+        m_writer->key("value");
+        m_writer->string_value(v->name());
+        m_writer->key("index");
+        m_writer->int_value(v->index(),false);
+        m_writer->end_object();
+    } else {
+        m_writer->string_value(v->name());
+    }
+}
+
+// Map key as the converter writes it , the default one when v is NULL
+void record_diff::map_key( const FieldDescriptor* field , const value* v ,
+                           std::string* key ) const {
+    if( field->type() == FieldDescriptor::TYPE_STRING ) {
+        if( v == NULL ) {
+            key->clear();
+        } else {
+            key->assign(v->data,v->size);
+        }
+        return;
+    }
+    uint64_t raw = 0;
+    if( v != NULL && v->wire_type == 0 ) {
+        get_varint(v->data,v->data + v->size,&raw);
+    } else if( v != NULL ) {
+        raw = get_fixed(v->data,static_cast<int>(v->size));
+    }
+    char buf[::util::kIntegerBufferSize];
+    switch( field->cpp_type() ) {
+        case FieldDescriptor::CPPTYPE_BOOL:
+            key->assign(raw != 0 ? "true" : "false");
+            break;
+        case FieldDescriptor::CPPTYPE_INT32:
+        case FieldDescriptor::CPPTYPE_INT64:
+            key->assign(buf,::util::FormatInt64(signed_value(field,raw),buf));
+            break;
+        case FieldDescriptor::CPPTYPE_UINT32:
+            key->assign(buf,::util::FormatUInt64(static_cast<uint32_t>(raw),buf));
+            break;
+        default:
+            key->assign(buf,::util::FormatUInt64(raw,buf));
+            break;
+    }
+}
+
+}// namespace proto2json
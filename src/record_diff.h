@@ -0,0 +1,140 @@
+#ifndef _RECORD_DIFF_H_
+#define _RECORD_DIFF_H_
+#include <cstddef>
+#include <stdint.h>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <google/protobuf/descriptor.h>
+
+#include "proto2json.h"
+#include "writer.h"
+
+// =====================================================================
+// Record diff
+// Two serialized records of the same type are compared field by field
+// on the wire , guided by the descriptor , without building messages :
+// where the bytes of two values are equal , the whole subtree is equal
+// and is skipped after one memcmp. Only what differs is decoded , and
+// written as a json patch (RFC 6902) turning the first record into the
+// second one , with the paths and values of the json the converter
+// writes for them :
+//   singular field   add , remove or replace ; a submessage is walked
+//                    into , a well known type is replaced as a whole
+//   repeated field   elements compared by index , then the extra ones
+//                    added , or removed from the last one down
+//   map field        entries compared by key
+// Serializers write a message in a canonical way , so equal content
+// means equal bytes in practice ; content equal in another field order
+// still compares equal , only slower. A proto3 scalar at its default is
+// absent , as the converter leaves it out. Fields unknown to a parser ,
+// not in the schema or of a wire type the field does not take , are only
+// compared with unknown_fields , which writes them : by their bytes , and
+// replaced as a whole under their number.
+// Each thread keeps its own instance , the schema is shared.
+// =====================================================================
+
+namespace proto2json {
+
+class record_diff {
+public:
+    // The schema must be loaded and outlive the instance
+    record_diff( const schema& s , const option& opt );
+    ~record_diff();
+
+    // Prepare for records of the message type , return false and describe
+    // the problem in error if it is unknown.
+    bool init( const std::string& message , std::string* error );
+
+    // Append the patch turning record a into record b to patch , as a json
+    // array , or nothing when they do not differ. A NULL record stands for
+    // a missing one , which is added or removed as a whole. Return false ,
+    // leaving patch untouched , if either record does not parse.
+    bool diff( const char* a , std::size_t a_size , const char* b , std::size_t b_size ,
+               std::string* patch );
+
+private:
+    // A value on the wire : the payload of a length delimited value or
+    // the body of a group , else the bytes of the varint or fixed value
+    struct value {
+        const char* data;
+        std::size_t size;
+        uint32_t wire_type;
+    };
+    // Values of each field number of a message , in wire order
+    typedef std::map<uint32_t,std::vector<value> > field_table;
+    // Entry of a map field , an absent value stands for the default one
+    struct map_entry {
+        std::string key;
+        value v;
+        bool has_value;
+    };
+
+    bool parse( const char* data , std::size_t size , field_table* table ) const;
+    bool singular( const google::protobuf::FieldDescriptor* field ,
+                   const std::vector<value>* occurrence , value* v , std::string* merged ) const;
+    bool elements( const google::protobuf::FieldDescriptor* field ,
+                   const std::vector<value>* occurrence , std::vector<value>* element ) const;
+    bool map_entries( const google::protobuf::FieldDescriptor* field ,
+                      const std::vector<value>* occurrence , std::vector<map_entry>* entry ) const;
+    bool diff_message( const google::protobuf::Descriptor* type ,
+                       const char* a , std::size_t a_size , const char* b , std::size_t b_size );
+    bool diff_field( const google::protobuf::FieldDescriptor* field ,
+                     const std::vector<value>* a , const std::vector<value>* b );
+    bool diff_repeated( const google::protobuf::FieldDescriptor* field ,
+                        const std::vector<value>* a , const std::vector<value>* b );
+    bool diff_map( const google::protobuf::FieldDescriptor* field ,
+                   const std::vector<value>* a , const std::vector<value>* b );
+    bool diff_value( const google::protobuf::FieldDescriptor* field ,
+                     const value* a , const value* b );
+    void strays( const google::protobuf::FieldDescriptor* field ,
+                 const std::vector<value>* occurrence , std::vector<value>* stray ) const;
+    bool diff_unknown( uint32_t number , const std::vector<value>& a ,
+                       const std::vector<value>& b );
+    static bool is_zero( const value& v );
+
+    // Append one operation at the current path , with its json value unless
+    // NULL
+    void write_op( const char* op , const std::string* json );
+    void write_whole( const google::protobuf::FieldDescriptor* field , bool emptied ,
+                      const std::string& json );
+    void quote( const std::string& text , std::string* output );
+    // Whether the converter writes the field when it is absent
+    bool emits_absent( const google::protobuf::FieldDescriptor* field ) const {
+        return m_option.emit_defaults && !field->is_extension();
+    }
+    // Json of a value of the field , its default one when v is NULL
+    bool render( const google::protobuf::FieldDescriptor* field , const value* v ,
+                 std::string* output );
+    bool render_message( const google::protobuf::Descriptor* type ,
+                         const char* data , std::size_t size , std::string* output );
+    void render_scalar( const google::protobuf::FieldDescriptor* field , const value& v );
+    void render_default( const google::protobuf::FieldDescriptor* field );
+    void render_enum( const google::protobuf::EnumDescriptor* type , int number );
+    // Unknown field as the converter writes it , one value or an array of
+    // the occurrences
+    bool render_unknown( const std::vector<value>& occurrence , std::string* output );
+    bool write_unknown( const std::vector<value>& occurrence );
+    void map_key( const google::protobuf::FieldDescriptor* field , const value* v ,
+                  std::string* key ) const;
+    void push_path( const std::string& token );
+
+    const schema& m_schema;
+    option m_option;
+    const google::protobuf::Descriptor* m_descriptor;
+    std::map<const google::protobuf::Descriptor*,converter*> m_converter;
+    std::ostringstream m_stream;    // Output of m_writer , for scalar values
+    writer* m_writer;
+    std::string m_path;             // Json pointer of the value compared
+    std::string* m_patch;
+    std::size_t m_patch_begin;      // Size of the patch before this diff
+    int m_depth;                    // Messages walked into , bounded as a parser does
+
+    void operator=( const record_diff& );
+    record_diff( const record_diff& );
+};
+
+}// namespace proto2json
+#endif // _RECORD_DIFF_H_
@@ -0,0 +1,542 @@
+#include "record_index.h"
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "itoa.h"
+
+namespace proto2json {
+using namespace google::protobuf;
+
+namespace {
+
+static const char kMagic[4] = { 'P','2','J','I' };
+static const uint32_t kVersion = 1;
+static const std::size_t kHeaderSize = 32;
+
+// Offsets are handed to the output stream in chunks of this size
+static const std::size_t kFlushSize = 1024 * 1024;
+
+inline void put_u32( std::string* buf , uint32_t v ) {
+    char b[4] = { static_cast<char>(v) , static_cast<char>(v>>8) ,
+                  static_cast<char>(v>>16) , static_cast<char>(v>>24) };
+    buf->append(b,4);
+}
+
+inline void put_u64( std::string* buf , uint64_t v ) {
+    put_u32(buf,static_cast<uint32_t>(v));
+    put_u32(buf,static_cast<uint32_t>(v>>32));
+}
+
+inline uint64_t get_u64( const char* p ) {
+    const unsigned char* b = reinterpret_cast<const unsigned char*>(p);
+    uint64_t v = 0;
+    for( int i = 7 ; i >= 0 ; --i ) {
+        v = (v << 8) | b[i];
+    }
+    return v;
+}
+
+inline uint32_t get_u32( const char* p ) {
+    const unsigned char* b = reinterpret_cast<const unsigned char*>(p);
+    return static_cast<uint32_t>(b[0]) | (static_cast<uint32_t>(b[1])<<8) |
+           (static_cast<uint32_t>(b[2])<<16) | (static_cast<uint32_t>(b[3])<<24);
+}
+
+// Decode a varint at p , never reading at or past end. Return NULL if it is
+// truncated or longer than 10 bytes.
+inline const char* get_varint( const char* p , const char* end , uint64_t* value ) {
+    uint64_t v = 0;
+    for( int shift = 0 ; shift < 64 && p < end ; shift += 7 ) {
+        const uint8_t b = static_cast<uint8_t>(*p++);
+        v |= static_cast<uint64_t>(b & 0x7f) << shift;
+        if( b < 0x80 ) {
+            *value = v;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+// Skip the value of a field with the wire type , return NULL if it runs past
+// end. Group is skipped up to its matching end tag.
+const char* skip_value( const char* p , const char* end , uint32_t wire_type ,
+                        uint64_t number ) {
+    uint64_t v;
+    switch( wire_type ) {
+        case 0:
+            return get_varint(p,end,&v);
+        case 1:
+            return end - p < 8 ? NULL : p + 8;
+        case 2:
+            p = get_varint(p,end,&v);
+            return p == NULL || static_cast<uint64_t>(end - p) < v ? NULL : p + v;
+        case 3:
+            while( p != NULL && p < end ) {
+                uint64_t tag;
+                p = get_varint(p,end,&tag);
+                if( p == NULL ) {
+                    return NULL;
+                }
+                if( (tag & 7) == 4 ) {
+                    return (tag >> 3) == number ? p : NULL;
+                }
+                p = skip_value(p,end,static_cast<uint32_t>(tag & 7),tag >> 3);
+            }
+            return NULL;
+        case 5:
+            return end - p < 4 ? NULL : p + 4;
+        default:
+            return NULL;
+    }
+}
+
+// Wire type the key field is encoded with
+uint32_t key_wire_type( const FieldDescriptor* field ) {
+    switch( field->type() ) {
+        case FieldDescriptor::TYPE_FIXED64:
+        case FieldDescriptor::TYPE_SFIXED64:
+            return 1;
+        case FieldDescriptor::TYPE_STRING:
+        case FieldDescriptor::TYPE_BYTES:
+            return 2;
+        case FieldDescriptor::TYPE_FIXED32:
+        case FieldDescriptor::TYPE_SFIXED32:
+            return 5;
+        default:
+            return 0;
+    }
+}
+
+// Render the raw value of the key field as the index keeps it
+void key_text( const FieldDescriptor* field , uint64_t raw , std::string* output ) {
+    char buf[::util::kIntegerBufferSize];
+    char* end;
+    switch( field->type() ) {
+        case FieldDescriptor::TYPE_INT32:
+        case FieldDescriptor::TYPE_INT64:
+        case FieldDescriptor::TYPE_ENUM:
+            end = ::util::FormatInt64(static_cast<int64_t>(raw),buf);
+            break;
+        case FieldDescriptor::TYPE_SINT32:
+        case FieldDescriptor::TYPE_SINT64:
+            end = ::util::FormatInt64(
+                    static_cast<int64_t>(raw >> 1) ^ -static_cast<int64_t>(raw & 1),buf);
+            break;
+        case FieldDescriptor::TYPE_SFIXED32:
+            end = ::util::FormatInt32(static_cast<int32_t>(raw),buf);
+            break;
+        case FieldDescriptor::TYPE_SFIXED64:
+            end = ::util::FormatInt64(static_cast<int64_t>(raw),buf);
+            break;
+        default:
+            end = ::util::FormatUInt64(raw,buf);
+            break;
+    }
+    output->assign(buf,end);
+}
+
+// Find the field at path[depth] among the fields of a message , going down
+// into it while it is not the last one of the path. The last occurrence
+// wins as it does for a parser , which merges a submessage occurring twice.
+// A field without presence missing from a well formed message is found with
+// its default value. Return whether the key was found ; broken record just
+// has no key.
+bool find_key( const char* p , const char* end , const FieldDescriptor* const* path ,
+               std::size_t depth , std::size_t length , std::string* key ) {
+    const FieldDescriptor* field = path[depth];
+    const bool leaf = depth + 1 == length;
+    const uint32_t wire_type = leaf ? key_wire_type(field) : 2;
+    const uint64_t number = static_cast<uint64_t>(field->number());
+    bool found = false;
+    while( p < end ) {
+        uint64_t tag;
+        p = get_varint(p,end,&tag);
+        if( p == NULL ) {
+            return found;
+        }
+        const uint32_t type = static_cast<uint32_t>(tag & 7);
+        if( (tag >> 3) == number && type == wire_type ) {
+            uint64_t v = 0;
+            const char* next;
+            switch( type ) {
+                case 0:
+                    next = get_varint(p,end,&v);
+                    if( next != NULL ) key_text(field,v,key);
+                    break;
+                case 1:
+                    next = skip_value(p,end,type,number);
+                    if( next != NULL ) key_text(field,get_u64(p),key);
+                    break;
+                case 5:
+                    next = skip_value(p,end,type,number);
+                    if( next != NULL ) key_text(field,get_u32(p),key);
+                    break;
+                default:
+                    next = skip_value(p,end,type,number);
+                    if( next != NULL ) {
+                        const char* data = get_varint(p,end,&v);
+                        if( leaf ) {
+                            key->assign(data,v);
+                        } else if( find_key(data,data + v,path,depth + 1,length,key) ) {
+                            found = true;
+                        }
+                    }
+                    break;
+            }
+            found = found || (leaf && next != NULL);
+            p = next;
+        } else {
+            p = skip_value(p,end,type,tag >> 3);
+        }
+        if( p == NULL ) {
+            return found;
+        }
+    }
+    if( !found && leaf && !field->has_presence() ) {
+        // Implicit presence : the default value is never written , so an
+        // absent field holds it
+        if( field->cpp_type() == FieldDescriptor::CPPTYPE_STRING ) {
+            key->clear();
+        } else {
+            key_text(field,0,key);
+        }
+        found = true;
+    }
+    return found;
+}
+
+// Find the key field among the top level fields of a record
+void extract_key( const char* p , const char* end , const FieldDescriptor* field ,
+                  std::string* key ) {
+    key->clear();
+    find_key(p,end,&field,0,1,key);
+}
+
+// Orders record numbers by their key , then by number
+class key_less {
+public:
+    key_less( const std::vector<uint64_t>& offset , const std::string& data ):
+        m_offset( offset ),
+        m_data( data )
+    {}
+
+    bool operator()( uint64_t l , uint64_t r ) const {
+        const std::size_t lsize = m_offset[l+1] - m_offset[l];
+        const std::size_t rsize = m_offset[r+1] - m_offset[r];
+        const int c = std::memcmp(m_data.data() + m_offset[l],
+                                  m_data.data() + m_offset[r],
+                                  std::min(lsize,rsize));
+        if( c != 0 ) return c < 0;
+        if( lsize != rsize ) return lsize < rsize;
+        return l < r;
+    }
+
+private:
+    const std::vector<uint64_t>& m_offset;
+    const std::string& m_data;
+};
+
+}// namespace
+
+mapped_file::mapped_file():
+    m_data( NULL ),
+    m_size( 0 )
+{}
+
+mapped_file::~mapped_file() {
+    if( m_data != NULL && m_size != 0 ) {
+        munmap(const_cast<char*>(m_data),m_size);
+    }
+}
+
+bool mapped_file::open( const std::string& path ) {
+    const int fd = ::open(path.c_str(),O_RDONLY);
+    if( fd < 0 ) {
+        return false;
+    }
+    struct stat info;
+    if( fstat(fd,&info) != 0 ) {
+        close(fd);
+        return false;
+    }
+    m_size = static_cast<std::size_t>(info.st_size);
+    if( m_size == 0 ) {
+        // Nothing to map , an empty input is still a valid one
+        static const char kEmpty = 0;
+        m_data = &kEmpty;
+        close(fd);
+        return true;
+    }
+    void* data = mmap(NULL,m_size,PROT_READ,MAP_PRIVATE,fd,0);
+    close(fd);
+    if( data == MAP_FAILED ) {
+        m_size = 0;
+        return false;
+    }
+    m_data = static_cast<const char*>(data);
+    return true;
+}
+
+bool is_index_key( const FieldDescriptor* field ) {
+    if( field == NULL || field->is_repeated() ) {
+        return false;
+    }
+    switch( field->cpp_type() ) {
+        case FieldDescriptor::CPPTYPE_INT32:
+        case FieldDescriptor::CPPTYPE_INT64:
+        case FieldDescriptor::CPPTYPE_UINT32:
+        case FieldDescriptor::CPPTYPE_UINT64:
+        case FieldDescriptor::CPPTYPE_BOOL:
+        case FieldDescriptor::CPPTYPE_ENUM:
+        case FieldDescriptor::CPPTYPE_STRING:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool extract_field_key( const char* data , std::size_t size ,
+                        const std::vector<const FieldDescriptor*>& path ,
+                        std::string* key ) {
+    key->clear();
+    return !path.empty() && find_key(data,data + size,&path[0],0,path.size(),key);
+}
+
+void parse_index_key( const FieldDescriptor* field , const std::string& text ,
+                      std::string* key ) {
+    const EnumValueDescriptor* value = field->type() == FieldDescriptor::TYPE_ENUM ?
+        field->enum_type()->FindValueByName(text) : NULL;
+    if( value == NULL ) {
+        key->assign(text);
+        return;
+    }
+    char buf[::util::kIntegerBufferSize];
+    key->assign(buf,::util::FormatInt64(value->number(),buf));
+}
+
+void name_index_key( const FieldDescriptor* field , std::string* key ) {
+    if( field->type() != FieldDescriptor::TYPE_ENUM || key->empty() ) {
+        return;
+    }
+    char* end;
+    errno = 0;
+    const long long number = std::strtoll(key->c_str(),&end,10);
+    if( *end != 0 || errno != 0 || number < INT_MIN || number > INT_MAX ) {
+        return;
+    }
+    const EnumValueDescriptor* value =
+        field->enum_type()->FindValueByNumber(static_cast<int>(number));
+    if( value != NULL ) {
+        key->assign(value->name());
+    }
+}
+
+bool scan_records( const char* data , std::size_t size ,
+                   std::vector< std::pair<uint64_t,uint64_t> >* records ,
+                   std::string* error ) {
+    const char* p = data;
+    const char* end = data + size;
+    while( p < end ) {
+        uint64_t length;
+        const char* payload = get_varint(p,end,&length);
+        if( payload == NULL || static_cast<uint64_t>(end - payload) < length ) {
+            error->assign("Truncated record at offset ");
+            char offset[::util::kIntegerBufferSize];
+            error->append(offset,::util::FormatUInt64(p - data,offset));
+            return false;
+        }
+        records->push_back(std::make_pair(static_cast<uint64_t>(payload - data),length));
+        p = payload + length;
+    }
+    return true;
+}
+
+bool build_record_index( const char* data , std::size_t size ,
+                         const FieldDescriptor* key ,
+                         std::ostream& output , std::string* error ) {
+    // Record count is only known at the end , it is patched into the header
+    // once the offsets are streamed out.
+    const std::streampos start = output.tellp();
+    std::string buf;
+    buf.append(kMagic,4);
+    put_u32(&buf,kVersion);
+    put_u64(&buf,size);
+    put_u64(&buf,0);
+    put_u32(&buf,key == NULL ? 0 : static_cast<uint32_t>(key->number()));
+    put_u32(&buf,key == NULL ? 0 : static_cast<uint32_t>(key->type()));
+
+    std::vector<uint64_t> key_offset;
+    std::string key_data;
+    std::string scratch;
+    uint64_t count = 0;
+    const char* p = data;
+    const char* end = data + size;
+    while( p < end ) {
+        uint64_t length;
+        const char* payload = get_varint(p,end,&length);
+        if( payload == NULL || static_cast<uint64_t>(end - payload) < length ) {
+            error->assign("Truncated record at offset ");
+            char offset[::util::kIntegerBufferSize];
+            error->append(offset,::util::FormatUInt64(p - data,offset));
+            return false;
+        }
+        put_u64(&buf,p - data);
+        if( key != NULL ) {
+            key_offset.push_back(key_data.size());
+            extract_key(payload,payload + length,key,&scratch);
+            key_data.append(scratch);
+        }
+        ++count;
+        p = payload + length;
+        if( buf.size() >= kFlushSize ) {
+            output.write(buf.data(),buf.size());
+            buf.clear();
+        }
+    }
+    put_u64(&buf,size);
+
+    if( key != NULL ) {
+        key_offset.push_back(key_data.size());
+        for( std::size_t i = 0 ; i < key_offset.size() ; ++i ) {
+            put_u64(&buf,key_offset[i]);
+        }
+        std::vector<uint64_t> order(count);
+        for( uint64_t i = 0 ; i < count ; ++i ) {
+            order[i] = i;
+        }
+        std::sort(order.begin(),order.end(),key_less(key_offset,key_data));
+        for( uint64_t i = 0 ; i < count ; ++i ) {
+            put_u64(&buf,order[i]);
+        }
+        buf.append(key_data);
+    }
+    output.write(buf.data(),buf.size());
+
+    buf.clear();
+    put_u64(&buf,count);
+    output.seekp(start + static_cast<std::streamoff>(16));
+    output.write(buf.data(),buf.size());
+    output.seekp(0,std::ios_base::end);
+    output.flush();
+    if( !output.good() ) {
+        error->assign("Cannot write the index");
+        return false;
+    }
+    return true;
+}
+
+record_index::record_index():
+    m_file(),
+    m_count( 0 ),
+    m_key_number( 0 ),
+    m_offset( NULL ),
+    m_key_offset( NULL ),
+    m_key_order( NULL ),
+    m_key_data( NULL )
+{}
+
+bool record_index::open( const std::string& path , std::size_t input_size ,
+                         std::string* error ) {
+    if( !m_file.open(path) ) {
+        error->assign("Cannot open index file:" + path + " , build it with --build_index");
+        return false;
+    }
+    const char* data = m_file.data();
+    const std::size_t size = m_file.size();
+    if( size < kHeaderSize || std::memcmp(data,kMagic,4) != 0 ||
+        get_u32(data + 4) != kVersion ) {
+        error->assign("Not an index file:" + path);
+        return false;
+    }
+    if( get_u64(data + 8) != input_size ) {
+        error->assign("Index does not match the input , rebuild it:" + path);
+        return false;
+    }
+    m_count = get_u64(data + 16);
+    m_key_number = get_u32(data + 24);
+
+    // Every table must fit inside of the file before anything is read
+    uint64_t need = kHeaderSize + (m_count + 1) * 8;
+    if( m_key_number != 0 ) {
+        need += (m_count + 1) * 8 + m_count * 8;
+    }
+    if( m_count > size / 8 || need > size ) {
+        error->assign("Truncated index file:" + path);
+        return false;
+    }
+    m_offset = data + kHeaderSize;
+    if( m_key_number != 0 ) {
+        m_key_offset = m_offset + (m_count + 1) * 8;
+        m_key_order = m_key_offset + (m_count + 1) * 8;
+        m_key_data = m_key_order + m_count * 8;
+        if( read_u64(m_key_offset,m_count) > size - need ) {
+            error->assign("Truncated index file:" + path);
+            return false;
+        }
+    }
+    if( read_u64(m_offset,m_count) != input_size ) {
+        error->assign("Index does not match the input , rebuild it:" + path);
+        return false;
+    }
+    return true;
+}
+
+uint64_t record_index::read_u64( const char* base , uint64_t index ) const {
+    return get_u64(base + index * 8);
+}
+
+void record_index::record( const char* input , uint64_t index ,
+                           const char** data , std::size_t* size ) const {
+    const char* p = input + read_u64(m_offset,index);
+    const char* end = input + read_u64(m_offset,index + 1);
+    uint64_t length;
+    const char* payload = get_varint(p,end,&length);
+    if( payload == NULL || static_cast<uint64_t>(end - payload) != length ) {
+        // Offsets were checked against the input size only , a record which
+        // does not frame right is handed over empty.
+        *data = end;
+        *size = 0;
+        return;
+    }
+    *data = payload;
+    *size = static_cast<std::size_t>(length);
+}
+
+std::string record_index::key( uint64_t record ) const {
+    const uint64_t start = read_u64(m_key_offset,record);
+    return std::string(m_key_data + start,read_u64(m_key_offset,record + 1) - start);
+}
+
+void record_index::find( const std::string& value , std::vector<uint64_t>* records ) const {
+    records->clear();
+    if( m_key_number == 0 ) {
+        return;
+    }
+    // Lower bound of the key in the ordered table , then walk the equal run
+    uint64_t low = 0;
+    uint64_t high = m_count;
+    while( low < high ) {
+        const uint64_t mid = low + (high - low) / 2;
+        if( key(read_u64(m_key_order,mid)) < value ) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    for( ; low < m_count ; ++low ) {
+        const uint64_t record = read_u64(m_key_order,low);
+        if( key(record) != value ) {
+            break;
+        }
+        records->push_back(record);
+    }
+}
+
+} // namespace proto2json
@@ -0,0 +1,132 @@
+#ifndef _RECORD_INDEX_H_
+#define _RECORD_INDEX_H_
+#include <cstddef>
+#include <stdint.h>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <google/protobuf/descriptor.h>
+
+// =====================================================================
+// Record index
+// Sidecar of a delimited capture file , holding where every record
+// starts so a record could be reached without parsing the ones before
+// it. Building only walks the varint length prefixes and skips the
+// payloads ; when a key field is asked for , the top level tags of each
+// payload are scanned to pick up its value , still without parsing.
+//
+// File layout , every integer is little endian u64 unless noted :
+//   "P2JI" u32 version
+//   input size , record count N
+//   u32 key field number (0 when no key) , u32 key type
+//   offset * (N + 1)      record i spans [offset i , offset i+1) and
+//                         includes its length prefix
+// When there is a key :
+//   key offset * (N + 1)  key of record i spans the same way in key data
+//   record * N            record numbers ordered by key , then number
+//   key data
+// Key is kept as text : decimal for integer fields , the raw value for
+// string and bytes fields. Record without the field has an empty key.
+// =====================================================================
+
+namespace proto2json {
+
+// Read only memory map of a whole file
+class mapped_file {
+public:
+    mapped_file();
+    ~mapped_file();
+
+    bool open( const std::string& path );
+
+    const char* data() const { return m_data; }
+    std::size_t size() const { return m_size; }
+
+private:
+    const char* m_data;
+    std::size_t m_size;
+
+    void operator=( const mapped_file& );
+    mapped_file( const mapped_file& );
+};
+
+// Return false for a field which could not be an index key : it must be a
+// singular integer , enum , string or bytes field.
+bool is_index_key( const google::protobuf::FieldDescriptor* field );
+
+// Value of the field at the end of path in a serialized record , rendered
+// as an index key , without parsing the record. Every field of the path but
+// the last is a singular message field , the last one passes is_index_key.
+// A last field without presence , as a proto3 scalar , missing from the
+// record holds its default value , 0 or the empty string. Return false and
+// leave key empty if the record does not hold the field , or a submessage
+// of the path.
+bool extract_field_key( const char* data , std::size_t size ,
+                        const std::vector<const google::protobuf::FieldDescriptor*>& path ,
+                        std::string* key );
+
+// Index key of text as given on the command line. For an enum field the
+// name of one of its values stands for its number , which is what the index
+// keeps ; anything else is the key as it is.
+void parse_index_key( const google::protobuf::FieldDescriptor* field ,
+                      const std::string& text , std::string* key );
+
+// Replace an index key of an enum field , a number , by the name of its
+// value. A number the schema does not know is kept , and the key of any
+// other field is left as it is.
+void name_index_key( const google::protobuf::FieldDescriptor* field , std::string* key );
+
+// Payload of every delimited record of data , as its offset and size , only
+// walking the length prefixes. Return false and describe the problem in
+// error if the framing is broken.
+bool scan_records( const char* data , std::size_t size ,
+                   std::vector< std::pair<uint64_t,uint64_t> >* records ,
+                   std::string* error );
+
+// Index the delimited records of data into output. Key field is optional ,
+// NULL means no key. Return false and describe the problem in error if the
+// framing is broken.
+bool build_record_index( const char* data , std::size_t size ,
+                         const google::protobuf::FieldDescriptor* key ,
+                         std::ostream& output , std::string* error );
+
+class record_index {
+public:
+    record_index();
+
+    // Map the index file , input size is checked against the one indexed
+    // so a stale index is refused.
+    bool open( const std::string& path , std::size_t input_size , std::string* error );
+
+    uint64_t size() const { return m_count; }
+
+    // Serialized record , without its length prefix , inside of the input
+    void record( const char* input , uint64_t index ,
+                 const char** data , std::size_t* size ) const;
+
+    uint32_t key_number() const { return m_key_number; }
+
+    // Records whose key equals value , in record order
+    void find( const std::string& value , std::vector<uint64_t>* records ) const;
+
+private:
+    uint64_t read_u64( const char* base , uint64_t index ) const;
+    std::string key( uint64_t record ) const;
+
+    mapped_file m_file;
+    uint64_t m_count;
+    uint32_t m_key_number;
+    const char* m_offset;
+    const char* m_key_offset;
+    const char* m_key_order;
+    const char* m_key_data;
+
+    void operator=( const record_index& );
+    record_index( const record_index& );
+};
+
+} // namespace proto2json
+
+#endif // _RECORD_INDEX_H_
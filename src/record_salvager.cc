@@ -0,0 +1,274 @@
+#include "record_salvager.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <unistd.h>
+
+#include <google/protobuf/wire_format_lite.h>
+
+namespace proto2json {
+using namespace google::protobuf;
+
+record_salvager::record_salvager( const Descriptor* descriptor ,
+                                  const wire_validator& validator ,
+                                  int input , const std::string& name , std::ostream& log ):
+    m_validator( validator ),
+    m_input( input ),
+    m_name( name ),
+    m_log( log ),
+    m_buffer(),
+    m_begin( 0 ),
+    m_base( 0 ),
+    m_eof( false ),
+    m_failed( false ),
+    m_resynced( false ),
+    m_skipped_record( 0 ),
+    m_skipped_byte( 0 ),
+    m_doubtful( 0 )
+{
+    std::memset(m_known_tag,0,sizeof(m_known_tag));
+    std::memset(m_short_tag,0,sizeof(m_short_tag));
+    for( int i = 0 ; i < descriptor->field_count() ; ++i ) {
+        const FieldDescriptor* field = descriptor->field(i);
+        add_known_tag(field->number(),internal::WireFormatLite::WireTypeForFieldType(
+                static_cast<internal::WireFormatLite::FieldType>(field->type())));
+        if( field->is_packable() ) {
+            add_known_tag(field->number(),internal::WireFormatLite::WIRETYPE_LENGTH_DELIMITED);
+        }
+    }
+    // A one byte tag of a known field number must be one of its own , the
+    // other bytes only need a wire type which could start a field
+    for( int i = 0 ; i < 256 ; ++i ) {
+        const int wire_type = i & 7;
+        m_tag[i] = wire_type != internal::WireFormatLite::WIRETYPE_END_GROUP && wire_type < 6 &&
+                   (i >= 0x80 ? true : (i >> 3) != 0 &&
+                    (m_known_tag[i] || descriptor->FindFieldByNumber(i >> 3) == NULL));
+    }
+}
+
+void record_salvager::refused( uint64_t offset ) {
+    char buf[64];
+    snprintf(buf,sizeof(buf),":record at offset %llu does not convert , skipped\n",
+            static_cast<unsigned long long>(offset));
+    log(buf);
+    ++m_skipped_record;
+}
+
+void record_salvager::report() const {
+    if( m_skipped_record > 0 || m_skipped_byte > 0 ) {
+        char buf[192];
+        snprintf(buf,sizeof(buf),":skipped %llu malformed records and %llu bytes of broken framing ,"
+                " %llu records after a resync could be fragments\n",
+                static_cast<unsigned long long>(m_skipped_record),
+                static_cast<unsigned long long>(m_skipped_byte),
+                static_cast<unsigned long long>(m_doubtful));
+        log(buf);
+    }
+}
+
+void record_salvager::add_known_tag( int number , int wire_type ) {
+    const uint32_t tag = internal::WireFormatLite::MakeTag(number,
+            static_cast<internal::WireFormatLite::WireType>(wire_type));
+    // First byte of the tag varint. Only one byte tags tell a tail , the last
+    // byte of a longer one is a small number , too common among values.
+    m_known_tag[tag < 0x80 ? tag : ((tag & 0x7f) | 0x80)] = true;
+    if( tag < 0x80 ) {
+        m_short_tag[tag] = true;
+    }
+}
+
+void record_salvager::log( const char* what ) const {
+    m_log<<(m_name + what);
+}
+
+void record_salvager::compact() {
+    m_base += m_begin;
+    m_buffer.erase(0,m_begin);
+    m_begin = 0;
+}
+
+bool record_salvager::fill( std::size_t end ) {
+    while( m_buffer.size() < end && !m_eof ) {
+        const std::size_t used = m_buffer.size();
+        const std::size_t want = std::max(kReadSize,end - used);
+        m_buffer.resize(used + want);
+        ssize_t got;
+        do {
+            got = read(m_input,&m_buffer[used],want);
+        } while( got < 0 && errno == EINTR );
+        m_buffer.resize(used + (got > 0 ? got : 0));
+        if( got <= 0 ) {
+            m_eof = true;
+            m_failed = got < 0;
+        }
+    }
+    return m_buffer.size() >= end;
+}
+
+bool record_salvager::length_prefix( std::size_t pos , std::size_t* prefix , uint32_t* length ) {
+    fill(pos + 5);
+    const std::size_t available = std::min<std::size_t>(m_buffer.size() - pos,5);
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(m_buffer.data()) + pos;
+    uint64_t value = 0;
+    for( std::size_t i = 0 ; i < available ; ++i ) {
+        value |= static_cast<uint64_t>(p[i] & 0x7f) << (7 * i);
+        if( p[i] < 0x80 ) {
+            *prefix = i + 1;
+            *length = static_cast<uint32_t>(value);
+            return value <= kMaxRecordSize;
+        }
+    }
+    return false;
+}
+
+bool record_salvager::plausible( std::size_t pos , const bool* tag ) {
+    if( !fill(pos + 1) ) {
+        return m_buffer.size() == pos && !m_failed;
+    }
+    std::size_t prefix;
+    uint32_t length;
+    if( !length_prefix(pos,&prefix,&length) ) {
+        return false;
+    }
+    return length == 0 || (fill(pos + prefix + 1) &&
+            tag[static_cast<unsigned char>(m_buffer[pos + prefix])]);
+}
+
+bool record_salvager::candidate( std::size_t pos , std::size_t* end , int follow ) {
+    std::size_t prefix;
+    uint32_t length;
+    // An empty record is a valid frame , but a run of zero bytes would be
+    // nothing but empty records
+    if( !length_prefix(pos,&prefix,&length) || length == 0 ||
+            !fill(pos + prefix + 1) ||
+            !m_known_tag[static_cast<unsigned char>(m_buffer[pos + prefix])] ||
+            !fill(pos + prefix + length) ) {
+        return false;
+    }
+    wire_validator::failure fail;
+    *end = pos + prefix + length;
+    if( !m_validator.validate(m_buffer.data() + pos + prefix,length,&fail) ) {
+        return false;
+    }
+    std::size_t next_end;
+    return follow == 0 || (!fill(*end + 1) && m_buffer.size() == *end) ?
+            plausible(*end,m_known_tag) : candidate(*end,&next_end,follow - 1);
+}
+
+bool record_salvager::spanned( std::size_t end ) {
+    std::size_t candidate_end;
+    for( std::size_t pos = m_begin + 1 ; pos < end ; ++pos ) {
+        if( candidate(pos,&candidate_end,1) && candidate_end > end ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void record_salvager::resync() {
+    const uint64_t from = m_base + m_begin;
+    std::size_t pos = m_begin + 1;
+    std::size_t end;
+    // First candidate which looked like the tail of a record , and its end
+    std::size_t tail = std::string::npos;
+    std::size_t tail_end = 0;
+    while( fill(pos + 1) ) {
+        if( tail != std::string::npos && pos > tail_end ) {
+            pos = tail;
+            break;
+        }
+        if( candidate(pos,&end,kResyncFollow) ) {
+            if( !m_short_tag[static_cast<unsigned char>(m_buffer[pos - 1])] ) {
+                break;
+            }
+            if( tail == std::string::npos ) {
+                tail = pos;
+                tail_end = end;
+            }
+        }
+        // Keeps the byte before pos , which the tail test reads
+        if( ++pos - m_begin >= kReadSize && tail == std::string::npos ) {
+            m_begin = pos - 1;
+            compact();
+            pos = m_begin + 1;
+        }
+    }
+    if( m_failed ) {
+        return;
+    }
+    // At a candidate , or at the end of input unless a tail was found
+    if( pos >= m_buffer.size() && tail != std::string::npos ) {
+        pos = tail;
+    }
+    m_begin = std::min(pos,m_buffer.size());
+    m_resynced = true;
+    const uint64_t to = m_base + m_begin;
+    m_skipped_byte += to - from;
+    char buf[128];
+    snprintf(buf,sizeof(buf),":broken length prefix at offset %llu , skipped %llu bytes\n",
+            static_cast<unsigned long long>(from),static_cast<unsigned long long>(to - from));
+    log(buf);
+}
+
+bool record_salvager::next( const char** data , std::size_t* size , uint64_t* offset ) {
+    while( true ) {
+        if( m_begin >= kReadSize ) {
+            compact();
+        }
+        if( !fill(m_begin + 1) ) {
+            return false;
+        }
+        std::size_t prefix;
+        uint32_t length;
+        wire_validator::failure fail;
+        if( length_prefix(m_begin,&prefix,&length) && fill(m_begin + prefix + length) ) {
+            const std::size_t end = m_begin + prefix + length;
+            // Looking ahead could grow the buffer , the payload is located after
+            const bool framed = plausible(end,m_tag);
+            const bool zero_run = length == 0 && fill(end + 1) && m_buffer[end] == 0;
+            const bool valid = m_validator.validate(m_buffer.data() + m_begin + prefix,length,&fail);
+            // Not followed by a plausible frame , the record is still good unless
+            // its length prefix is the broken one ; the next call then finds the
+            // broken length prefix behind it
+            if( valid && !zero_run && (framed || !spanned(end)) ) {
+                *data = m_buffer.data() + m_begin + prefix;
+                *size = length;
+                *offset = m_base + m_begin;
+                m_begin = end;
+                if( m_resynced ) {
+                    // Frames chained behind a resync point are only likely ones , the
+                    // tail of a record could check out as well
+                    char buf[128];
+                    snprintf(buf,sizeof(buf),":record at offset %llu follows a resync , could be a fragment\n",
+                            static_cast<unsigned long long>(*offset));
+                    log(buf);
+                    ++m_doubtful;
+                    m_resynced = false;
+                }
+                return true;
+            }
+            // Refused , the framing is still trusted when a whole frame follows
+            // which does not look like the tail of a record , or a run of frames
+            // long enough for a resync
+            std::size_t next_end;
+            if( !valid && framed && (m_buffer.size() == end ||
+                    (candidate(end,&next_end,0) && !m_short_tag[static_cast<unsigned char>(m_buffer[end - 1])]) ||
+                    candidate(end,&next_end,kResyncFollow)) ) {
+                char buf[128];
+                snprintf(buf,sizeof(buf),":record at offset %llu is malformed , skipped:",
+                        static_cast<unsigned long long>(m_base + m_begin));
+                log((std::string(buf) + fail.reason + "\n").c_str());
+                ++m_skipped_record;
+                m_begin = end;
+                continue;
+            }
+        }
+        if( m_failed ) {
+            return false;
+        }
+        resync();
+    }
+}
+
+}// namespace proto2json
@@ -0,0 +1,127 @@
+#ifndef _RECORD_SALVAGER_H_
+#define _RECORD_SALVAGER_H_
+#include <cstddef>
+#include <stdint.h>
+#include <ostream>
+#include <string>
+
+#include <google/protobuf/descriptor.h>
+
+#include "wire_validator.h"
+
+// =====================================================================
+// Record salvager
+// Read delimited input which could be damaged , skipping what is
+// malformed. A frame is trusted when the validator accepts its payload
+// and a plausible frame follows it : the end of input , or a length
+// prefix and a well formed tag. The second test matters since a broken
+// length prefix could span several records , and records put together
+// still make a valid message. Such a span is told from a good record
+// followed by a broken length prefix by the frames inside of it : a
+// record starting inside of the span ends past it , while a submessage
+// which looks like a frame ends within. Empty records back to back are
+// not trusted either , they are what a run of zero bytes reads as , which
+// a crash leaves in a preallocated capture.
+//
+// When the payload is refused but a whole frame follows it , only that
+// record is skipped. Otherwise the length prefix itself is taken for
+// broken and the reader resynchronizes : it moves one byte at a time to
+// the next offset where a candidate frame and the kResyncFollow frames
+// behind it , three whole frames in a row , check out , with a stricter
+// test this time : every record must start with the tag of a known top
+// level field. The tail of a record , a submessage or even an integer
+// read as a length prefix , followed by the next record looks like a
+// frame too , so a candidate right behind a one byte tag is passed over
+// for one starting no later than where it ends. The tests are ordered by
+// cost , so most offsets are turned down by a varint decode and one table
+// lookup , and the validator only sees the few candidates left. Every
+// skip is written to the log as one line , with its offset in the input.
+// =====================================================================
+
+namespace proto2json {
+
+class record_salvager {
+public:
+    // Records are checked against descriptor by validator and read from the
+    // file descriptor input. Lines of the log start with name.
+    record_salvager( const google::protobuf::Descriptor* descriptor ,
+                     const wire_validator& validator ,
+                     int input , const std::string& name , std::ostream& log );
+
+    // Next record the validator accepts , with its offset in the input.
+    // Return false at the end of input or on a read error , see failed().
+    bool next( const char** data , std::size_t* size , uint64_t* offset );
+
+    // Log a record the caller refused after the validator accepted it
+    void refused( uint64_t offset );
+
+    // Log how much was skipped , if anything
+    void report() const;
+
+    bool failed() const { return m_failed; }
+
+private:
+    static const std::size_t kReadSize = 1 << 20;
+    // Longer length prefixes are taken for broken , which bounds how far one
+    // candidate reads ahead. It is the default limit protobuf used to apply.
+    static const uint32_t kMaxRecordSize = 64 << 20;
+    // Frames which must check out behind a candidate before reading resumes
+    // there. Two make a run of bytes inside a record passing for frames rare.
+    static const int kResyncFollow = 2;
+
+    void add_known_tag( int number , int wire_type );
+
+    // One line to the log , whole , so the lines of parallel inputs do not mix
+    void log( const char* what ) const;
+
+    // Read until the buffer holds end bytes. Return false if the input ends
+    // before , or on a read error.
+    bool fill( std::size_t end );
+
+    // Drop the bytes before m_begin , buffer positions held move with it
+    void compact();
+
+    // Decode the length prefix at pos into prefix and length. Return false if
+    // it is incomplete , longer than 5 bytes or beyond kMaxRecordSize.
+    bool length_prefix( std::size_t pos , std::size_t* prefix , uint32_t* length );
+
+    // Whether a frame could start at pos : the end of input , or a length
+    // prefix followed , for a non empty record , by a byte of tag , which is
+    // a tag of a known field when it comes from m_known_tag
+    bool plausible( std::size_t pos , const bool* tag );
+
+    // Whether a whole frame checks out at pos , for resynchronizing , end is
+    // where it ends. So must the follow frames behind it , up to the end of
+    // input , and a plausible frame behind those.
+    bool candidate( std::size_t pos , std::size_t* end , int follow );
+
+    // Whether a candidate frame starts inside of the frame at m_begin , which
+    // ends at end , and ends past it
+    bool spanned( std::size_t end );
+
+    // Skip from m_begin to the next candidate frame , or the end of input
+    void resync();
+
+    const wire_validator& m_validator;
+    int m_input;
+    std::string m_name;
+    std::ostream& m_log;
+    std::string m_buffer;
+    std::size_t m_begin;            // Buffer position of the next frame
+    uint64_t m_base;                // Input offset of the buffer start
+    bool m_eof;
+    bool m_failed;
+    bool m_resynced;                // No record accepted since the last resync
+    uint64_t m_skipped_record;
+    uint64_t m_skipped_byte;
+    uint64_t m_doubtful;            // Records accepted right after a resync
+    bool m_known_tag[256];          // First bytes of the tags of top level fields
+    bool m_tag[256];                // First bytes of well formed tags
+    bool m_short_tag[256];          // One byte tags of top level fields
+
+    void operator=( const record_salvager& );
+    record_salvager( const record_salvager& );
+};
+
+}// namespace proto2json
+#endif // _RECORD_SALVAGER_H_
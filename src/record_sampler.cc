@@ -0,0 +1,61 @@
+#include "record_sampler.h"
+#include <cmath>
+#include <algorithm>
+
+namespace proto2json {
+
+record_sampler::record_sampler( const option& opt ):
+    m_option( opt ),
+    m_random( std::random_device()() ),
+    m_seen( 0 ),
+    m_weight( 1 ),
+    m_reservoir()
+{
+    if( opt.count > 0 ) {
+        m_weight = std::exp(std::log(uniform())/opt.count);
+    }
+}
+
+uint64_t record_sampler::next_skip() {
+    if( m_option.every > 0 ) {
+        return m_seen == 0 ? 0 : m_option.every - 1;
+    } else if( m_option.sample > 0 ) {
+        return std::geometric_distribution<uint64_t>(m_option.sample)(m_random);
+    } else if( m_reservoir.size() < m_option.count ) {
+        return 0;
+    }
+    const double skip = std::floor(std::log(uniform())/std::log(1 - m_weight));
+    return skip >= 1.8e19 ? UINT64_MAX : static_cast<uint64_t>(skip);
+}
+
+bool record_sampler::take( uint64_t position , std::string* data ) {
+    ++m_seen;
+    if( !is_reservoir() ) {
+        return true;
+    }
+    std::size_t slot = m_reservoir.size();
+    if( slot < m_option.count ) {
+        m_reservoir.push_back(std::make_pair(position,std::string()));
+    } else {
+        slot = std::uniform_int_distribution<std::size_t>(0,slot-1)(m_random);
+        m_weight *= std::exp(std::log(uniform())/m_option.count);
+    }
+    m_reservoir[slot].first = position;
+    m_reservoir[slot].second.swap(*data);
+    return false;
+}
+
+std::vector< std::pair<uint64_t,std::string> >* record_sampler::reservoir() {
+    std::sort(m_reservoir.begin(),m_reservoir.end());
+    return &m_reservoir;
+}
+
+double record_sampler::uniform() {
+    double ret;
+    do {
+        ret = std::uniform_real_distribution<double>(0,1)(m_random);
+    } while( ret == 0 );
+    return ret;
+}
+
+}// namespace proto2json
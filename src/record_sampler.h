@@ -0,0 +1,71 @@
+#ifndef _RECORD_SAMPLER_H_
+#define _RECORD_SAMPLER_H_
+#include <cstddef>
+#include <stdint.h>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+// =====================================================================
+// Record sampler
+// Pick records of a delimited input by their position only , so the
+// records not picked are skipped by the framing without being parsed.
+// The sampler tells how many records to skip before the next one to
+// take :
+//  every    : a fixed stride.
+//  sample   : a geometric gap , the same as flipping a coin per record.
+//  count    : reservoir sampling with the gaps of Li's algorithm L. The
+//             first K records fill the reservoir , later ones replace a
+//             random slot , and the reservoir is handed out at the end in
+//             input order.
+// =====================================================================
+
+namespace proto2json {
+
+class record_sampler {
+public:
+    struct option {
+        double sample;          // Probability a record is picked , 0 for no sampling
+        uint64_t every;         // Pick every Nth record , 0 for no sampling
+        uint64_t count;         // Reservoir size , 0 for no sampling
+
+        option(): sample(0), every(0), count(0) {}
+    };
+
+    explicit record_sampler( const option& opt );
+
+    bool enabled() const {
+        return m_option.sample > 0 || m_option.every > 0 || m_option.count > 0;
+    }
+
+    bool is_reservoir() const {
+        return m_option.count > 0;
+    }
+
+    // Records to skip before the next record to take
+    uint64_t next_skip();
+
+    // Record number position is taken , return true if it should be written
+    // right away , otherwise it is kept in the reservoir.
+    bool take( uint64_t position , std::string* data );
+
+    // Reservoir in input order , once the input is exhausted
+    std::vector< std::pair<uint64_t,std::string> >* reservoir();
+
+private:
+    // Uniform in (0,1) , zero would blow the logarithm
+    double uniform();
+
+    option m_option;
+    std::mt19937_64 m_random;
+    uint64_t m_seen;
+    double m_weight;            // W of algorithm L
+    std::vector< std::pair<uint64_t,std::string> > m_reservoir;
+
+    void operator=( const record_sampler& );
+    record_sampler( const record_sampler& );
+};
+
+}// namespace proto2json
+#endif // _RECORD_SAMPLER_H_
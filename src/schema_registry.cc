@@ -0,0 +1,236 @@
+#include "schema_registry.h"
+#include <cstring>
+#include <algorithm>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace proto2json {
+
+namespace {
+
+inline bool is_word( char c ) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           (c >= '0' && c <= '9') || c == '_' || c == '.';
+}
+
+inline bool is_proto_file( const std::string& name ) {
+    static const char kSuffix[] = ".proto";
+    const std::size_t suffix = sizeof(kSuffix) - 1;
+    return name.size() > suffix &&
+           name.compare(name.size() - suffix,suffix,kSuffix) == 0;
+}
+
+bool read_file( const std::string& path , std::string* content ) {
+    const int fd = open(path.c_str(),O_RDONLY);
+    if( fd < 0 ) {
+        return false;
+    }
+    content->clear();
+    char buffer[65536];
+    ssize_t size;
+    while( (size = read(fd,buffer,sizeof(buffer))) > 0 ) {
+        content->append(buffer,size);
+    }
+    close(fd);
+    return size == 0;
+}
+
+// Next token of the schema text starting at p : a word , which includes
+// numbers and dotted names , or a single punctuation character. Comments
+// and string literals are skipped. Return false at the end of the text.
+bool next_token( const char** cursor , const char* end ,
+                 const char** token , std::size_t* size ) {
+    const char* p = *cursor;
+    while( p < end ) {
+        const char c = *p;
+        if( c == ' ' || c == '\t' || c == '\n' || c == '\r' ) {
+            ++p;
+        } else if( c == '/' && p + 1 < end && p[1] == '/' ) {
+            while( p < end && *p != '\n' ) {
+                ++p;
+            }
+        } else if( c == '/' && p + 1 < end && p[1] == '*' ) {
+            p += 2;
+            while( p + 1 < end && !(p[0] == '*' && p[1] == '/') ) {
+                ++p;
+            }
+            p = std::min(p + 2,end);
+        } else if( c == '"' || c == '\'' ) {
+            for( ++p ; p < end && *p != c ; ++p ) {
+                if( *p == '\\' ) {
+                    ++p;
+                }
+            }
+            p = std::min(p + 1,end);
+        } else if( is_word(c) ) {
+            const char* begin = p;
+            while( p < end && is_word(*p) ) {
+                ++p;
+            }
+            *token = begin;
+            *size = p - begin;
+            *cursor = p;
+            return true;
+        } else {
+            *token = p;
+            *size = 1;
+            *cursor = p + 1;
+            return true;
+        }
+    }
+    *cursor = end;
+    return false;
+}
+
+inline bool token_is( const char* token , std::size_t size , const char* word ) {
+    return std::strlen(word) == size && std::memcmp(token,word,size) == 0;
+}
+
+}// namespace
+
+schema_registry::schema_registry():
+    m_root(),
+    m_message(),
+    m_file_count( 0 )
+{}
+
+bool schema_registry::add_root( const std::string& directory , std::string* error ) {
+    std::string root(directory);
+    while( root.size() > 1 && root[root.size()-1] == '/' ) {
+        root.erase(root.size()-1);
+    }
+    m_root.push_back(root);
+    directory_set visited;
+    return scan_directory(static_cast<int>(m_root.size()) - 1,std::string(),&visited,error);
+}
+
+bool schema_registry::scan_directory( int root , const std::string& relative ,
+                                      directory_set* visited , std::string* error ) {
+    const std::string path = relative.empty() ? m_root[root] : m_root[root] + "/" + relative;
+    DIR* dir = opendir(path.c_str());
+    if( dir == NULL ) {
+        error->assign("Cannot open import directory:" + path);
+        return false;
+    }
+    // Links could make a cycle , stop where a directory comes back
+    struct stat self;
+    if( fstat(dirfd(dir),&self) != 0 ||
+        !visited->insert(std::make_pair(self.st_dev,self.st_ino)).second ) {
+        closedir(dir);
+        return true;
+    }
+    std::vector<std::string> names;
+    struct dirent* entry;
+    while( (entry = readdir(dir)) != NULL ) {
+        if( entry->d_name[0] != '.' ) {
+            names.push_back(entry->d_name);
+        }
+    }
+    closedir(dir);
+    // Sorted , so the file picked for a type declared twice in one root does
+    // not depend on the directory order
+    std::sort(names.begin(),names.end());
+
+    std::string content;
+    for( std::size_t i = 0 ; i < names.size() ; ++i ) {
+        const std::string name = relative.empty() ? names[i] : relative + "/" + names[i];
+        struct stat info;
+        if( stat((m_root[root] + "/" + name).c_str(),&info) != 0 ) {
+            continue;
+        }
+        if( S_ISDIR(info.st_mode) ) {
+            if( !scan_directory(root,name,visited,error) ) {
+                return false;
+            }
+        } else if( S_ISREG(info.st_mode) && is_proto_file(name) ) {
+            if( !read_file(m_root[root] + "/" + name,&content) ) {
+                error->assign("Cannot read schema file:" + m_root[root] + "/" + name);
+                return false;
+            }
+            scan_file(root,name,content);
+            ++m_file_count;
+        }
+    }
+    return true;
+}
+
+void schema_registry::scan_file( int root , const std::string& relative ,
+                                 const std::string& content ) {
+    // Every block pushes its message name , or an empty one for the blocks
+    // which are not messages : enum , service , oneof , extend and option
+    // values. The name comes from the word after "message" or "group".
+    std::string package;
+    std::vector<std::string> block;
+    std::string pending;
+    bool want_package = false;
+    bool want_name = false;
+
+    const char* cursor = content.data();
+    const char* end = cursor + content.size();
+    const char* token;
+    std::size_t size;
+    while( next_token(&cursor,end,&token,&size) ) {
+        if( is_word(*token) ) {
+            if( want_package ) {
+                package.assign(token,size);
+                want_package = false;
+            } else if( want_name ) {
+                pending.assign(token,size);
+                want_name = false;
+            } else if( block.empty() && token_is(token,size,"package") ) {
+                want_package = true;
+            } else if( token_is(token,size,"message") || token_is(token,size,"group") ) {
+                want_name = true;
+            }
+            continue;
+        }
+        want_name = false;
+        switch( *token ) {
+            case '{':
+                if( !pending.empty() ) {
+                    std::string name(package);
+                    for( std::size_t i = 0 ; i < block.size() ; ++i ) {
+                        if( !block[i].empty() ) {
+                            name.append(name.empty() ? "" : ".").append(block[i]);
+                        }
+                    }
+                    name.append(name.empty() ? "" : ".").append(pending);
+                    location& loc = m_message[name];
+                    if( loc.file.empty() ) {
+                        loc.root = root;
+                        loc.file = relative;
+                    }
+                }
+                block.push_back(pending);
+                pending.clear();
+                break;
+            case '}':
+                if( !block.empty() ) {
+                    block.pop_back();
+                }
+                pending.clear();
+                break;
+            case ';':
+                pending.clear();
+                want_package = false;
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+bool schema_registry::find( const std::string& message , std::string* file ,
+                            std::string* root ) const {
+    std::unordered_map<std::string,location>::const_iterator itr = m_message.find(message);
+    if( itr == m_message.end() ) {
+        return false;
+    }
+    file->assign(itr->second.file);
+    root->assign(m_root[itr->second.root]);
+    return true;
+}
+
+}// namespace proto2json
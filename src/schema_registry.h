@@ -0,0 +1,64 @@
+#ifndef _SCHEMA_REGISTRY_H_
+#define _SCHEMA_REGISTRY_H_
+#include <cstddef>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <sys/types.h>
+
+// =====================================================================
+// Schema registry
+// Index of the message types declared by the .proto files of a source
+// tree , so the one file declaring a type is found without importing
+// the whole tree. Files are not parsed : a token scan skips comments
+// and string literals , follows the package statement and the nesting
+// of blocks , and records the full name of every message and group it
+// opens. That is enough to name the declared types , the importer then
+// parses only the file found and what it imports.
+// Files are named relative to their root , as an import statement
+// names them. Symbolic links are followed , a directory reached twice ,
+// as through a link to one of its parents , is scanned once.
+// =====================================================================
+
+namespace proto2json {
+
+class schema_registry {
+public:
+    schema_registry();
+
+    // Index every .proto file under the directory , recursively. A type
+    // declared under several roots resolves to the root added first.
+    // Return false and describe the problem in error if it is unreadable.
+    bool add_root( const std::string& directory , std::string* error );
+
+    // File declaring the message type , relative to its root , and the root.
+    // Return false if no indexed file declares it.
+    bool find( const std::string& message , std::string* file , std::string* root ) const;
+
+    std::size_t file_count() const { return m_file_count; }
+
+private:
+    struct location {
+        int root;
+        std::string file;
+    };
+
+    typedef std::set< std::pair<dev_t,ino_t> > directory_set;
+
+    // Index the directory under the root , unless it is in visited already
+    bool scan_directory( int root , const std::string& relative ,
+                         directory_set* visited , std::string* error );
+    void scan_file( int root , const std::string& relative , const std::string& content );
+
+    std::vector<std::string> m_root;
+    std::unordered_map<std::string,location> m_message;
+    std::size_t m_file_count;
+
+    void operator=( const schema_registry& );
+    schema_registry( const schema_registry& );
+};
+
+}// namespace proto2json
+#endif // _SCHEMA_REGISTRY_H_
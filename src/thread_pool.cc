@@ -0,0 +1,113 @@
+#include "thread_pool.h"
+#include <cassert>
+
+namespace util {
+
+thread_pool::thread_pool( std::size_t thread_count ):
+    m_queue(),
+    m_thread(),
+    m_lock(),
+    m_wakeup(),
+    m_finish(),
+    m_batch(0),
+    m_pending(0),
+    m_shutdown(false) {
+    if( thread_count == 0 ) thread_count = 1;
+    for( std::size_t i = 0 ; i < thread_count ; ++i ) {
+        m_queue.push_back( new task_queue() );
+    }
+    for( std::size_t i = 0 ; i < thread_count ; ++i ) {
+        m_thread.push_back( std::thread(&thread_pool::worker,this,i) );
+    }
+}
+
+thread_pool::~thread_pool() {
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_shutdown = true;
+    }
+    m_wakeup.notify_all();
+    for( std::size_t i = 0 ; i < m_thread.size() ; ++i ) {
+        m_thread[i].join();
+    }
+    for( std::size_t i = 0 ; i < m_queue.size() ; ++i ) {
+        delete m_queue[i];
+    }
+}
+
+void thread_pool::run( std::vector<task>* tasks ) {
+    if( tasks->empty() ) return;
+    // Count the batch before publishing it : a worker still looking for
+    // work after the previous batch could take the first tasks right away
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        assert( m_pending == 0 );
+        m_pending = tasks->size();
+    }
+    const std::size_t size = m_queue.size();
+    for( std::size_t i = 0 ; i < tasks->size() ; ++i ) {
+        task_queue* q = m_queue[i % size];
+        std::lock_guard<std::mutex> guard(q->lock);
+        q->tasks.push_back( &((*tasks)[i]) );
+    }
+    // Workers are woken once every task is queued , so none of them could
+    // see the new batch , find the queues empty and sleep through it
+    std::unique_lock<std::mutex> guard(m_lock);
+    ++m_batch;
+    m_wakeup.notify_all();
+    while( m_pending != 0 ) {
+        m_finish.wait(guard);
+    }
+}
+
+thread_pool::task* thread_pool::pop( std::size_t index ) {
+    task_queue* q = m_queue[index];
+    std::lock_guard<std::mutex> guard(q->lock);
+    if( q->tasks.empty() ) return NULL;
+    task* ret = q->tasks.front();
+    q->tasks.pop_front();
+    return ret;
+}
+
+thread_pool::task* thread_pool::steal( std::size_t index ) {
+    const std::size_t size = m_queue.size();
+    for( std::size_t i = 1 ; i < size ; ++i ) {
+        task_queue* q = m_queue[(index+i) % size];
+        std::lock_guard<std::mutex> guard(q->lock);
+        if( !q->tasks.empty() ) {
+            task* ret = q->tasks.back();
+            q->tasks.pop_back();
+            return ret;
+        }
+    }
+    return NULL;
+}
+
+void thread_pool::worker( std::size_t index ) {
+    std::size_t batch = 0;
+    while( true ) {
+        {
+            std::unique_lock<std::mutex> guard(m_lock);
+            while( !m_shutdown && batch == m_batch ) {
+                m_wakeup.wait(guard);
+            }
+            if( m_shutdown ) return;
+            batch = m_batch;
+        }
+        std::size_t done = 0;
+        task* t;
+        while( (t = pop(index)) != NULL || (t = steal(index)) != NULL ) {
+            (*t)();
+            ++done;
+        }
+        if( done != 0 ) {
+            std::lock_guard<std::mutex> guard(m_lock);
+            m_pending -= done;
+            if( m_pending == 0 ) {
+                m_finish.notify_all();
+            }
+        }
+    }
+}
+
+}// namespace util
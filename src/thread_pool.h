@@ -0,0 +1,57 @@
+#ifndef _THREAD_POOL_H_
+#define _THREAD_POOL_H_
+#include <cstddef>
+#include <vector>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+namespace util {
+
+// A fixed size pool of worker threads with one task queue per worker. A batch
+// of tasks is dealt round robin into the queues , each worker drains its own
+// queue from the front and , once it runs dry , steals from the back of other
+// queues. Since dealing is round robin , a batch sorted by descending cost has
+// every worker start with the most expensive tasks it owns , while the cheap
+// tail gets balanced by stealing.
+class thread_pool {
+public:
+    typedef std::function<void()> task;
+
+    explicit thread_pool( std::size_t thread_count );
+    ~thread_pool();
+
+    // Run all the tasks and block until every one of them finished. Only one
+    // batch can be in flight at a time.
+    void run( std::vector<task>* tasks );
+
+    std::size_t thread_count() const { return m_queue.size(); }
+
+private:
+    struct task_queue {
+        std::mutex lock;
+        std::deque<task*> tasks;
+    };
+
+    void worker( std::size_t index );
+    task* pop( std::size_t index );
+    task* steal( std::size_t index );
+
+    std::vector<task_queue*> m_queue;
+    std::vector<std::thread> m_thread;
+
+    std::mutex m_lock;
+    std::condition_variable m_wakeup;   // New batch or shutdown
+    std::condition_variable m_finish;   // Batch done
+    std::size_t m_batch;                // Batch sequence , bumped by run()
+    std::size_t m_pending;              // Tasks of current batch not done yet
+    bool m_shutdown;
+
+    void operator=( const thread_pool& );
+    thread_pool( const thread_pool& );
+};
+
+}// namespace util
+#endif // _THREAD_POOL_H_
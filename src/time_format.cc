@@ -0,0 +1,125 @@
+#include "time_format.h"
+#include <cstring>
+
+#include "itoa.h"
+
+// =====================================================================
+// Timestamp formatting
+// Going through gmtime and strftime costs a libc call with its locale
+// and timezone handling for every value. Here the day number is turned
+// into a calendar date with the usual era arithmetic : a 400 years era
+// has a fixed length , and shifting the year to start in March moves
+// the leap day to the end of it , so year , month and day fall out of a
+// few divisions without any table or loop. The date is remembered with
+// its day number , so the next timestamp of the same day only formats
+// the time of day.
+// =====================================================================
+
+namespace {
+
+// 0001-01-01T00:00:00Z and 9999-12-31T23:59:59Z
+static const int64_t kMinTimestamp = -62135596800LL;
+static const int64_t kMaxTimestamp = 253402300799LL;
+// 10000 years of 365.25 days , as the proto3 json mapping bounds Duration
+static const int64_t kMaxDuration = 315576000000LL;
+static const int32_t kNanosPerSecond = 1000000000;
+
+inline char* Put2( int v , char* p ) {
+    p[0] = static_cast<char>('0' + v / 10);
+    p[1] = static_cast<char>('0' + v % 10);
+    return p + 2;
+}
+
+inline char* Put4( int v , char* p ) {
+    Put2(v / 100,p);
+    return Put2(v % 100,p + 2);
+}
+
+void FormatDate( int64_t day , char* p ) {
+    const int64_t z = day + 719468;
+    const int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    const int64_t doe = z - era * 146097;                                 // [0, 146096]
+    const int64_t yoe = (doe - doe/1460 + doe/36524 - doe/146096) / 365;  // [0, 399]
+    const int64_t doy = doe - (365*yoe + yoe/4 - yoe/100);                // [0, 365]
+    const int64_t mp = (5*doy + 2) / 153;                                 // [0, 11]
+    const int d = static_cast<int>(doy - (153*mp + 2)/5 + 1);
+    const int m = static_cast<int>(mp < 10 ? mp + 3 : mp - 9);
+    const int y = static_cast<int>(yoe + era * 400 + (m <= 2 ? 1 : 0));
+    p = Put4(y,p);
+    *p++ = '-';
+    p = Put2(m,p);
+    *p++ = '-';
+    p = Put2(d,p);
+    *p = 'T';
+}
+
+// Fraction with 3 , 6 or 9 digits , nothing for a whole second
+char* FormatNanos( int32_t nanos , char* p ) {
+    if( nanos == 0 ) {
+        return p;
+    }
+    int digits = 9;
+    if( nanos % 1000000 == 0 ) {
+        nanos /= 1000000;
+        digits = 3;
+    } else if( nanos % 1000 == 0 ) {
+        nanos /= 1000;
+        digits = 6;
+    }
+    *p++ = '.';
+    for( int i = digits - 1 ; i >= 0 ; --i ) {
+        p[i] = static_cast<char>('0' + nanos % 10);
+        nanos /= 10;
+    }
+    return p + digits;
+}
+
+}// namespace
+
+namespace util {
+
+char* FormatTimestamp( int64_t seconds , int32_t nanos , date_cache* cache , char* buffer ) {
+    if( seconds < kMinTimestamp || seconds > kMaxTimestamp ||
+        nanos < 0 || nanos >= kNanosPerSecond ) {
+        return NULL;
+    }
+    // Floor division , the range above keeps seconds + offset positive
+    const int64_t shifted = seconds - kMinTimestamp;
+    const int64_t day = shifted / 86400 + kMinTimestamp / 86400;
+    const int second_of_day = static_cast<int>(shifted % 86400);
+    if( cache->day != day ) {
+        FormatDate(day,cache->text);
+        cache->day = day;
+    }
+    char* p = buffer;
+    std::memcpy(p,cache->text,sizeof(cache->text));
+    p += sizeof(cache->text);
+    p = Put2(second_of_day / 3600,p);
+    *p++ = ':';
+    p = Put2(second_of_day / 60 % 60,p);
+    *p++ = ':';
+    p = Put2(second_of_day % 60,p);
+    p = FormatNanos(nanos,p);
+    *p++ = 'Z';
+    return p;
+}
+
+char* FormatDuration( int64_t seconds , int32_t nanos , char* buffer ) {
+    if( seconds < -kMaxDuration || seconds > kMaxDuration ||
+        nanos <= -kNanosPerSecond || nanos >= kNanosPerSecond ||
+        (seconds < 0 && nanos > 0) || (seconds > 0 && nanos < 0) ) {
+        return NULL;
+    }
+    char* p = buffer;
+    if( seconds < 0 || nanos < 0 ) {
+        *p++ = '-';
+        seconds = -seconds;
+        nanos = -nanos;
+    }
+    p = FormatUInt64(static_cast<uint64_t>(seconds),p);
+    p = FormatNanos(nanos,p);
+    *p++ = 's';
+    return p;
+}
+
+}// namespace util
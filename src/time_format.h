@@ -0,0 +1,30 @@
+#ifndef _TIME_FORMAT_H_
+#define _TIME_FORMAT_H_
+#include <cstddef>
+#include <stdint.h>
+namespace util {
+// Largest output of any routine below.
+static const std::size_t kTimeBufferSize = 32;
+
+// Date part of the last timestamp formatted. Timestamps of a record stream
+// mostly fall on the same day , the civil date is only computed again when
+// the day changes. Each thread keeps its own.
+struct date_cache {
+    int64_t day;        // Days since the epoch , INT64_MIN when empty
+    char text[11];      // "YYYY-MM-DDT"
+
+    date_cache(): day(INT64_MIN) {}
+};
+
+// Write the timestamp as RFC 3339 in UTC , like "1972-01-01T10:00:20.021Z" ,
+// with 0 , 3 , 6 or 9 fraction digits as needed. No terminating zero is
+// written. Return pointer to the end of the written characters , or NULL if
+// the time is outside of year 1 to 9999 or nanos outside of 0 to 999999999.
+char* FormatTimestamp( int64_t seconds , int32_t nanos , date_cache* cache , char* buffer );
+
+// Write the duration as seconds with the same fraction digits and a trailing
+// 's' , like "-3.000500s". Return NULL if it is longer than 10000 years or
+// the sign of nanos disagrees with the one of seconds.
+char* FormatDuration( int64_t seconds , int32_t nanos , char* buffer );
+}// namespace util
+#endif // _TIME_FORMAT_H_
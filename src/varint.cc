@@ -0,0 +1,91 @@
+#include "varint.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// =====================================================================
+// Packed varint decoding
+// The runtime decodes a packed field one varint at a time into its own
+// repeated field , and reflection then hands the values back one virtual
+// call each. Here the whole payload is decoded in one pass into a plain
+// array. With SSE2 the high bits of 16 bytes are gathered into a mask :
+// a chunk without any continuation bit is 16 single byte values and is
+// widened as is , which is the common case for small counters and
+// deltas ; otherwise the clear bits of the mask give where every varint
+// of the chunk ends , so each one is assembled without testing its bytes
+// for the end. The tail and other targets use the plain byte loop.
+// =====================================================================
+
+namespace {
+
+inline uint64_t Assemble( const unsigned char* p , int length ) {
+    uint64_t v = 0;
+    for( int i = 0 ; i < length ; ++i ) {
+        v |= static_cast<uint64_t>(p[i] & 0x7f) << (7 * i);
+    }
+    return v;
+}
+
+}// namespace
+
+namespace util {
+
+bool DecodePackedVarint( const char* input , std::size_t length , std::vector<uint64_t>* output ) {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(input);
+    const unsigned char* end = p + length;
+    // Never more values than bytes , so the output is grown once and written
+    // through a plain pointer.
+    const std::size_t base = output->size();
+    output->resize(base + length);
+    uint64_t* out = output->data() + base;
+
+#if defined(__SSE2__)
+    while( end - p >= 16 ) {
+        const uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(p))));
+        if( mask == 0 ) {
+            for( int i = 0 ; i < 16 ; ++i ) {
+                out[i] = p[i];
+            }
+            out += 16;
+            p += 16;
+            continue;
+        }
+        uint32_t ends = ~mask & 0xffff;
+        if( ends == 0 ) {
+            // Varint starting here runs over 16 bytes
+            return false;
+        }
+        int start = 0;
+        do {
+            const int stop = __builtin_ctz(ends);
+            if( stop - start >= 10 ) {
+                return false;
+            }
+            *out++ = Assemble(p + start,stop - start + 1);
+            start = stop + 1;
+            ends &= ends - 1;
+        } while( ends != 0 );
+        // The continuation bytes after the last end start a varint which is
+        // finished on the next round
+        p += start;
+    }
+#endif
+
+    while( p < end ) {
+        const unsigned char* start = p;
+        while( p < end && *p >= 0x80 ) {
+            ++p;
+        }
+        if( p == end || p - start >= 10 ) {
+            return false;
+        }
+        ++p;
+        *out++ = Assemble(start,static_cast<int>(p - start));
+    }
+    output->resize(out - output->data());
+    return true;
+}
+
+}// namespace util
@@ -0,0 +1,12 @@
+#ifndef _VARINT_H_
+#define _VARINT_H_
+#include <cstddef>
+#include <stdint.h>
+#include <vector>
+namespace util {
+// Decode the payload of a packed repeated varint field and append the values
+// to output. Return false if the payload does not hold whole varints of at
+// most 10 bytes , output then has an unspecified tail.
+bool DecodePackedVarint( const char* input , std::size_t length , std::vector<uint64_t>* output );
+}// namespace util
+#endif // _VARINT_H_
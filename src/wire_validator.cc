@@ -0,0 +1,401 @@
+#include "wire_validator.h"
+#include <climits>
+#include <algorithm>
+
+#include <google/protobuf/wire_format_lite.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace proto2json {
+using namespace google::protobuf;
+using google::protobuf::internal::WireFormatLite;
+
+namespace {
+
+// Same default as the parser
+static const int kMaxDepth = 100;
+
+// Field numbers below this are looked up directly , the rest by search
+static const uint32_t kDenseNumber = 64;
+
+// Read a varint of at most 10 bytes , return false if it is truncated or
+// longer.
+inline bool read_varint( const char** cursor , const char* end , uint64_t* value ) {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(*cursor);
+    const unsigned char* e = reinterpret_cast<const unsigned char*>(end);
+    // Most tags and lengths fit in one byte
+    if( p < e && *p < 0x80 ) {
+        *value = *p;
+        *cursor += 1;
+        return true;
+    }
+    uint64_t v = 0;
+    for( int i = 0 ; i < 10 && p < e ; ++i ) {
+        const unsigned char b = *p++;
+        v |= static_cast<uint64_t>(b & 0x7f) << (7 * i);
+        if( b < 0x80 ) {
+            *value = v;
+            *cursor = reinterpret_cast<const char*>(p);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Byte by byte check of packed varints , return the start of the first bad
+// varint or NULL.
+const char* find_bad_varint_slow( const char* begin , const char* end ) {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(begin);
+    const unsigned char* e = reinterpret_cast<const unsigned char*>(end);
+    while( p < e ) {
+        const unsigned char* start = p;
+        while( p < e && *p >= 0x80 ) {
+            ++p;
+        }
+        if( p == e || p - start >= 10 ) {
+            return reinterpret_cast<const char*>(start);
+        }
+        ++p;
+    }
+    return NULL;
+}
+
+// Packed varints are well formed when every run of continuation bytes is
+// shorter than 10 and the last byte ends a varint. With SSE2 the high bits
+// of 16 bytes are gathered into one mask and the runs are checked on it ;
+// the bytes are only walked one by one from the varint where a problem is
+// spotted , and for the tail.
+const char* find_bad_varint( const char* begin , const char* end ) {
+    const char* p = begin;
+#if defined(__SSE2__)
+    uint32_t run = 0;   // Continuation bytes right before p
+    while( end - p >= 16 ) {
+        const uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(p))));
+        if( mask == 0 ) {
+            run = 0;
+            p += 16;
+            continue;
+        }
+        // Runs of the chunk itself , bit i survives when bytes i to i+9 all
+        // continue
+        uint32_t long_run = mask;
+        for( int k = 1 ; k < 10 ; ++k ) {
+            long_run &= mask >> k;
+        }
+        const uint32_t head = static_cast<uint32_t>(__builtin_ctz(~mask));
+        if( long_run != 0 || run + head >= 10 ) {
+            break;
+        }
+        run = mask == 0xffff ? run + 16 :
+            static_cast<uint32_t>(__builtin_clz(~mask & 0xffff)) - 16;
+        p += 16;
+    }
+    p -= run;
+#endif
+    return find_bad_varint_slow(p,end);
+}
+
+// Return the first byte which is not part of valid UTF-8 or NULL. Overlong
+// forms , surrogates and code points above U+10FFFF are refused. ASCII runs
+// are skipped 16 bytes at a time with SSE2.
+const char* find_bad_utf8( const char* begin , const char* end ) {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(begin);
+    const unsigned char* e = reinterpret_cast<const unsigned char*>(end);
+    while( p < e ) {
+#if defined(__SSE2__)
+        while( e - p >= 16 &&
+               _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))) == 0 ) {
+            p += 16;
+        }
+        if( p == e ) {
+            break;
+        }
+#endif
+        const unsigned char c = *p;
+        if( c < 0x80 ) {
+            ++p;
+            continue;
+        }
+        int length;
+        unsigned char low = 0x80;   // Bounds of the second byte
+        unsigned char high = 0xbf;
+        if( c >= 0xc2 && c <= 0xdf ) {
+            length = 2;
+        } else if( c >= 0xe0 && c <= 0xef ) {
+            length = 3;
+            if( c == 0xe0 ) low = 0xa0;       // Overlong
+            if( c == 0xed ) high = 0x9f;      // Surrogate
+        } else if( c >= 0xf0 && c <= 0xf4 ) {
+            length = 4;
+            if( c == 0xf0 ) low = 0x90;       // Overlong
+            if( c == 0xf4 ) high = 0x8f;      // Above U+10FFFF
+        } else {
+            return reinterpret_cast<const char*>(p);
+        }
+        if( e - p < length || p[1] < low || p[1] > high ) {
+            return reinterpret_cast<const char*>(p);
+        }
+        for( int i = 2 ; i < length ; ++i ) {
+            if( (p[i] & 0xc0) != 0x80 ) {
+                return reinterpret_cast<const char*>(p);
+            }
+        }
+        p += length;
+    }
+    return NULL;
+}
+
+}// namespace
+
+struct wire_validator::rule {
+    uint32_t number;        // 0 for a number the schema does not know
+    uint8_t wire_type;      // Expected wire type
+    uint8_t packed;         // Packable : 1 for varint , 4 or 8 for fixed size
+    bool utf8;              // String which must be valid UTF-8
+    int message;            // Table of message or group field , -1 otherwise
+
+    rule(): number(0), wire_type(0), packed(0), utf8(false), message(-1) {}
+
+    bool operator<( const rule& that ) const { return number < that.number; }
+};
+
+struct wire_validator::table {
+    std::vector<rule> dense;    // By field number below kDenseNumber
+    std::vector<rule> sparse;   // The others , sorted by number
+
+    const rule* find( uint32_t number ) const {
+        if( number < dense.size() ) {
+            return dense[number].number == 0 ? NULL : &dense[number];
+        }
+        rule key;
+        key.number = number;
+        std::vector<rule>::const_iterator i =
+            std::lower_bound(sparse.begin(),sparse.end(),key);
+        return i == sparse.end() || i->number != number ? NULL : &*i;
+    }
+};
+
+wire_validator::wire_validator( const Descriptor* descriptor ):
+    m_table()
+{
+    std::map<const Descriptor*,int> built;
+    build(descriptor,&built);
+}
+
+wire_validator::~wire_validator() {}
+
+// Index of a type is reserved before its fields are looked at
+int wire_validator::build( const Descriptor* descriptor ,
+                           std::map<const Descriptor*,int>* built ) {
+    std::map<const Descriptor*,int>::iterator found = built->find(descriptor);
+    if( found != built->end() ) {
+        return found->second;
+    }
+    const int index = static_cast<int>(m_table.size());
+    (*built)[descriptor] = index;
+    m_table.push_back(table());
+
+    std::vector<const FieldDescriptor*> fields;
+    for( int i = 0 ; i < descriptor->field_count() ; ++i ) {
+        fields.push_back(descriptor->field(i));
+    }
+    descriptor->file()->pool()->FindAllExtensions(descriptor,&fields);
+
+    std::vector<rule> rules;
+    for( std::size_t i = 0 ; i < fields.size() ; ++i ) {
+        const FieldDescriptor* field = fields[i];
+        rule r;
+        r.number = static_cast<uint32_t>(field->number());
+        r.wire_type = static_cast<uint8_t>(WireFormatLite::WireTypeForFieldType(
+                static_cast<WireFormatLite::FieldType>(field->type())));
+        if( field->is_packable() ) {
+            switch( r.wire_type ) {
+                case WireFormatLite::WIRETYPE_VARINT:  r.packed = 1; break;
+                case WireFormatLite::WIRETYPE_FIXED32: r.packed = 4; break;
+                case WireFormatLite::WIRETYPE_FIXED64: r.packed = 8; break;
+                default: break;
+            }
+        }
+        r.utf8 = field->type() == FieldDescriptor::TYPE_STRING;
+        if( field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE ) {
+            r.message = build(field->message_type(),built);
+        }
+        rules.push_back(r);
+    }
+
+    table& t = m_table[index];
+    for( std::size_t i = 0 ; i < rules.size() ; ++i ) {
+        if( rules[i].number < kDenseNumber ) {
+            if( t.dense.size() <= rules[i].number ) {
+                t.dense.resize(rules[i].number + 1);
+            }
+            t.dense[rules[i].number] = rules[i];
+        } else {
+            t.sparse.push_back(rules[i]);
+        }
+    }
+    std::sort(t.sparse.begin(),t.sparse.end());
+    return index;
+}
+
+bool wire_validator::validate( const char* data , std::size_t size , failure* fail ) const {
+    const char* cursor = data;
+    bad_byte bad;
+    if( !check_message(0,&cursor,data+size,0,0,&bad) ) {
+        fail->offset = static_cast<std::size_t>(bad.at - data);
+        fail->reason = bad.reason;
+        return false;
+    }
+    return true;
+}
+
+bool wire_validator::validate_delimited( const char* data , std::size_t size ,
+                                         uint64_t* record , std::size_t* record_offset ,
+                                         failure* fail ) const {
+    const char* end = data + size;
+    const char* cursor = data;
+    bad_byte bad;
+    *record = 0;
+    while( cursor < end ) {
+        *record_offset = static_cast<std::size_t>(cursor - data);
+        uint64_t length;
+        bad.at = cursor;
+        if( !read_varint(&cursor,end,&length) ) {
+            bad.reason = "Truncated record length";
+        } else if( length > INT_MAX ) {
+            bad.reason = "Record length out of range";
+        } else if( length > static_cast<uint64_t>(end - cursor) ) {
+            bad.reason = "Record runs past the end of the input";
+        } else {
+            const char* record_end = cursor + length;
+            if( check_message(0,&cursor,record_end,0,0,&bad) ) {
+                ++*record;
+                continue;
+            }
+        }
+        fail->offset = static_cast<std::size_t>(bad.at - data);
+        fail->reason = bad.reason;
+        return false;
+    }
+    return true;
+}
+
+// Check fields up to end , or up to the end group tag when group is not 0.
+// Index -1 means a group unknown to the schema , whose fields are only
+// checked for framing.
+bool wire_validator::check_message( int index , const char** cursor , const char* end ,
+                                    int depth , uint32_t group , bad_byte* bad ) const {
+    if( depth > kMaxDepth ) {
+        bad->at = *cursor;
+        bad->reason = "Message nests too deep";
+        return false;
+    }
+    const table* t = index < 0 ? NULL : &m_table[index];
+    const char* p = *cursor;
+    while( p < end ) {
+        bad->at = p;
+        uint64_t tag;
+        if( !read_varint(&p,end,&tag) || tag > UINT32_MAX ) {
+            bad->reason = "Invalid tag";
+            return false;
+        }
+        const uint32_t number = static_cast<uint32_t>(tag >> 3);
+        const int wire_type = static_cast<int>(tag & 7);
+        if( number == 0 ) {
+            bad->reason = "Invalid field number 0";
+            return false;
+        }
+        if( wire_type == WireFormatLite::WIRETYPE_END_GROUP ) {
+            if( number != group ) {
+                bad->reason = "End group tag does not match";
+                return false;
+            }
+            *cursor = p;
+            return true;
+        }
+
+        const rule* r = t == NULL ? NULL : t->find(number);
+        if( r != NULL && wire_type != r->wire_type &&
+            !(r->packed != 0 && wire_type == WireFormatLite::WIRETYPE_LENGTH_DELIMITED) ) {
+            bad->reason = "Wire type does not match field type";
+            return false;
+        }
+
+        uint64_t value;
+        switch( wire_type ) {
+            case WireFormatLite::WIRETYPE_VARINT:
+                if( !read_varint(&p,end,&value) ) {
+                    bad->reason = "Truncated varint";
+                    return false;
+                }
+                break;
+            case WireFormatLite::WIRETYPE_FIXED64:
+            case WireFormatLite::WIRETYPE_FIXED32: {
+                const std::ptrdiff_t size =
+                    wire_type == WireFormatLite::WIRETYPE_FIXED64 ? 8 : 4;
+                if( end - p < size ) {
+                    bad->reason = "Truncated fixed size value";
+                    return false;
+                }
+                p += size;
+                break;
+            }
+            case WireFormatLite::WIRETYPE_LENGTH_DELIMITED:
+                if( !read_varint(&p,end,&value) || value > INT_MAX ) {
+                    bad->reason = "Invalid length";
+                    return false;
+                }
+                if( value > static_cast<uint64_t>(end - p) ) {
+                    bad->reason = "Length runs past the enclosing message";
+                    return false;
+                }
+                if( r != NULL && !check_length_delimited(*r,p,p+value,depth,bad) ) {
+                    return false;
+                }
+                p += value;
+                break;
+            case WireFormatLite::WIRETYPE_START_GROUP:
+                if( !check_message(r == NULL ? -1 : r->message,&p,end,depth+1,number,bad) ) {
+                    return false;
+                }
+                break;
+            default:
+                bad->reason = "Invalid wire type";
+                return false;
+        }
+    }
+    if( group != 0 ) {
+        bad->at = p;
+        bad->reason = "Missing end group tag";
+        return false;
+    }
+    *cursor = p;
+    return true;
+}
+
+bool wire_validator::check_length_delimited( const rule& r , const char* begin ,
+                                             const char* end , int depth ,
+                                             bad_byte* bad ) const {
+    if( r.packed == 1 ) {
+        bad->at = find_bad_varint(begin,end);
+        bad->reason = "Malformed varint in packed field";
+        return bad->at == NULL;
+    } else if( r.packed != 0 ) {
+        bad->at = begin;
+        bad->reason = "Packed field length is not a multiple of the value size";
+        return (end - begin) % r.packed == 0;
+    } else if( r.utf8 ) {
+        bad->at = find_bad_utf8(begin,end);
+        bad->reason = "Invalid UTF-8 in string field";
+        return bad->at == NULL;
+    } else if( r.message >= 0 ) {
+        const char* cursor = begin;
+        return check_message(r.message,&cursor,end,depth+1,0,bad);
+    }
+    return true;
+}
+
+}// namespace proto2json
@@ -0,0 +1,76 @@
+#ifndef _WIRE_VALIDATOR_H_
+#define _WIRE_VALIDATOR_H_
+#include <cstddef>
+#include <stdint.h>
+#include <map>
+#include <vector>
+
+#include <google/protobuf/descriptor.h>
+
+// =====================================================================
+// Wire validator
+// Check that serialized records are well formed against a schema without
+// parsing them into messages : every tag has a valid number and wire
+// type , the wire type of a known field matches its declared type ( or
+// is length delimited for a packable repeated field ) , lengths stay in
+// the bounds of the enclosing message , groups are balanced , packed
+// payloads hold whole values and strings are valid UTF-8. Fields unknown
+// to the schema are accepted , as the parser does.
+// Tables are built once from the descriptors and only read afterwards ,
+// so one validator is shared by every thread.
+// Bytes are scanned 16 at a time with SSE2 where it helps : the varints
+// of a packed field are checked by their continuation bits , and runs of
+// ASCII are skipped while validating UTF-8. Other targets use the plain
+// byte loop.
+// =====================================================================
+
+namespace proto2json {
+
+class wire_validator {
+public:
+    struct failure {
+        std::size_t offset;     // First bad byte , from the start of the data
+        const char* reason;
+    };
+
+    explicit wire_validator( const google::protobuf::Descriptor* descriptor );
+    ~wire_validator();
+
+    // Check one serialized record. Return false and describe the problem
+    // in fail if it is malformed.
+    bool validate( const char* data , std::size_t size , failure* fail ) const;
+
+    // Check a stream of varint length prefixed records. On failure , record
+    // is the number of the first bad one and record_offset where its length
+    // prefix starts. On success record is the number of records.
+    bool validate_delimited( const char* data , std::size_t size , uint64_t* record ,
+                             std::size_t* record_offset , failure* fail ) const;
+
+private:
+    struct rule;
+    struct table;
+
+    // Table of the type and of every type reachable from it , built holds
+    // the types done so far so recursive types refer back to their table.
+    int build( const google::protobuf::Descriptor* descriptor ,
+               std::map<const google::protobuf::Descriptor*,int>* built );
+
+    // Failure while checking , located by pointer until it is reported
+    struct bad_byte {
+        const char* at;
+        const char* reason;
+    };
+
+    bool check_message( int index , const char** cursor , const char* end ,
+                        int depth , uint32_t group , bad_byte* bad ) const;
+    bool check_length_delimited( const rule& r , const char* begin , const char* end ,
+                                 int depth , bad_byte* bad ) const;
+
+    std::vector<table> m_table;
+
+    void operator=( const wire_validator& );
+    wire_validator( const wire_validator& );
+};
+
+}// namespace proto2json
+#endif // _WIRE_VALIDATOR_H_
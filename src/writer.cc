@@ -0,0 +1,476 @@
+#include "writer.h"
+#include "base64.h"
+#include "itoa.h"
+#include <cstdio>
+#include <cstring>
+
+namespace proto2json {
+namespace {
+
+// =====================================================================
+// Json
+// The separator is driven by a single flag : any value or key written
+// right after another value of the same container needs a comma ahead.
+// Opening a container or writing a key clears the flag.
+// =====================================================================
+
+// Character needs escape , 0 means copy as is
+static const char kJsonEscape[256] = {
+    'u','u','u','u','u','u','u','u','b','t','n','u','f','r','u','u',
+    'u','u','u','u','u','u','u','u','u','u','u','u','u','u','u','u',
+    0,0,'"',0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,'\\',0,0,0,
+};
+
+class json_writer : public writer {
+public:
+    explicit json_writer( std::ostream& output ):
+        writer(output),
+        m_need_comma(false)
+    {}
+
+    virtual format type() const { return FORMAT_JSON; }
+
+    virtual void begin_record() { m_need_comma = false; }
+
+    virtual void begin_object( std::size_t ) { open('{'); }
+    virtual void end_object() { close('}'); }
+    virtual void begin_array( std::size_t ) { open('['); }
+    virtual void end_array() { close(']'); }
+
+    virtual void encode_key( const std::string& name , std::string* output ) const {
+        output->push_back('"');
+        escape(name,output);
+        output->append("\":",2);
+    }
+
+    virtual void encoded_key( const std::string& key ) {
+        comma();
+        m_output.write(key.data(),key.size());
+        m_need_comma = false;
+    }
+
+    virtual void null_value() { literal("null",4); }
+    virtual void bool_value( bool value ) {
+        if( value ) literal("true",4); else literal("false",5);
+    }
+
+    // Integer is formatted into a stack buffer , the quotes included , and
+    // then written with a single call to the output.
+    virtual void int_value( int64_t value , bool quote ) {
+        char buf[::util::kIntegerBufferSize+2];
+        char* end = buf;
+        if( quote ) *end++ = '"';
+        end = ::util::FormatInt64(value,end);
+        if( quote ) *end++ = '"';
+        literal(buf,end-buf);
+    }
+
+    virtual void uint_value( uint64_t value , bool quote ) {
+        char buf[::util::kIntegerBufferSize+2];
+        char* end = buf;
+        if( quote ) *end++ = '"';
+        end = ::util::FormatUInt64(value,end);
+        if( quote ) *end++ = '"';
+        literal(buf,end-buf);
+    }
+
+    virtual void float_value( float value , bool quote ) {
+        comma();
+        if( quote ) {
+            real_to_string(value);
+        } else {
+            m_output << value;
+        }
+        m_need_comma = true;
+    }
+
+    virtual void double_value( double value , bool quote ) {
+        comma();
+        if( quote ) {
+            real_to_string(value);
+        } else {
+            m_output << value;
+        }
+        m_need_comma = true;
+    }
+
+    virtual void string_value( const std::string& value ) {
+        m_buffer.clear();
+        m_buffer.push_back('"');
+        escape(value,&m_buffer);
+        m_buffer.push_back('"');
+        literal(m_buffer.data(),m_buffer.size());
+    }
+
+    virtual void bytes_value( const std::string& value ) {
+        m_buffer.clear();
+        if( !value.empty() ) {
+            ::util::Base64Encode(value.c_str(),value.size(),&m_buffer);
+        }
+        comma();
+        m_output<<'"';
+        m_output.write(m_buffer.data(),m_buffer.size());
+        m_output<<'"';
+        m_need_comma = true;
+    }
+
+    virtual void raw_value( const std::string& data ) {
+        if( data.empty() ) return;
+        literal(data.data(),data.size());
+    }
+
+private:
+    void comma() {
+        if( m_need_comma ) m_output<<',';
+    }
+    void open( char c ) {
+        comma();
+        m_output<<c;
+        m_need_comma = false;
+    }
+    void close( char c ) {
+        m_output<<c;
+        m_need_comma = true;
+    }
+    void literal( const char* data , std::size_t size ) {
+        comma();
+        m_output.write(data,size);
+        m_need_comma = true;
+    }
+    void real_to_string( double value ) {
+        char buf[1024];
+        snprintf(buf,sizeof(buf),"\"%f\"",value);
+        m_output<<buf;
+    }
+
+    // Most string needs no escape at all , so runs of plain characters are
+    // appended in one go.
+    static void escape( const std::string& value , std::string* output ) {
+        const char* start = value.data();
+        const char* end = start + value.size();
+        const char* run = start;
+        for( const char* p = start ; p != end ; ++p ) {
+            const char e = kJsonEscape[static_cast<unsigned char>(*p)];
+            if( e == 0 ) continue;
+            output->append(run,p-run);
+            output->push_back('\\');
+            if( e == 'u' ) {
+                static const char kHex[] = "0123456789abcdef";
+                const unsigned char c = static_cast<unsigned char>(*p);
+                output->append("u00",3);
+                output->push_back(kHex[c>>4]);
+                output->push_back(kHex[c&15]);
+            } else {
+                output->push_back(e);
+            }
+            run = p + 1;
+        }
+        output->append(run,end-run);
+    }
+
+    bool m_need_comma;
+    std::string m_buffer;
+};
+
+// Big endian helpers shared by msgpack and cbor
+inline void put_be16( char* buf , uint16_t v ) {
+    buf[0] = static_cast<char>(v>>8);
+    buf[1] = static_cast<char>(v);
+}
+inline void put_be32( char* buf , uint32_t v ) {
+    put_be16(buf,static_cast<uint16_t>(v>>16));
+    put_be16(buf+2,static_cast<uint16_t>(v));
+}
+inline void put_be64( char* buf , uint64_t v ) {
+    put_be32(buf,static_cast<uint32_t>(v>>32));
+    put_be32(buf+4,static_cast<uint32_t>(v));
+}
+
+// =====================================================================
+// MessagePack
+// =====================================================================
+class msgpack_writer : public writer {
+public:
+    explicit msgpack_writer( std::ostream& output ): writer(output) {}
+
+    virtual format type() const { return FORMAT_MSGPACK; }
+    virtual void begin_record() {}
+
+    virtual void begin_object( std::size_t size ) {
+        header(size,0x80,16,0xde,0xdf);
+    }
+    virtual void end_object() {}
+    virtual void begin_array( std::size_t size ) {
+        header(size,0x90,16,0xdc,0xdd);
+    }
+    virtual void end_array() {}
+
+    virtual void encode_key( const std::string& name , std::string* output ) const {
+        char buf[5];
+        output->append(buf,str_header(name.size(),buf));
+        output->append(name);
+    }
+    virtual void encoded_key( const std::string& key ) {
+        m_output.write(key.data(),key.size());
+    }
+
+    virtual void null_value() { m_output.put(static_cast<char>(0xc0)); }
+    virtual void bool_value( bool value ) {
+        m_output.put(static_cast<char>(value ? 0xc3 : 0xc2));
+    }
+
+    virtual void int_value( int64_t value , bool ) {
+        if( value >= 0 ) {
+            uint_value(static_cast<uint64_t>(value),false);
+            return;
+        }
+        char buf[9];
+        if( value >= -32 ) {
+            buf[0] = static_cast<char>(value);
+            m_output.write(buf,1);
+        } else if( value >= -128 ) {
+            buf[0] = static_cast<char>(0xd0);
+            buf[1] = static_cast<char>(value);
+            m_output.write(buf,2);
+        } else if( value >= -32768 ) {
+            buf[0] = static_cast<char>(0xd1);
+            put_be16(buf+1,static_cast<uint16_t>(value));
+            m_output.write(buf,3);
+        } else if( value >= -2147483647LL - 1 ) {
+            buf[0] = static_cast<char>(0xd2);
+            put_be32(buf+1,static_cast<uint32_t>(value));
+            m_output.write(buf,5);
+        } else {
+            buf[0] = static_cast<char>(0xd3);
+            put_be64(buf+1,static_cast<uint64_t>(value));
+            m_output.write(buf,9);
+        }
+    }
+
+    virtual void uint_value( uint64_t value , bool ) {
+        char buf[9];
+        if( value < 128 ) {
+            buf[0] = static_cast<char>(value);
+            m_output.write(buf,1);
+        } else if( value < 256 ) {
+            buf[0] = static_cast<char>(0xcc);
+            buf[1] = static_cast<char>(value);
+            m_output.write(buf,2);
+        } else if( value < 65536 ) {
+            buf[0] = static_cast<char>(0xcd);
+            put_be16(buf+1,static_cast<uint16_t>(value));
+            m_output.write(buf,3);
+        } else if( value <= 0xffffffffu ) {
+            buf[0] = static_cast<char>(0xce);
+            put_be32(buf+1,static_cast<uint32_t>(value));
+            m_output.write(buf,5);
+        } else {
+            buf[0] = static_cast<char>(0xcf);
+            put_be64(buf+1,value);
+            m_output.write(buf,9);
+        }
+    }
+
+    virtual void float_value( float value , bool ) {
+        char buf[5];
+        uint32_t bits;
+        std::memcpy(&bits,&value,4);
+        buf[0] = static_cast<char>(0xca);
+        put_be32(buf+1,bits);
+        m_output.write(buf,5);
+    }
+
+    virtual void double_value( double value , bool ) {
+        char buf[9];
+        uint64_t bits;
+        std::memcpy(&bits,&value,8);
+        buf[0] = static_cast<char>(0xcb);
+        put_be64(buf+1,bits);
+        m_output.write(buf,9);
+    }
+
+    virtual void string_value( const std::string& value ) {
+        char buf[5];
+        m_output.write(buf,str_header(value.size(),buf));
+        m_output.write(value.data(),value.size());
+    }
+
+    virtual void bytes_value( const std::string& value ) {
+        char buf[5];
+        std::size_t size;
+        if( value.size() < 256 ) {
+            buf[0] = static_cast<char>(0xc4);
+            buf[1] = static_cast<char>(value.size());
+            size = 2;
+        } else if( value.size() < 65536 ) {
+            buf[0] = static_cast<char>(0xc5);
+            put_be16(buf+1,static_cast<uint16_t>(value.size()));
+            size = 3;
+        } else {
+            buf[0] = static_cast<char>(0xc6);
+            put_be32(buf+1,static_cast<uint32_t>(value.size()));
+            size = 5;
+        }
+        m_output.write(buf,size);
+        m_output.write(value.data(),value.size());
+    }
+
+    virtual void raw_value( const std::string& data ) {
+        m_output.write(data.data(),data.size());
+    }
+
+private:
+    static std::size_t str_header( std::size_t size , char* buf ) {
+        if( size < 32 ) {
+            buf[0] = static_cast<char>(0xa0 | size);
+            return 1;
+        } else if( size < 256 ) {
+            buf[0] = static_cast<char>(0xd9);
+            buf[1] = static_cast<char>(size);
+            return 2;
+        } else if( size < 65536 ) {
+            buf[0] = static_cast<char>(0xda);
+            put_be16(buf+1,static_cast<uint16_t>(size));
+            return 3;
+        }
+        buf[0] = static_cast<char>(0xdb);
+        put_be32(buf+1,static_cast<uint32_t>(size));
+        return 5;
+    }
+
+    void header( std::size_t size , unsigned char fix , std::size_t fix_limit ,
+                 unsigned char b16 , unsigned char b32 ) {
+        char buf[5];
+        if( size < fix_limit ) {
+            buf[0] = static_cast<char>(fix | size);
+            m_output.write(buf,1);
+        } else if( size < 65536 ) {
+            buf[0] = static_cast<char>(b16);
+            put_be16(buf+1,static_cast<uint16_t>(size));
+            m_output.write(buf,3);
+        } else {
+            buf[0] = static_cast<char>(b32);
+            put_be32(buf+1,static_cast<uint32_t>(size));
+            m_output.write(buf,5);
+        }
+    }
+};
+
+// =====================================================================
+// CBOR
+// Every item starts with a major type in the top 3 bits and a length or
+// value encoded in the rest , as in RFC 8949.
+// =====================================================================
+class cbor_writer : public writer {
+public:
+    explicit cbor_writer( std::ostream& output ): writer(output) {}
+
+    virtual format type() const { return FORMAT_CBOR; }
+    virtual void begin_record() {}
+
+    virtual void begin_object( std::size_t size ) { head(5,size); }
+    virtual void end_object() {}
+    virtual void begin_array( std::size_t size ) { head(4,size); }
+    virtual void end_array() {}
+
+    virtual void encode_key( const std::string& name , std::string* output ) const {
+        char buf[9];
+        output->append(buf,encode_head(3,name.size(),buf));
+        output->append(name);
+    }
+    virtual void encoded_key( const std::string& key ) {
+        m_output.write(key.data(),key.size());
+    }
+
+    virtual void null_value() { m_output.put(static_cast<char>(0xf6)); }
+    virtual void bool_value( bool value ) {
+        m_output.put(static_cast<char>(value ? 0xf5 : 0xf4));
+    }
+    virtual void int_value( int64_t value , bool ) {
+        if( value >= 0 ) {
+            head(0,static_cast<uint64_t>(value));
+        } else {
+            head(1,static_cast<uint64_t>(-1 - value));
+        }
+    }
+    virtual void uint_value( uint64_t value , bool ) { head(0,value); }
+
+    virtual void float_value( float value , bool ) {
+        char buf[5];
+        uint32_t bits;
+        std::memcpy(&bits,&value,4);
+        buf[0] = static_cast<char>(0xfa);
+        put_be32(buf+1,bits);
+        m_output.write(buf,5);
+    }
+    virtual void double_value( double value , bool ) {
+        char buf[9];
+        uint64_t bits;
+        std::memcpy(&bits,&value,8);
+        buf[0] = static_cast<char>(0xfb);
+        put_be64(buf+1,bits);
+        m_output.write(buf,9);
+    }
+    virtual void string_value( const std::string& value ) {
+        head(3,value.size());
+        m_output.write(value.data(),value.size());
+    }
+    virtual void bytes_value( const std::string& value ) {
+        head(2,value.size());
+        m_output.write(value.data(),value.size());
+    }
+    virtual void raw_value( const std::string& data ) {
+        m_output.write(data.data(),data.size());
+    }
+
+private:
+    static std::size_t encode_head( int major , uint64_t value , char* buf ) {
+        const unsigned char m = static_cast<unsigned char>(major << 5);
+        if( value < 24 ) {
+            buf[0] = static_cast<char>(m | value);
+            return 1;
+        } else if( value < 256 ) {
+            buf[0] = static_cast<char>(m | 24);
+            buf[1] = static_cast<char>(value);
+            return 2;
+        } else if( value < 65536 ) {
+            buf[0] = static_cast<char>(m | 25);
+            put_be16(buf+1,static_cast<uint16_t>(value));
+            return 3;
+        } else if( value <= 0xffffffffu ) {
+            buf[0] = static_cast<char>(m | 26);
+            put_be32(buf+1,static_cast<uint32_t>(value));
+            return 5;
+        }
+        buf[0] = static_cast<char>(m | 27);
+        put_be64(buf+1,value);
+        return 9;
+    }
+    void head( int major , uint64_t value ) {
+        char buf[9];
+        m_output.write(buf,encode_head(major,value,buf));
+    }
+};
+
+}// namespace
+
+writer* writer::create( format fmt , std::ostream& output ) {
+    switch( fmt ) {
+        case FORMAT_JSON:    return new json_writer(output);
+        case FORMAT_MSGPACK: return new msgpack_writer(output);
+        case FORMAT_CBOR:    return new cbor_writer(output);
+        default:             return NULL;
+    }
+}
+
+writer* writer::create( const std::string& format , std::ostream& output ) {
+    if( format == "json" ) return create(FORMAT_JSON,output);
+    if( format == "msgpack" ) return create(FORMAT_MSGPACK,output);
+    if( format == "cbor" ) return create(FORMAT_CBOR,output);
+    return NULL;
+}
+
+}// namespace proto2json
@@ -0,0 +1,84 @@
+#ifndef _WRITER_H_
+#define _WRITER_H_
+#include <cstddef>
+#include <stdint.h>
+#include <ostream>
+#include <string>
+
+// =====================================================================
+// Writer
+// The converter walks a message and describes it as a tree of objects ,
+// arrays and scalar values through this interface. Each output format
+// has its own writer , so json and the binary json like formats share
+// exactly the same traversal.
+// Object and array take their element count up front , since msgpack
+// and cbor write it in the header ; only the json writer ignores it.
+// Key is encoded once through encode_key() and then emitted with
+// encoded_key() , so caller could cache the encoded form per field.
+// =====================================================================
+
+namespace proto2json {
+
+class writer {
+public:
+    enum format {
+        FORMAT_JSON ,
+        FORMAT_MSGPACK ,
+        FORMAT_CBOR
+    };
+
+    // Return NULL for unknown format name
+    static writer* create( const std::string& format , std::ostream& output );
+    static writer* create( format fmt , std::ostream& output );
+
+    explicit writer( std::ostream& output ): m_output(output) {}
+    virtual ~writer() {}
+
+    virtual format type() const = 0;
+
+    // New writer of the same format on another output
+    writer* clone( std::ostream& output ) const { return create(type(),output); }
+
+    // Start a new top level value
+    virtual void begin_record() = 0;
+
+    virtual void begin_object( std::size_t size ) = 0;
+    virtual void end_object() = 0;
+    virtual void begin_array( std::size_t size ) = 0;
+    virtual void end_array() = 0;
+
+    virtual void encode_key( const std::string& name , std::string* output ) const = 0;
+    virtual void encoded_key( const std::string& key ) = 0;
+    void key( const std::string& name ) {
+        std::string buf;
+        encode_key(name,&buf);
+        encoded_key(buf);
+    }
+
+    // The quote flag asks for the value to be written as a string , which
+    // only means something to json. Binary format always keeps native type.
+    virtual void null_value() = 0;
+    virtual void bool_value( bool value ) = 0;
+    virtual void int_value( int64_t value , bool quote ) = 0;
+    virtual void uint_value( uint64_t value , bool quote ) = 0;
+    virtual void float_value( float value , bool quote ) = 0;
+    virtual void double_value( double value , bool quote ) = 0;
+    virtual void string_value( const std::string& value ) = 0;
+    virtual void bytes_value( const std::string& value ) = 0;
+
+    // Append a run of array elements already encoded by a clone of this
+    // writer , used to join the buffers of parallel shards.
+    virtual void raw_value( const std::string& data ) = 0;
+
+    std::ostream& output() { return m_output; }
+
+protected:
+    std::ostream& m_output;
+
+private:
+    void operator=( const writer& );
+    writer( const writer& );
+};
+
+}// namespace proto2json
+#endif // _WRITER_H_